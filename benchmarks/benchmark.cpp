@@ -0,0 +1,1647 @@
+//
+// Benchmarks the containers under contention, next to a std::mutex wrapped standard container and (for the queue) a
+// Michael-Scott lock-free queue. The library is header only, so the benchmark is built directly,
+//
+//     g++ -std=c++14 -O2 -pthread benchmarks/benchmark.cpp -o ccl_benchmark
+//
+// Run it with --help for the available options. With --verify it instead stresses the containers and checks that no
+// value is lost, duplicated or reordered, which is best combined with -fsanitize=thread.
+// Built with -DCCL_ENABLE_STATS, --verify also checks that the statistics of the containers account for every
+// operation made.
+//
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <stack>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../ccl.hpp"
+
+namespace ccl_benchmark {
+    std::size_t const LATENCY_SAMPLE_INTERVAL = 8; // Every 8th operation of a thread has its latency measured
+
+    using clock = std::chrono::steady_clock;
+
+    /**
+     * Value of a configurable size that is stored in the containers.
+     */
+    template<std::size_t SIZE>
+    struct payload {
+        static_assert(SIZE >= sizeof(std::uint64_t), "Payloads must be able to hold their seed");
+
+        std::array<std::uint8_t, SIZE> bytes;
+
+        payload()
+            : bytes() {
+        }
+
+        explicit payload(std::uint64_t seed) {
+            bytes.fill(static_cast<std::uint8_t>(seed));
+            std::memcpy(bytes.data(), &seed, sizeof(seed));
+        }
+
+        std::uint64_t seed() const {
+            std::uint64_t value;
+            std::memcpy(&value, bytes.data(), sizeof(value));
+            return value;
+        }
+
+        /**
+         * Orders payloads by their seed, for the priority queues.
+         */
+        bool operator<(payload const& other) const {
+            return seed() < other.seed();
+        }
+    };
+
+    /**
+     * Draws keys in [0, count) where key k is drawn with a probability proportional to 1 / (k + 1)^exponent. An
+     * exponent of 0 gives a uniform distribution.
+     */
+    class zipf_distribution {
+    private:
+        std::vector<double> cumulative;
+
+    public:
+        zipf_distribution(std::size_t count, double exponent)
+            : cumulative(count) {
+            double sum = 0.0;
+            for (std::size_t rank = 0; rank < count; ++rank) {
+                sum += 1.0 / std::pow(static_cast<double>(rank + 1), exponent);
+                cumulative[rank] = sum;
+            }
+            for (auto& probability : cumulative) {
+                probability /= sum;
+            }
+        }
+
+        template<typename RANDOM>
+        std::size_t operator()(RANDOM& random) const {
+            auto point = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+            auto rank = std::lower_bound(cumulative.begin(), cumulative.end(), point) - cumulative.begin();
+            return std::min(static_cast<std::size_t>(rank), cumulative.size() - 1);
+        }
+    };
+
+    /**
+     * std::stack behind a single mutex.
+     */
+    template<typename T>
+    class mutex_stack {
+    private:
+        std::mutex mutex;
+        std::stack<T, std::vector<T>> values;
+
+    public:
+        void push(T value) {
+            std::lock_guard<std::mutex> lock(mutex);
+            values.push(std::move(value));
+        }
+
+        bool try_pop(T& value) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (values.empty()) return false;
+
+            value = std::move(values.top());
+            values.pop();
+            return true;
+        }
+    };
+
+    /**
+     * std::queue behind a single mutex.
+     */
+    template<typename T>
+    class mutex_queue {
+    private:
+        std::mutex mutex;
+        std::queue<T> values;
+
+    public:
+        void push(T value) {
+            std::lock_guard<std::mutex> lock(mutex);
+            values.push(std::move(value));
+        }
+
+        bool try_pop(T& value) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (values.empty()) return false;
+
+            value = std::move(values.front());
+            values.pop();
+            return true;
+        }
+    };
+
+    /**
+     * std::priority_queue behind a single mutex.
+     */
+    template<typename T>
+    class mutex_priority_queue {
+    private:
+        std::mutex mutex;
+        std::priority_queue<T> values;
+
+    public:
+        void push(T value) {
+            std::lock_guard<std::mutex> lock(mutex);
+            values.push(std::move(value));
+        }
+
+        bool try_pop(T& value) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (values.empty()) return false;
+
+            value = values.top();
+            values.pop();
+            return true;
+        }
+    };
+
+    /**
+     * std::unordered_map behind a single mutex.
+     */
+    template<typename KEY_TYPE, typename T>
+    class mutex_map {
+    private:
+        std::mutex mutex;
+        std::unordered_map<KEY_TYPE, T> values;
+
+    public:
+        void insert(KEY_TYPE key, T value) {
+            std::lock_guard<std::mutex> lock(mutex);
+            values[std::move(key)] = std::move(value);
+        }
+
+        bool try_at(KEY_TYPE key, T& value) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto entry = values.find(key);
+            if (entry == values.end()) return false;
+
+            value = entry->second;
+            return true;
+        }
+
+        bool try_erase(KEY_TYPE key) {
+            std::lock_guard<std::mutex> lock(mutex);
+            return values.erase(key) != 0;
+        }
+    };
+
+    /**
+     * Michael-Scott lock-free queue, outlined here: https://www.cs.rochester.edu/~scott/papers/1996_PODC_queues.pdf
+     * Popped nodes are freed through the library's epoch based reclamation.
+     */
+    template<typename T>
+    class michael_scott_queue {
+    private:
+        struct node {
+            std::atomic<node*> next;
+            T data;
+
+            node()
+                : next(nullptr) {
+            }
+
+            explicit node(T data_)
+                : next(nullptr)
+                , data(std::move(data_)) {
+            }
+        };
+
+        std::atomic<node*> head; // Always points at a dummy node, the first value is in head->next
+        std::atomic<node*> tail;
+
+    public:
+        michael_scott_queue() {
+            auto dummy = new node;
+            head.store(dummy);
+            tail.store(dummy);
+        }
+
+        ~michael_scott_queue() {
+            auto current = head.load();
+            while (current) {
+                auto next = current->next.load();
+                delete current;
+                current = next;
+            }
+        }
+
+        michael_scott_queue(const michael_scott_queue &other) = delete;
+        michael_scott_queue &operator=(const michael_scott_queue &other) = delete;
+
+        void push(T value) {
+            auto new_node = new node(std::move(value));
+            ccl::reclaim::epoch_guard guard;
+            while (true) {
+                auto last = tail.load();
+                auto next = last->next.load();
+                if (last != tail.load()) continue;
+
+                if (next) {
+                    // Tail is lagging behind, help move it forward
+                    tail.compare_exchange_weak(last, next);
+                } else if (last->next.compare_exchange_weak(next, new_node)) {
+                    tail.compare_exchange_strong(last, new_node);
+                    return;
+                }
+            }
+        }
+
+        bool try_pop(T& value) {
+            ccl::reclaim::epoch_guard guard;
+            while (true) {
+                auto first = head.load();
+                auto last = tail.load();
+                auto next = first->next.load();
+                if (first != head.load()) continue;
+
+                if (first == last) {
+                    if (!next) return false;
+
+                    tail.compare_exchange_weak(last, next);
+                } else {
+                    // The value has to be read before the swing, after which another pop may take over the node
+                    T data = next->data;
+                    if (head.compare_exchange_weak(first, next)) {
+                        value = std::move(data);
+                        ccl::reclaim::retire(first);
+                        return true;
+                    }
+                }
+            }
+        }
+    };
+
+    /**
+     * Command line options, each list is benchmarked in every combination.
+     */
+    struct options {
+        std::vector<unsigned int> thread_counts;
+        std::size_t operations; // Per thread
+        std::vector<double> write_ratios; // Share of pushes (or inserts and erases for maps)
+        std::vector<std::size_t> payload_sizes; // In bytes
+        std::vector<double> zipf_exponents; // Key distributions for the maps, where 0 is uniform
+        std::size_t key_count; // Keys the maps draw from
+        std::size_t prefill; // Values pushed into stacks, queues and pools before measuring
+        std::string filter; // Only containers whose name contains this are benchmarked
+        bool verify; // Check the containers for correctness instead of measuring them
+
+        options()
+            : operations(100000)
+            , write_ratios{0.5}
+            , payload_sizes{8, 64}
+            , zipf_exponents{0.0, 0.99}
+            , key_count(100000)
+            , prefill(1000)
+            , verify(false) {
+            auto hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned int threads = 1; threads < hardware_threads; threads *= 2) {
+                thread_counts.push_back(threads);
+            }
+            thread_counts.push_back(hardware_threads);
+            if (thread_counts.size() == 1) {
+                // Still measure contention on machines with a single core
+                thread_counts.push_back(4);
+            }
+        }
+    };
+
+    /**
+     * Throughput and latency percentiles of one benchmark run.
+     */
+    struct result {
+        double throughput; // Operations per second over all threads
+        double p50; // Latencies in nanoseconds
+        double p99;
+        double p999;
+    };
+
+    /**
+     * Runs operation(random, index, thread_index) the requested amount of times on each thread, with all threads
+     * starting at once.
+     */
+    template<typename OPERATION>
+    result run_threads(unsigned int thread_count, std::size_t operations, OPERATION const& operation) {
+        std::atomic<unsigned int> ready(0);
+        std::atomic<bool> start(false);
+        std::vector<std::vector<std::uint64_t>> latencies(thread_count);
+
+        std::vector<std::thread> threads;
+        for (unsigned int thread_index = 0; thread_index < thread_count; ++thread_index) {
+            threads.emplace_back([&, thread_index]() {
+                std::mt19937_64 random(0x9e3779b97f4a7c15ULL * (thread_index + 1));
+                auto& samples = latencies[thread_index];
+                samples.reserve(operations / LATENCY_SAMPLE_INTERVAL + 1);
+
+                ++ready;
+                while (!start.load(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                }
+
+                for (std::size_t index = 0; index < operations; ++index) {
+                    if (index % LATENCY_SAMPLE_INTERVAL == 0) {
+                        auto begin = clock::now();
+                        operation(random, index, thread_index);
+                        auto elapsed = clock::now() - begin;
+                        samples.push_back(static_cast<std::uint64_t>(
+                                std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+                    } else {
+                        operation(random, index, thread_index);
+                    }
+                }
+            });
+        }
+
+        while (ready.load() != thread_count) {
+            std::this_thread::yield();
+        }
+
+        auto begin = clock::now();
+        start.store(true, std::memory_order_release);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        auto seconds = std::chrono::duration<double>(clock::now() - begin).count();
+
+        std::vector<std::uint64_t> samples;
+        for (auto& thread_samples : latencies) {
+            samples.insert(samples.end(), thread_samples.begin(), thread_samples.end());
+        }
+        std::sort(samples.begin(), samples.end());
+        auto percentile = [&](double fraction) {
+            if (samples.empty()) return 0.0;
+            auto index = std::min(samples.size() - 1, static_cast<std::size_t>(fraction * samples.size()));
+            return static_cast<double>(samples[index]);
+        };
+
+        result measured;
+        measured.throughput = static_cast<double>(operations) * thread_count / seconds;
+        measured.p50 = percentile(0.5);
+        measured.p99 = percentile(0.99);
+        measured.p999 = percentile(0.999);
+        return measured;
+    }
+
+    void print_header() {
+        std::cout << std::left << std::setw(28) << "container" << std::right
+                  << std::setw(8) << "threads" << std::setw(8) << "writes" << std::setw(9) << "payload"
+                  << std::setw(12) << "keys" << std::setw(14) << "ops/s"
+                  << std::setw(10) << "p50 ns" << std::setw(10) << "p99 ns" << std::setw(11) << "p999 ns"
+                  << std::endl;
+    }
+
+    void print_result(std::string const& name, unsigned int threads, double write_ratio, std::size_t payload_size,
+                      std::string const& keys, result const& measured) {
+        std::cout << std::left << std::setw(28) << name << std::right
+                  << std::setw(8) << threads << std::setw(8) << std::fixed << std::setprecision(2) << write_ratio
+                  << std::setw(9) << payload_size << std::setw(12) << keys
+                  << std::setw(14) << std::setprecision(0) << measured.throughput
+                  << std::setw(10) << measured.p50 << std::setw(10) << measured.p99 << std::setw(11) << measured.p999
+                  << std::endl;
+    }
+
+    /**
+     * Benchmarks a stack, queue or pool with a mix of pushes and pops.
+     */
+    template<typename CONTAINER, std::size_t SIZE>
+    void run_sequence(std::string const& name, options const& settings) {
+        using value_type = payload<SIZE>;
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        for (auto write_ratio : settings.write_ratios) {
+            for (auto threads : settings.thread_counts) {
+                CONTAINER container;
+                // Prefill from a thread of its own, so that no benchmark thread outlives the container it used
+                std::thread([&]() {
+                    for (std::size_t index = 0; index < settings.prefill; ++index) {
+                        container.push(value_type(index));
+                    }
+                }).join();
+
+                auto measured = run_threads(threads, settings.operations,
+                                            [&](std::mt19937_64& random, std::size_t index, unsigned int) {
+                    if (std::uniform_real_distribution<double>(0.0, 1.0)(random) < write_ratio) {
+                        container.push(value_type(index));
+                    } else {
+                        value_type value;
+                        container.try_pop(value);
+                    }
+                });
+                print_result(name, threads, write_ratio, SIZE, "-", measured);
+            }
+        }
+    }
+
+    /**
+     * Combining policy that keeps the combiner on for as long as requests keep arriving.
+     */
+    inline ccl::combining_policy adaptive_policy() {
+        ccl::combining_policy policy;
+        policy.adaptive = true;
+        return policy;
+    }
+
+    template<typename T>
+    struct adaptive_stack : ccl::stack<T> {
+        adaptive_stack()
+            : ccl::stack<T>(adaptive_policy()) {
+        }
+    };
+
+    template<typename T>
+    struct adaptive_queue : ccl::queue<T> {
+        adaptive_queue()
+            : ccl::queue<T>(0, adaptive_policy()) {
+        }
+    };
+
+    /**
+     * Combining policy splitting the threads over four clusters whatever the amount of NUMA nodes, so that the handover
+     * between cluster combiners is exercised on a machine with a single node as well.
+     */
+    inline ccl::combining_policy clustered_policy() {
+        ccl::combining_policy policy;
+        policy.clusters = 4;
+        return policy;
+    }
+
+    template<typename T>
+    struct clustered_queue : ccl::queue<T> {
+        clustered_queue()
+            : ccl::queue<T>(0, clustered_policy()) {
+        }
+    };
+
+    template<typename T>
+    struct clustered_stack : ccl::stack<T> {
+        clustered_stack()
+            : ccl::stack<T>(clustered_policy()) {
+        }
+    };
+
+    template<typename T>
+    struct clustered_priority_queue : ccl::priority_queue<T> {
+        clustered_priority_queue()
+            : ccl::priority_queue<T>(clustered_policy()) {
+        }
+    };
+
+    /**
+     * ccl::stack used as the task pool of a scheduler, for comparing against work_stealing_scheduler. Every worker
+     * shares the one stack, so the worker index is ignored.
+     */
+    template<typename T>
+    class shared_stack_scheduler {
+    private:
+        ccl::stack<T> tasks;
+
+    public:
+        explicit shared_stack_scheduler(std::size_t /* worker_count */) {
+        }
+
+        void push(std::size_t, T const& task) {
+            tasks.push(task);
+        }
+
+        bool try_pop(std::size_t, T& task) {
+            return tasks.try_pop(task);
+        }
+    };
+
+    /**
+     * Benchmarks a scheduler where every thread is a worker that spawns tasks (pushes) and runs them (pops), with the
+     * share of pushes as the write ratio. Tasks are plain integers, which is what a scheduler would hold a pointer as.
+     */
+    template<typename SCHEDULER>
+    void run_scheduler(std::string const& name, options const& settings) {
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        for (auto write_ratio : settings.write_ratios) {
+            for (auto threads : settings.thread_counts) {
+                SCHEDULER scheduler(threads);
+                auto measured = run_threads(threads, settings.operations,
+                                            [&](std::mt19937_64& random, std::size_t index, unsigned int self) {
+                    if (std::uniform_real_distribution<double>(0.0, 1.0)(random) < write_ratio) {
+                        scheduler.push(self, index);
+                    } else {
+                        std::uint64_t task;
+                        scheduler.try_pop(self, task);
+                    }
+                });
+                print_result(name, threads, write_ratio, sizeof(std::uint64_t), "-", measured);
+            }
+        }
+    }
+
+    /**
+     * Benchmarks a queue used as a channel: producer threads push their operations while a single consumer pops until
+     * it has seen them all. A spsc_queue only gets one producer whatever the thread count. Every value is a push and
+     * a pop, so both count as an operation, and the latencies are those of the pushes.
+     */
+    template<typename QUEUE, std::size_t SIZE>
+    void run_channel(std::string const& name, options const& settings, bool single_producer) {
+        using value_type = payload<SIZE>;
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        for (auto threads : settings.thread_counts) {
+            auto producers = single_producer ? 1u : std::max(threads, 2u) - 1;
+            if (single_producer && threads != settings.thread_counts.front()) break;
+
+            QUEUE queue;
+            std::atomic<unsigned int> ready(0);
+            std::atomic<bool> start(false);
+            std::vector<std::vector<std::uint64_t>> latencies(producers);
+
+            std::vector<std::thread> workers;
+            for (unsigned int thread_index = 0; thread_index < producers; ++thread_index) {
+                workers.emplace_back([&, thread_index]() {
+                    auto& samples = latencies[thread_index];
+                    samples.reserve(settings.operations / LATENCY_SAMPLE_INTERVAL + 1);
+                    ++ready;
+                    while (!start.load(std::memory_order_acquire)) {
+                        std::this_thread::yield();
+                    }
+
+                    for (std::size_t index = 0; index < settings.operations; ++index) {
+                        if (index % LATENCY_SAMPLE_INTERVAL == 0) {
+                            auto begin = clock::now();
+                            queue.push(value_type(index));
+                            auto elapsed = clock::now() - begin;
+                            samples.push_back(static_cast<std::uint64_t>(
+                                    std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+                        } else {
+                            queue.push(value_type(index));
+                        }
+                    }
+                });
+            }
+            workers.emplace_back([&]() {
+                ++ready;
+                while (!start.load(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                }
+
+                value_type value;
+                std::size_t remaining = settings.operations * producers;
+                while (remaining) {
+                    if (queue.try_pop(value)) {
+                        --remaining;
+                    } else {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+
+            while (ready.load() != producers + 1) {
+                std::this_thread::yield();
+            }
+            auto begin = clock::now();
+            start.store(true, std::memory_order_release);
+            for (auto& worker : workers) {
+                worker.join();
+            }
+            auto seconds = std::chrono::duration<double>(clock::now() - begin).count();
+
+            std::vector<std::uint64_t> samples;
+            for (auto& thread_samples : latencies) {
+                samples.insert(samples.end(), thread_samples.begin(), thread_samples.end());
+            }
+            std::sort(samples.begin(), samples.end());
+            auto percentile = [&](double fraction) {
+                auto index = std::min(samples.size() - 1, static_cast<std::size_t>(fraction * samples.size()));
+                return samples.empty() ? 0.0 : static_cast<double>(samples[index]);
+            };
+
+            result measured;
+            measured.throughput = 2.0 * settings.operations * producers / seconds;
+            measured.p50 = percentile(0.5);
+            measured.p99 = percentile(0.99);
+            measured.p999 = percentile(0.999);
+            print_result(name, producers + 1, 0.5, SIZE, "-", measured);
+        }
+    }
+
+    /**
+     * Benchmarks a map with a mix of lookups and writes, half of the writes being inserts and half erases so that the
+     * map keeps about the same size.
+     */
+    template<typename MAP, std::size_t SIZE>
+    void run_map(std::string const& name, options const& settings) {
+        using value_type = payload<SIZE>;
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        for (auto exponent : settings.zipf_exponents) {
+            zipf_distribution keys(settings.key_count, exponent);
+            std::ostringstream key_description;
+            if (exponent == 0.0) {
+                key_description << "uniform";
+            } else {
+                key_description << "zipf " << std::fixed << std::setprecision(2) << exponent;
+            }
+
+            for (auto write_ratio : settings.write_ratios) {
+                for (auto threads : settings.thread_counts) {
+                    MAP map;
+                    for (std::size_t key = 0; key < settings.key_count; key += 2) {
+                        map.insert(key, value_type(key));
+                    }
+
+                    auto measured = run_threads(threads, settings.operations,
+                                                [&](std::mt19937_64& random, std::size_t, unsigned int) {
+                        auto key = keys(random);
+                        auto choice = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+                        if (choice < write_ratio / 2) {
+                            map.insert(key, value_type(key));
+                        } else if (choice < write_ratio) {
+                            map.try_erase(key);
+                        } else {
+                            value_type value;
+                            map.try_at(key, value);
+                        }
+                    });
+                    print_result(name, threads, write_ratio, SIZE, key_description.str(), measured);
+                }
+            }
+        }
+    }
+
+    template<std::size_t SIZE>
+    void run_all(options const& settings) {
+        using value_type = payload<SIZE>;
+
+        run_sequence<ccl::stack<value_type>, SIZE>("ccl::stack", settings);
+        run_sequence<ccl::stack<value_type, std::allocator<value_type>, ccl::contiguous_storage>, SIZE>(
+                "ccl::stack (contiguous)", settings);
+        run_sequence<adaptive_stack<value_type>, SIZE>("ccl::stack (adaptive)", settings);
+        run_sequence<mutex_stack<value_type>, SIZE>("mutex std::stack", settings);
+        run_sequence<ccl::queue<value_type>, SIZE>("ccl::queue", settings);
+        run_sequence<ccl::queue<value_type, std::allocator<value_type>, ccl::contiguous_storage>, SIZE>(
+                "ccl::queue (contiguous)", settings);
+        run_sequence<ccl::queue<value_type, std::allocator<value_type>, ccl::ring_storage>, SIZE>(
+                "ccl::queue (ring)", settings);
+        run_sequence<adaptive_queue<value_type>, SIZE>("ccl::queue (adaptive)", settings);
+        run_sequence<clustered_queue<value_type>, SIZE>("ccl::queue (clustered)", settings);
+        run_sequence<mutex_queue<value_type>, SIZE>("mutex std::queue", settings);
+        run_sequence<michael_scott_queue<value_type>, SIZE>("michael-scott queue", settings);
+        run_channel<ccl::spsc_queue<value_type>, SIZE>("ccl::spsc_queue", settings, true);
+        run_channel<ccl::queue<value_type>, SIZE>("ccl::queue (one producer)", settings, true);
+        run_channel<ccl::mpsc_queue<value_type>, SIZE>("ccl::mpsc_queue", settings, false);
+        run_channel<ccl::queue<value_type>, SIZE>("ccl::queue (one consumer)", settings, false);
+        run_channel<michael_scott_queue<value_type>, SIZE>("michael-scott (one consumer)", settings, false);
+        run_sequence<ccl::priority_queue<value_type>, SIZE>("ccl::priority_queue", settings);
+        run_sequence<mutex_priority_queue<value_type>, SIZE>("mutex std::priority_queue", settings);
+        run_sequence<ccl::data_pool<value_type>, SIZE>("ccl::data_pool", settings);
+        run_sequence<ccl::data_pool<value_type, ccl::padded_nodes>, SIZE>("ccl::data_pool (padded)", settings);
+
+        if (SIZE == sizeof(std::uint64_t)) {
+            run_scheduler<ccl::work_stealing_scheduler<std::uint64_t>>("ccl::work_stealing_scheduler", settings);
+            run_scheduler<shared_stack_scheduler<std::uint64_t>>("ccl::stack (shared tasks)", settings);
+        }
+
+        run_map<ccl::map<std::size_t, value_type>, SIZE>("ccl::map", settings);
+        run_map<ccl::numa_map<std::size_t, value_type>, SIZE>("ccl::numa_map", settings);
+        run_map<ccl::flat_map<std::size_t, value_type>, SIZE>("ccl::flat_map", settings);
+        run_map<mutex_map<std::size_t, value_type>, SIZE>("mutex std::unordered_map", settings);
+    }
+
+    /**
+     * Reports a failed check and stops the program.
+     */
+    void fail(std::string const& name, unsigned int threads, std::string const& reason) {
+        std::cout << name << " with " << threads << " threads FAILED: " << reason << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    /**
+     * Checks that the values popped (by each consumer, plus any drained at the end) are exactly the values pushed by
+     * the producers, operations each, tagged with the producer's index. With FIFO set, also checks that
+     * each consumer popped the values of any one producer in the order they were pushed.
+     */
+    void check_popped(std::string const& name, unsigned int threads, unsigned int producers, std::size_t operations,
+                      std::vector<std::vector<std::uint64_t>> const& popped, bool fifo) {
+        if (fifo) {
+            for (auto& thread_popped : popped) {
+                std::vector<std::int64_t> last_seen(producers, -1);
+                for (auto popped_value : thread_popped) {
+                    auto producer = popped_value >> 32;
+                    auto sequence = static_cast<std::int64_t>(popped_value & 0xffffffffULL);
+                    if (producer >= producers || sequence <= last_seen[producer]) {
+                        fail(name, threads, "values of a producer were popped out of order");
+                    }
+                    last_seen[producer] = sequence;
+                }
+            }
+        }
+
+        std::vector<std::uint64_t> all_popped;
+        for (auto& thread_popped : popped) {
+            all_popped.insert(all_popped.end(), thread_popped.begin(), thread_popped.end());
+        }
+        std::sort(all_popped.begin(), all_popped.end());
+        std::vector<std::uint64_t> pushed;
+        for (std::uint64_t thread_index = 0; thread_index < producers; ++thread_index) {
+            for (std::uint64_t index = 0; index < operations; ++index) {
+                pushed.push_back((thread_index << 32) | index);
+            }
+        }
+        if (all_popped != pushed) {
+            fail(name, threads, "popped values don't match the pushed values (" +
+                                std::to_string(all_popped.size()) + " popped, " + std::to_string(pushed.size()) +
+                                " pushed)");
+        }
+    }
+
+    /**
+     * Has every thread push values tagged with the thread's index (single and bulk), while popping (single and bulk)
+     * as well. Once the threads are done, checks that every value pushed was popped exactly once. With FIFO set, also
+     * checks that each thread popped the values of any one producer in the order they were pushed.
+     */
+    template<typename CONTAINER>
+    void verify_sequence(std::string const& name, options const& settings, bool fifo) {
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        for (auto threads : settings.thread_counts) {
+            CONTAINER container;
+            std::vector<std::vector<std::uint64_t>> popped(threads);
+
+            std::vector<std::thread> workers;
+            for (unsigned int thread_index = 0; thread_index < threads; ++thread_index) {
+                workers.emplace_back([&, thread_index]() {
+                    auto& thread_popped = popped[thread_index];
+                    std::uint64_t tag = static_cast<std::uint64_t>(thread_index) << 32;
+                    std::vector<std::uint64_t> batch;
+                    std::uint64_t value;
+
+                    std::size_t index = 0;
+                    while (index < settings.operations) {
+                        if (index % 16 == 0) {
+                            batch.clear();
+                            for (std::size_t offset = 0; offset < 8 && index < settings.operations; ++offset) {
+                                batch.push_back(tag | index++);
+                            }
+                            container.push_bulk(batch.begin(), batch.end());
+                            container.try_pop_n(std::back_inserter(thread_popped), 4);
+                        } else {
+                            container.push(tag | index++);
+                            if (container.try_pop(value)) {
+                                thread_popped.push_back(value);
+                            }
+                        }
+                    }
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+
+            std::vector<std::uint64_t> drained;
+            std::uint64_t value;
+            while (container.try_pop(value)) {
+                drained.push_back(value);
+            }
+            popped.push_back(std::move(drained));
+
+            check_popped(name, threads, threads, settings.operations, popped, fifo);
+            std::cout << name << " with " << threads << " threads ok" << std::endl;
+        }
+    }
+
+    /**
+     * Has every thread push values tagged with the thread's index (single and bulk), then once all of them are in,
+     * has every thread pop (single and bulk) until the priority queue is empty. Nothing is pushed while the values are
+     * popped, so each thread has to pop its values greatest first, and every value has to come out exactly once.
+     */
+    template<typename PRIORITY_QUEUE>
+    void verify_priority_order(std::string const& name, options const& settings) {
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        for (auto threads : settings.thread_counts) {
+            PRIORITY_QUEUE priority_queue;
+            std::vector<std::vector<std::uint64_t>> popped(threads);
+            std::atomic<unsigned int> pushed_threads(0);
+
+            std::vector<std::thread> workers;
+            for (unsigned int thread_index = 0; thread_index < threads; ++thread_index) {
+                workers.emplace_back([&, thread_index]() {
+                    // Spread the values of the threads over each other, rather than having one thread own the top
+                    std::mt19937_64 random(thread_index);
+                    std::vector<std::uint64_t> values;
+                    std::uint64_t tag = static_cast<std::uint64_t>(thread_index) << 32;
+                    for (std::size_t index = 0; index < settings.operations; ++index) {
+                        values.push_back(tag | index);
+                    }
+                    std::shuffle(values.begin(), values.end(), random);
+                    for (std::size_t index = 0; index < values.size(); index += 8) {
+                        if (index % 64 == 0) {
+                            auto last = std::min(index + 8, values.size());
+                            priority_queue.push_bulk(values.begin() + index, values.begin() + last);
+                        } else {
+                            for (auto offset = index; offset < std::min(index + 8, values.size()); ++offset) {
+                                priority_queue.push(values[offset]);
+                            }
+                        }
+                    }
+
+                    pushed_threads.fetch_add(1);
+                    while (pushed_threads.load() != threads) {
+                        std::this_thread::yield();
+                    }
+
+                    auto& thread_popped = popped[thread_index];
+                    std::uint64_t value;
+                    while (true) {
+                        if (thread_popped.size() % 16 == 0) {
+                            if (!priority_queue.try_pop_n(std::back_inserter(thread_popped), 4)) break;
+                        } else {
+                            if (!priority_queue.try_pop(value)) break;
+                            thread_popped.push_back(value);
+                        }
+                    }
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+
+            for (auto& thread_popped : popped) {
+                for (std::size_t index = 1; index < thread_popped.size(); ++index) {
+                    if (thread_popped[index] > thread_popped[index - 1]) {
+                        fail(name, threads, "a value was popped after a smaller one");
+                    }
+                }
+            }
+            check_popped(name, threads, threads, settings.operations, popped, false);
+            std::cout << name << " with " << threads << " threads ok" << std::endl;
+        }
+    }
+
+    /**
+     * Checks that a bounded queue takes exactly capacity values, then has half of the threads push (with push,
+     * try_push and push_bulk) into a queue much smaller than what they push, while the other half pops. Every value
+     * has to come out exactly once and in order per producer, and the producers must not get stuck.
+     */
+    template<typename QUEUE>
+    void verify_bounded_queue(std::string const& name, options const& settings) {
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        std::size_t const capacity = 64;
+        for (auto threads : settings.thread_counts) {
+            QUEUE queue(capacity);
+            for (std::uint64_t index = 0; index < capacity; ++index) {
+                if (!queue.try_push(index)) fail(name, threads, "a push failed before the queue was full");
+            }
+            std::uint64_t value = capacity;
+            if (queue.try_push(value)) fail(name, threads, "a full queue took another value");
+            if (!queue.try_pop(value) || value != 0) fail(name, threads, "popped the wrong value");
+            if (!queue.try_push(value)) fail(name, threads, "a push failed after a pop made room");
+            while (queue.try_pop(value)) {
+            }
+
+            auto producers = std::max(threads / 2, 1u);
+            auto consumers = std::max(threads - producers, 1u);
+            std::vector<std::vector<std::uint64_t>> popped(consumers);
+            std::atomic<std::size_t> popped_count(0);
+            auto total = producers * settings.operations;
+
+            std::vector<std::thread> workers;
+            for (unsigned int thread_index = 0; thread_index < producers; ++thread_index) {
+                workers.emplace_back([&, thread_index]() {
+                    std::uint64_t tag = static_cast<std::uint64_t>(thread_index) << 32;
+                    std::vector<std::uint64_t> batch;
+                    std::size_t index = 0;
+                    while (index < settings.operations) {
+                        if (index % 16 == 0) {
+                            batch.clear();
+                            for (std::size_t offset = 0; offset < 8 && index < settings.operations; ++offset) {
+                                batch.push_back(tag | index++);
+                            }
+                            queue.push_bulk(batch.begin(), batch.end());
+                        } else if (index % 2) {
+                            queue.push(tag | index++);
+                        } else {
+                            std::uint64_t pushed_value = tag | index++;
+                            while (!queue.try_push(pushed_value)) {
+                                std::this_thread::yield();
+                            }
+                        }
+                    }
+                });
+            }
+            for (unsigned int thread_index = 0; thread_index < consumers; ++thread_index) {
+                workers.emplace_back([&, thread_index]() {
+                    auto& thread_popped = popped[thread_index];
+                    std::uint64_t popped_value;
+                    while (popped_count.load() < total) {
+                        if (queue.wait_pop_for(popped_value, std::chrono::milliseconds(1))) {
+                            thread_popped.push_back(popped_value);
+                            ++popped_count;
+                        }
+                        popped_count += queue.try_pop_n(std::back_inserter(thread_popped), 4);
+                    }
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+
+            check_popped(name, threads, producers, settings.operations, popped, true);
+            std::cout << name << " with " << threads << " threads ok" << std::endl;
+        }
+    }
+
+    /**
+     * Has producer threads (only one for a spsc_queue) push values tagged with their index while a single consumer pops
+     * them, checking that every value comes out exactly once and in the order its producer pushed it.
+     */
+    template<typename QUEUE>
+    void verify_channel(std::string const& name, options const& settings, bool single_producer) {
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        for (auto threads : settings.thread_counts) {
+            auto producers = single_producer ? 1u : std::max(threads, 2u) - 1;
+            QUEUE queue;
+            std::vector<std::vector<std::uint64_t>> popped(1);
+
+            std::vector<std::thread> workers;
+            for (unsigned int thread_index = 0; thread_index < producers; ++thread_index) {
+                workers.emplace_back([&, thread_index]() {
+                    std::uint64_t tag = static_cast<std::uint64_t>(thread_index) << 32;
+                    for (std::size_t index = 0; index < settings.operations; ++index) {
+                        if (index % 2) {
+                            queue.push(tag | index);
+                        } else {
+                            queue.emplace(tag | index);
+                        }
+                    }
+                });
+            }
+            workers.emplace_back([&]() {
+                std::uint64_t value;
+                while (popped[0].size() < producers * settings.operations) {
+                    if (queue.try_pop(value)) {
+                        popped[0].push_back(value);
+                    } else {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+            for (auto& worker : workers) {
+                worker.join();
+            }
+
+            std::uint64_t value;
+            if (!queue.empty() || queue.try_pop(value)) fail(name, threads, "the queue still held values");
+            check_popped(name, producers + 1, producers, settings.operations, popped, true);
+            std::cout << name << " with " << producers << " producers ok" << std::endl;
+        }
+    }
+
+    /**
+     * Has every thread act as a worker of a work_stealing_scheduler, spawning tasks tagged with its index and popping
+     * (own, submitted or stolen) until all tasks have run, while one more thread submits tasks from outside. Every
+     * task has to be popped exactly once.
+     */
+    void verify_scheduler(std::string const& name, options const& settings) {
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        for (auto threads : settings.thread_counts) {
+            ccl::work_stealing_scheduler<std::uint64_t> scheduler(threads);
+            std::vector<std::vector<std::uint64_t>> popped(threads);
+            std::atomic<std::size_t> popped_count(0);
+            auto total = (threads + 1) * settings.operations;
+
+            std::vector<std::thread> workers;
+            for (unsigned int thread_index = 0; thread_index < threads; ++thread_index) {
+                workers.emplace_back([&, thread_index]() {
+                    auto& thread_popped = popped[thread_index];
+                    std::uint64_t tag = static_cast<std::uint64_t>(thread_index) << 32;
+                    std::uint64_t task;
+                    for (std::size_t index = 0; index < settings.operations; ++index) {
+                        scheduler.push(thread_index, tag | index);
+                        // Leave tasks behind every other push, so the deques fill up (and grow) for the thieves
+                        if (index % 2 && scheduler.try_pop(thread_index, task)) {
+                            thread_popped.push_back(task);
+                            ++popped_count;
+                        }
+                    }
+                    while (popped_count.load() < total) {
+                        if (scheduler.try_pop(thread_index, task)) {
+                            thread_popped.push_back(task);
+                            ++popped_count;
+                        } else {
+                            std::this_thread::yield();
+                        }
+                    }
+                });
+            }
+            workers.emplace_back([&]() {
+                std::uint64_t tag = static_cast<std::uint64_t>(threads) << 32;
+                for (std::size_t index = 0; index < settings.operations; ++index) {
+                    scheduler.submit(tag | index);
+                }
+            });
+            for (auto& worker : workers) {
+                worker.join();
+            }
+
+            check_popped(name, threads, threads + 1, settings.operations, popped, false);
+            std::cout << name << " with " << threads << " threads ok" << std::endl;
+        }
+    }
+
+    /**
+     * Every thread owns a range of keys that only it writes, and checks each lookup against its own copy of them.
+     * Threads also read from the other ranges, checking that the value found belongs to the key.
+     */
+    template<typename MAP>
+    void verify_map(std::string const& name, options const& settings) {
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        std::size_t const keys_per_thread = 256;
+        for (auto threads : settings.thread_counts) {
+            MAP map;
+            std::atomic<bool> failed(false);
+            std::vector<std::thread> workers;
+            for (unsigned int thread_index = 0; thread_index < threads; ++thread_index) {
+                workers.emplace_back([&, thread_index]() {
+                    std::mt19937_64 random(thread_index + 1);
+                    std::unordered_map<std::uint64_t, std::uint64_t> expected;
+                    std::uint64_t first_key = thread_index * keys_per_thread;
+
+                    for (std::uint64_t version = 0; version < settings.operations && !failed; ++version) {
+                        auto key = first_key + random() % keys_per_thread;
+                        std::uint64_t value;
+                        switch (random() % 4) {
+                            case 0:
+                                map.insert(key, (key << 20) | (version & 0xfffff));
+                                expected[key] = (key << 20) | (version & 0xfffff);
+                                break;
+                            case 1:
+                                if (map.try_erase(key) != (expected.erase(key) != 0)) failed = true;
+                                break;
+                            case 2: {
+                                auto entry = expected.find(key);
+                                bool found = map.try_at(key, value);
+                                if (found != (entry != expected.end()) || (found && value != entry->second)) {
+                                    failed = true;
+                                }
+                                break;
+                            }
+                            default: {
+                                auto other_key = random() % (threads * keys_per_thread);
+                                if (map.try_at(other_key, value) && (value >> 20) != other_key) failed = true;
+                            }
+                        }
+                    }
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+
+            if (failed) {
+                fail(name, threads, "a lookup didn't match what was written");
+            }
+            std::cout << name << " with " << threads << " threads ok" << std::endl;
+        }
+    }
+
+    /**
+     * Threads add to a few shared counters through fetch_add, compute and update, while inserting and erasing keys of
+     * their own with try_emplace and erase_if to keep the writers busy. The counters must add up to every increment.
+     */
+    template<typename MAP>
+    void verify_map_updates(std::string const& name, options const& settings) {
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        std::size_t const counters = 64;
+        std::uint64_t const first_counter = std::uint64_t(1) << 40;
+        std::size_t const keys_per_thread = 256;
+        for (auto threads : settings.thread_counts) {
+            MAP map;
+            std::atomic<bool> failed(false);
+            std::atomic<std::uint64_t> increments(0);
+            std::vector<std::thread> workers;
+            for (unsigned int thread_index = 0; thread_index < threads; ++thread_index) {
+                workers.emplace_back([&, thread_index]() {
+                    std::mt19937_64 random(thread_index + 1);
+                    std::unordered_map<std::uint64_t, std::uint64_t> expected;
+                    std::uint64_t first_key = thread_index * keys_per_thread;
+                    std::uint64_t added = 0;
+
+                    for (std::uint64_t version = 0; version < settings.operations && !failed; ++version) {
+                        auto counter = first_counter + random() % counters;
+                        auto key = first_key + random() % keys_per_thread;
+                        switch (random() % 5) {
+                            case 0:
+                                map.fetch_add(counter, 1);
+                                ++added;
+                                break;
+                            case 1:
+                                map.compute(counter, [](std::uint64_t& value, bool) {
+                                    ++value;
+                                    return true;
+                                });
+                                ++added;
+                                break;
+                            case 2:
+                                if (map.update(counter, [](std::uint64_t& value) { ++value; })) ++added;
+                                break;
+                            case 3:
+                                if (map.try_emplace(key, version) != expected.emplace(key, version).second) {
+                                    failed = true;
+                                }
+                                break;
+                            default: {
+                                auto entry = expected.find(key);
+                                bool odd = entry != expected.end() && (entry->second & 1);
+                                if (map.erase_if(key, [](std::uint64_t value) { return (value & 1) != 0; }) != odd) {
+                                    failed = true;
+                                }
+                                if (odd) expected.erase(entry);
+                            }
+                        }
+                    }
+                    increments += added;
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+
+            std::uint64_t total = 0;
+            for (std::uint64_t counter = first_counter; counter < first_counter + counters; ++counter) {
+                std::uint64_t value = 0;
+                if (map.try_at(counter, value)) total += value;
+            }
+            if (failed) {
+                fail(name, threads, "try_emplace or erase_if didn't match what was written");
+            }
+            if (total != increments) {
+                fail(name, threads, "the counters lost increments");
+            }
+            std::cout << name << " with " << threads << " threads ok" << std::endl;
+        }
+    }
+
+    /**
+     * Bulk loads a range of stable keys (with duplicates, the last value winning), then scans the map with
+     * parallel_for_each while the other threads insert and erase keys outside of that range. Every stable key must be
+     * visited exactly once per scan.
+     */
+    void verify_map_scan(std::string const& name, options const& settings) {
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        std::uint64_t const stable_keys = 50000;
+        for (auto threads : settings.thread_counts) {
+            ccl::map<std::uint64_t, std::uint64_t> map;
+            std::vector<std::pair<std::uint64_t, std::uint64_t>> entries;
+            for (std::uint64_t index = 0; index < stable_keys * 2; ++index) {
+                entries.emplace_back(index % stable_keys, index);
+            }
+            map.bulk_insert(entries.begin(), entries.end(), threads);
+
+            std::atomic<bool> failed(false);
+            std::atomic<bool> done(false);
+            std::vector<std::thread> writers;
+            for (unsigned int thread_index = 1; thread_index < threads; ++thread_index) {
+                writers.emplace_back([&, thread_index]() {
+                    std::uint64_t first_key = stable_keys * (thread_index + 1);
+                    for (std::uint64_t key = first_key; !done; ++key) {
+                        map.insert(key, key);
+                        if (key % 2) map.try_erase(key - 1);
+                    }
+                });
+            }
+
+            auto scans = std::max<std::uint64_t>(settings.operations / 10000, 1);
+            for (std::uint64_t scan = 0; scan < scans && !failed; ++scan) {
+                std::unique_ptr<std::atomic<unsigned int>[]> visits(new std::atomic<unsigned int>[stable_keys]);
+                for (std::uint64_t key = 0; key < stable_keys; ++key) {
+                    visits[key].store(0);
+                }
+                map.parallel_for_each([&](std::uint64_t const& key, std::uint64_t const& value) {
+                    if (key < stable_keys) {
+                        if (value != key + stable_keys) failed = true;
+                        ++visits[key];
+                    } else if (value != key) {
+                        failed = true;
+                    }
+                }, threads);
+                for (std::uint64_t key = 0; key < stable_keys; ++key) {
+                    if (visits[key] != 1) failed = true;
+                }
+            }
+            done = true;
+            for (auto& writer : writers) {
+                writer.join();
+            }
+
+            if (failed) {
+                fail(name, threads, "a stable key wasn't visited exactly once with its last value");
+            }
+            std::cout << name << " with " << threads << " threads ok" << std::endl;
+        }
+    }
+
+    /**
+     * A data pool compacting whenever a pop passes over an empty pool, so that values are moved between pools and
+     * pools are freed while the other threads push and pop. The helper thread isn't used, since values it is moving
+     * when the workers are done would be missed by the final count.
+     */
+    struct compacting_pool : ccl::data_pool<std::uint64_t> {
+        static ccl::shrink_policy eager_policy() {
+            ccl::shrink_policy policy;
+            policy.maximum_occupancy = 0.5;
+            policy.compaction_interval = 1;
+            return policy;
+        }
+
+        compacting_pool()
+            : ccl::data_pool<std::uint64_t>(eager_policy()) {
+        }
+    };
+
+    /**
+     * A compacting data pool whose pools come from an arena backed by huge pages. The arena is kept small, so that
+     * growing past it falls back to the heap and compaction frees pools of both kinds.
+     */
+    struct arena_pool : ccl::data_pool<std::uint64_t> {
+        static ccl::growth_policy arena_growth() {
+            ccl::growth_policy growth;
+            growth.initial_capacity = 256;
+            growth.growth_rate = 2.0;
+            growth.arena_capacity = 4096;
+            growth.huge_pages = true;
+            return growth;
+        }
+
+        arena_pool()
+            : ccl::data_pool<std::uint64_t>(arena_growth(), compacting_pool::eager_policy()) {
+        }
+    };
+
+    int moves_before_throw = -1; // Moves of a throwing_value left until one throws, negative to never throw
+
+    /**
+     * Value whose copy or move throws once moves_before_throw counts down to zero, which then stops counting.
+     */
+    struct throwing_value {
+        std::uint64_t value;
+
+        throwing_value()
+            : value(0) {
+        }
+
+        explicit throwing_value(std::uint64_t value_)
+            : value(value_) {
+        }
+
+        throwing_value(throwing_value const& other)
+            : value(other.value) {
+            if (moves_before_throw >= 0 && moves_before_throw-- == 0) {
+                throw std::runtime_error("throwing_value");
+            }
+        }
+
+        throwing_value& operator=(throwing_value const& other) = default;
+    };
+
+    /**
+     * Fills a data pool spread over several pools, then compacts it with a move throwing somewhere along the way
+     * (while values are taken out of a pool, or while they are placed in another). Afterwards no value may be lost,
+     * and compacting again, popping and clearing must not wait forever on nodes the failed compaction left claimed.
+     */
+    void verify_pool_throwing_moves(std::string const& name, options const& settings) {
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        std::size_t const VALUES = 1000;
+        for (int throw_after : {0, 30, 70, 600}) {
+            ccl::growth_policy growth;
+            growth.initial_capacity = 64;
+            growth.growth_rate = 2.0;
+            ccl::shrink_policy policy;
+            policy.maximum_occupancy = 1.0;
+            policy.minimum_capacity = 0;
+            policy.compaction_interval = 0;
+            ccl::data_pool<throwing_value> pool(growth, policy);
+            for (std::uint64_t index = 0; index < VALUES; ++index) {
+                pool.push(throwing_value(index));
+            }
+
+            auto reason = "throwing after " + std::to_string(throw_after) + " moves";
+            moves_before_throw = throw_after;
+            try {
+                pool.compact();
+                fail(name, 1, "compaction didn't throw " + reason);
+            } catch (std::runtime_error const&) {
+            }
+            moves_before_throw = -1;
+            if (pool.size_approx() != VALUES) {
+                fail(name, 1, std::to_string(pool.size_approx()) + " values counted " + reason);
+            }
+
+            pool.compact();
+            std::vector<std::uint64_t> popped;
+            throwing_value popped_value;
+            while (pool.try_pop(popped_value)) {
+                popped.push_back(popped_value.value);
+            }
+            std::sort(popped.begin(), popped.end());
+            for (std::uint64_t index = 0; index < VALUES; ++index) {
+                if (popped.size() != VALUES || popped[index] != index) {
+                    fail(name, 1, "values were lost or duplicated " + reason);
+                }
+            }
+            pool.clear();
+        }
+        std::cout << name << " with 1 threads ok" << std::endl;
+    }
+
+#ifdef CCL_ENABLE_STATS
+    /**
+     * Runs task(thread_index) on threads threads at once.
+     */
+    template<typename TASK>
+    void run_workers(unsigned int threads, TASK task) {
+        std::vector<std::thread> workers;
+        for (unsigned int thread_index = 0; thread_index < threads; ++thread_index) {
+            workers.emplace_back(task, thread_index);
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    /**
+     * Has every thread push and pop one value at a time, then checks that the combining statistics account for every
+     * request: each push and pop is one request answered by some combiner, and every pass is counted once.
+     */
+    template<typename CONTAINER>
+    void verify_combining_stats(std::string const& name, options const& settings) {
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        for (auto threads : settings.thread_counts) {
+            CONTAINER container;
+            run_workers(threads, [&](unsigned int) {
+                std::uint64_t value;
+                for (std::size_t index = 0; index < settings.operations; ++index) {
+                    container.push(index);
+                    container.try_pop(value);
+                }
+            });
+
+            auto snapshot = container.stats();
+            auto submitted = 2 * static_cast<std::uint64_t>(threads) * settings.operations;
+            if (snapshot.requests != submitted) {
+                fail(name, threads, std::to_string(snapshot.requests) + " requests counted, " +
+                                    std::to_string(submitted) + " submitted");
+            }
+            if (snapshot.requests_per_pass.count() != snapshot.passes || snapshot.requests_per_pass.sum != submitted) {
+                fail(name, threads, "requests_per_pass doesn't add up to the passes and requests");
+            }
+            if (snapshot.lock_acquisitions == 0 || snapshot.lock_acquisitions > snapshot.passes) {
+                fail(name, threads, "every lock acquisition should make at least one pass");
+            }
+            std::cout << name << " with " << threads << " threads ok" << std::endl;
+        }
+    }
+
+    /**
+     * Has every thread push and try to pop one value at a time, then drains the data pool and checks that the
+     * statistics counted every push and pop. Compaction is turned off, since it counts the values it moves as pushed
+     * again.
+     */
+    void verify_pool_stats(std::string const& name, options const& settings) {
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        for (auto threads : settings.thread_counts) {
+            ccl::shrink_policy policy;
+            policy.compaction_interval = 0;
+            ccl::data_pool<std::uint64_t> pool(policy);
+            run_workers(threads, [&](unsigned int) {
+                std::uint64_t value;
+                for (std::size_t index = 0; index < settings.operations; ++index) {
+                    pool.push(index);
+                    pool.try_pop(value);
+                }
+            });
+            std::uint64_t value;
+            std::uint64_t drained = 0;
+            while (pool.try_pop(value)) {
+                ++drained;
+            }
+
+            auto snapshot = pool.stats();
+            auto pushed = static_cast<std::uint64_t>(threads) * settings.operations;
+            if (snapshot.pushes != pushed || snapshot.pops != pushed) {
+                fail(name, threads, std::to_string(snapshot.pushes) + " pushes and " + std::to_string(snapshot.pops) +
+                                    " pops counted, " + std::to_string(pushed) + " of each made");
+            }
+            if (snapshot.pops + snapshot.empty_pops != pushed + drained + 1) {
+                fail(name, threads, "pops and empty pops don't add up to the pops attempted");
+            }
+            std::cout << name << " with " << threads << " threads ok" << std::endl;
+        }
+    }
+
+    /**
+     * Has every thread insert its own keys and then look each of them up, checking that the statistics counted every
+     * lookup, and that the histogram the map doesn't fill stays empty.
+     */
+    template<typename MAP>
+    void verify_map_stats(std::string const& name, options const& settings, bool probing) {
+        if (name.find(settings.filter) == std::string::npos) return;
+
+        for (auto threads : settings.thread_counts) {
+            MAP map;
+            run_workers(threads, [&](unsigned int thread_index) {
+                std::uint64_t tag = static_cast<std::uint64_t>(thread_index) << 32;
+                std::uint64_t value;
+                for (std::size_t index = 0; index < settings.operations; ++index) {
+                    map.insert(tag | index, index);
+                }
+                for (std::size_t index = 0; index < settings.operations; ++index) {
+                    map.try_at(tag | index, value);
+                }
+            });
+
+            auto snapshot = map.stats();
+            auto looked_up = static_cast<std::uint64_t>(threads) * settings.operations;
+            if (snapshot.lookups != looked_up) {
+                fail(name, threads, std::to_string(snapshot.lookups) + " lookups counted, " +
+                                    std::to_string(looked_up) + " made");
+            }
+            auto& filled = probing ? snapshot.probe_lengths : snapshot.bucket_heights;
+            auto& unused = probing ? snapshot.bucket_heights : snapshot.probe_lengths;
+            if (filled.count() == 0 || unused.count() != 0) {
+                fail(name, threads, "tree heights and probe lengths were mixed up");
+            }
+            std::cout << name << " with " << threads << " threads ok" << std::endl;
+        }
+    }
+#endif
+
+    void verify_all(options const& settings) {
+        using value_type = std::uint64_t;
+
+        verify_sequence<ccl::stack<value_type>>("ccl::stack", settings, false);
+        verify_sequence<ccl::stack<value_type, std::allocator<value_type>, ccl::contiguous_storage>>(
+                "ccl::stack (contiguous)", settings, false);
+        verify_sequence<adaptive_stack<value_type>>("ccl::stack (adaptive)", settings, false);
+        verify_sequence<clustered_stack<value_type>>("ccl::stack (clustered)", settings, false);
+        verify_sequence<ccl::queue<value_type>>("ccl::queue", settings, true);
+        verify_sequence<adaptive_queue<value_type>>("ccl::queue (adaptive)", settings, true);
+        verify_sequence<clustered_queue<value_type>>("ccl::queue (clustered)", settings, true);
+        verify_sequence<ccl::queue<value_type, std::allocator<value_type>, ccl::contiguous_storage>>(
+                "ccl::queue (contiguous)", settings, true);
+        verify_sequence<ccl::queue<value_type, std::allocator<value_type>, ccl::ring_storage>>(
+                "ccl::queue (ring)", settings, true);
+        verify_bounded_queue<ccl::queue<value_type>>("ccl::queue (bounded)", settings);
+        verify_bounded_queue<ccl::queue<value_type, std::allocator<value_type>, ccl::ring_storage>>(
+                "ccl::queue (bounded ring)", settings);
+        verify_sequence<ccl::priority_queue<value_type>>("ccl::priority_queue", settings, false);
+        verify_priority_order<ccl::priority_queue<value_type>>("ccl::priority_queue (order)", settings);
+        verify_priority_order<clustered_priority_queue<value_type>>("ccl::priority_queue (clustered order)",
+                                                                    settings);
+        verify_channel<ccl::spsc_queue<value_type>>("ccl::spsc_queue", settings, true);
+        verify_channel<ccl::mpsc_queue<value_type>>("ccl::mpsc_queue", settings, false);
+        verify_scheduler("ccl::work_stealing_scheduler", settings);
+        verify_sequence<ccl::data_pool<value_type>>("ccl::data_pool", settings, false);
+        verify_sequence<ccl::data_pool<value_type, ccl::padded_nodes>>("ccl::data_pool (padded)", settings, false);
+        verify_sequence<compacting_pool>("ccl::data_pool (compacting)", settings, false);
+        verify_sequence<arena_pool>("ccl::data_pool (arena)", settings, false);
+        verify_pool_throwing_moves("ccl::data_pool (throwing moves)", settings);
+
+        verify_map<ccl::map<value_type, value_type>>("ccl::map", settings);
+        verify_map<ccl::numa_map<value_type, value_type>>("ccl::numa_map", settings);
+        verify_map<ccl::flat_map<value_type, value_type>>("ccl::flat_map", settings);
+        verify_map_updates<ccl::map<value_type, value_type>>("ccl::map (updates)", settings);
+        verify_map_updates<ccl::flat_map<value_type, value_type>>("ccl::flat_map (updates)", settings);
+        verify_map_scan("ccl::map (bulk and scan)", settings);
+
+#ifdef CCL_ENABLE_STATS
+        verify_combining_stats<ccl::stack<value_type>>("ccl::stack (stats)", settings);
+        verify_combining_stats<ccl::queue<value_type>>("ccl::queue (stats)", settings);
+        verify_combining_stats<ccl::priority_queue<value_type>>("ccl::priority_queue (stats)", settings);
+        verify_pool_stats("ccl::data_pool (stats)", settings);
+        verify_map_stats<ccl::map<value_type, value_type>>("ccl::map (stats)", settings, false);
+        verify_map_stats<ccl::flat_map<value_type, value_type>>("ccl::flat_map (stats)", settings, true);
+#endif
+    }
+
+    template<typename VALUE>
+    std::vector<VALUE> parse_list(std::string const& text) {
+        std::vector<VALUE> values;
+        std::istringstream stream(text);
+        std::string item;
+        while (std::getline(stream, item, ',')) {
+            std::istringstream item_stream(item);
+            VALUE value;
+            if (!(item_stream >> value)) {
+                throw std::invalid_argument("Invalid value '" + item + "'");
+            }
+            values.push_back(value);
+        }
+        return values;
+    }
+
+    void print_usage() {
+        std::cout << "Usage: ccl_benchmark [options]\n"
+                  << "  --threads=1,2,4      Thread counts to run with\n"
+                  << "  --operations=N       Operations per thread\n"
+                  << "  --writes=0.5         Share of pushes, or of inserts and erases for the maps\n"
+                  << "  --payloads=8,64      Value sizes in bytes (8, 64, 256 or 1024)\n"
+                  << "  --zipf=0,0.99        Key distributions for the maps, 0 being uniform\n"
+                  << "  --keys=N             Keys the maps draw from\n"
+                  << "  --prefill=N          Values pushed into stacks, queues and pools before measuring\n"
+                  << "  --filter=NAME        Only run containers whose name contains NAME\n"
+                  << "  --verify             Check the containers for lost, duplicated or reordered values instead\n";
+    }
+
+    options parse_options(int argc, char** argv) {
+        options settings;
+        for (int index = 1; index < argc; ++index) {
+            std::string argument = argv[index];
+            auto separator = argument.find('=');
+            auto name = argument.substr(0, separator);
+            auto value = separator == std::string::npos ? std::string() : argument.substr(separator + 1);
+
+            if (name == "--threads") {
+                settings.thread_counts = parse_list<unsigned int>(value);
+            } else if (name == "--operations") {
+                settings.operations = parse_list<std::size_t>(value).at(0);
+            } else if (name == "--writes") {
+                settings.write_ratios = parse_list<double>(value);
+            } else if (name == "--payloads") {
+                settings.payload_sizes = parse_list<std::size_t>(value);
+            } else if (name == "--zipf") {
+                settings.zipf_exponents = parse_list<double>(value);
+            } else if (name == "--keys") {
+                settings.key_count = std::max<std::size_t>(1, parse_list<std::size_t>(value).at(0));
+            } else if (name == "--prefill") {
+                settings.prefill = parse_list<std::size_t>(value).at(0);
+            } else if (name == "--filter") {
+                settings.filter = value;
+            } else if (name == "--verify") {
+                settings.verify = true;
+            } else {
+                print_usage();
+                std::exit(name == "--help" ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+        }
+        return settings;
+    }
+}
+
+int main(int argc, char** argv) {
+    using namespace ccl_benchmark;
+
+    options settings;
+    try {
+        settings = parse_options(argc, argv);
+    } catch (std::exception const& error) {
+        std::cerr << error.what() << std::endl;
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (settings.verify) {
+        verify_all(settings);
+        return EXIT_SUCCESS;
+    }
+
+    print_header();
+    for (auto payload_size : settings.payload_sizes) {
+        switch (payload_size) {
+            case 8: run_all<8>(settings); break;
+            case 64: run_all<64>(settings); break;
+            case 256: run_all<256>(settings); break;
+            case 1024: run_all<1024>(settings); break;
+            default:
+                std::cerr << "Unsupported payload size " << payload_size << ", skipping it" << std::endl;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
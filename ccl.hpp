@@ -10,19 +10,33 @@
 
 namespace ccl {
     unsigned int const MAXIMUM_RECORD_AGE = 100; // After 100 operations, old records are removed from publication list
+    unsigned int const SPIN_ATTEMPTS = 128; // Times a thread waiting on its request spins before it starts yielding
+    unsigned int const YIELD_ATTEMPTS = 16; // Times a thread waiting on its request yields before it parks
 }
 
 
+// Flat combining engine the stack, queue and priority queue are built on, for turning any sequential structure into a
+// concurrent one
+#include "containers/flat_combiner.hpp"
 // Concurrent stack (LIFO)
 #include "containers/stack.hpp"
 // Doubly-linked list (for fast insertion/erase but slow iteration)
 //#include "containers/list.hpp"
 // Concurrent Queue (FIFO)
 #include "containers/queue.hpp"
+// Concurrent priority queue (greatest value first)
+#include "containers/priority_queue.hpp"
+// Lock-free queues for channels with a single producer and consumer, or many producers and a single consumer
+#include "containers/spsc_queue.hpp"
+#include "containers/mpsc_queue.hpp"
+// Work-stealing deque (Chase-Lev) and a scheduler keeping one per worker thread
+#include "containers/work_stealing_deque.hpp"
 // Operates like a stack/queue in that data can be pushed into it, but pop randomly removes one pushed entry (there
 // are no guarantees about order).
 #include "containers/data_pool.hpp"
-// Concurrent Hash Map
+// Concurrent Hash Map, and ccl::numa_map which spreads its stripes over the NUMA nodes
 #include "containers/map.hpp"
+// Concurrent Hash Map using open addressing (Swiss table layout)
+#include "containers/flat_map.hpp"
 
 #endif //CCL_CCL_HPP
@@ -5,59 +5,687 @@
 #ifndef CCL_DATA_POOL_HPP
 #define CCL_DATA_POOL_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#include "detail.hpp"
+#include "event_count.hpp"
+#include "reclaim.hpp"
+#include "stats.hpp"
+
 namespace ccl {
     std::size_t const INITIAL_SIZE = 11;
     double const GROWTH_RATE = 1.5; // Growth rate (size increase) of each successive data pool entry.
+    std::size_t const HUGE_PAGE_SIZE = std::size_t(1) << 21; // Alignment of a data pool arena using huge pages
+
+    /**
+     * Node layout policy for ccl::data_pool keeping the nodes back to back (the default), so that a scan over a pool
+     * touches as few cache lines as possible.
+     */
+    struct packed_nodes {
+        static std::size_t const alignment = 1; // Nodes keep their natural alignment
+    };
+
+    /**
+     * Node layout policy for ccl::data_pool giving each node its own cache line(s), so that threads claiming
+     * neighboring nodes don't invalidate each other's lines. Costs memory and makes scans touch more lines, so it pays
+     * off when many threads push and pop at the same time.
+     */
+    struct padded_nodes {
+        static std::size_t const alignment = CACHE_LINE_SIZE;
+    };
+
+    /**
+     * Decides when a ccl::data_pool gives memory back. Compaction moves the values out of sparsely used pools into the
+     * rest, then frees the emptied pools, which keeps both memory use and the pool list (and with it scans) short.
+     */
+    struct shrink_policy {
+        double maximum_occupancy; // Pools holding at most this fraction of values to nodes are emptied and freed
+        std::size_t minimum_capacity; // Compaction never leaves fewer nodes than this
+        std::size_t compaction_interval; // Pops passing over an empty pool before one of them compacts, 0 never does
+        std::chrono::milliseconds helper_interval; // Pause between the compactions of the thread helper
+
+        shrink_policy()
+            : maximum_occupancy(0.25)
+            , minimum_capacity(INITIAL_SIZE)
+            , compaction_interval(64)
+            , helper_interval(10) {
+        }
+    };
+
+    /**
+     * Decides how a ccl::data_pool grows, and where its pools are allocated.
+     */
+    struct growth_policy {
+        std::size_t initial_capacity; // Nodes of the first pool (and of the one clear() starts over with)
+        double growth_rate; // Nodes of each new pool relative to the newest one
+        std::size_t arena_capacity; // Nodes an arena reserved up front has room for, 0 allocates every pool on its own
+        bool huge_pages; // Asks for the arena to be backed by transparent huge pages (Linux only)
+
+        growth_policy()
+            : initial_capacity(INITIAL_SIZE)
+            , growth_rate(GROWTH_RATE)
+            , arena_capacity(0)
+            , huge_pages(false) {
+        }
+    };
+
+    namespace detail {
+        /**
+         * One large block of memory that a data pool carves its pools out of, so that they sit next to each other
+         * (and, with huge pages, share as few TLB entries as possible). Pools are only allocated when growing or
+         * compacting, so the free ranges are simply kept in a map under a mutex, first fit and coalesced on free.
+         */
+        class pool_arena {
+        private:
+            char* memory;
+            std::size_t size;
+            bool mapped; // With mmap, rather than allocate_aligned
+            std::mutex mutex;
+            std::map<std::size_t, std::size_t> free_ranges; // Offset to length
+
+        public:
+            pool_arena(std::size_t size_, bool huge_pages)
+                : memory(nullptr)
+                , size(size_)
+                , mapped(false) {
+#if defined(__linux__)
+                // Mapped rather than allocated, so that the pages are only backed once touched and are given back to
+                // the system as a whole when the arena goes away
+                auto alignment = huge_pages ? HUGE_PAGE_SIZE : std::size_t(1);
+                size = (size + alignment - 1) / alignment * alignment;
+                auto length = size + alignment - 1;
+                auto mapping = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (mapping != MAP_FAILED) {
+                    auto start = reinterpret_cast<std::uintptr_t>(mapping);
+                    auto aligned = (start + alignment - 1) / alignment * alignment;
+                    if (aligned != start) {
+                        ::munmap(mapping, aligned - start);
+                    }
+                    if (aligned + size != start + length) {
+                        ::munmap(reinterpret_cast<void*>(aligned + size), start + length - aligned - size);
+                    }
+                    memory = reinterpret_cast<char*>(aligned);
+                    mapped = true;
+#if defined(MADV_HUGEPAGE)
+                    if (huge_pages) {
+                        ::madvise(memory, size, MADV_HUGEPAGE); // Only a hint, the kernel may not have any to give
+                    }
+#endif
+                }
+#else
+                (void) huge_pages;
+#endif
+                if (!memory) {
+                    memory = static_cast<char*>(allocate_aligned(size, CACHE_LINE_SIZE));
+                }
+                free_ranges[0] = size;
+            }
+
+            ~pool_arena() {
+#if defined(__linux__)
+                if (mapped) {
+                    ::munmap(memory, size);
+                    return;
+                }
+#endif
+                free_aligned(memory);
+            }
+
+            pool_arena(const pool_arena &other) = delete;
+            pool_arena &operator=(const pool_arena &other) = delete;
+
+            /**
+             * Returns bytes of memory aligned to alignment (a power of two), or nullptr if no free range is large
+             * enough.
+             */
+            void* allocate(std::size_t bytes, std::size_t alignment) {
+                std::lock_guard<std::mutex> lock(mutex);
+                // Offsets are rounded as addresses, since the heap fallback only aligns memory to a cache line
+                auto base = reinterpret_cast<std::uintptr_t>(memory);
+                for (auto range = free_ranges.begin(); range != free_ranges.end(); ++range) {
+                    auto offset = range->first;
+                    auto end = offset + range->second;
+                    auto address = (base + offset + alignment - 1) / alignment * alignment;
+                    auto aligned = static_cast<std::size_t>(address - base);
+                    if (aligned + bytes > end) continue;
+
+                    free_ranges.erase(range);
+                    if (aligned != offset) free_ranges[offset] = aligned - offset;
+                    if (aligned + bytes != end) free_ranges[aligned + bytes] = end - aligned - bytes;
+                    return memory + aligned;
+                }
+                return nullptr;
+            }
+
+            void deallocate(void* pointer, std::size_t bytes) {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto offset = static_cast<std::size_t>(static_cast<char*>(pointer) - memory);
+                auto range = free_ranges.emplace(offset, bytes).first;
+
+                // Merge with the free ranges on either side
+                auto next = std::next(range);
+                if (next != free_ranges.end() && range->first + range->second == next->first) {
+                    range->second += next->second;
+                    free_ranges.erase(next);
+                }
+                if (range != free_ranges.begin()) {
+                    auto previous = std::prev(range);
+                    if (previous->first + previous->second == range->first) {
+                        previous->second += range->second;
+                        free_ranges.erase(range);
+                    }
+                }
+            }
+        };
+    }
 
     /**
      * Allows data to be pushed into a "pool" of data, where pops remove one entry with no guarantee about which is
-     * removed (no order for popping).
+     * removed (no order for popping). The PADDING policy (packed_nodes or padded_nodes) decides how nodes are laid
+     * out in memory.
+     *
+     * Each pool is a single allocation holding its bitmaps followed by its nodes. The growth_policy passed to the
+     * constructor decides the size of the first pool and how much larger each new one is, and may reserve an arena up
+     * front that pools are carved out of (falling back to the heap once it is full), so that a data pool sized for its
+     * steady state starts out with a single allocation and scans walk contiguous memory.
      */
-    template<typename T>
+    template<typename T, typename PADDING = packed_nodes>
     class data_pool {
     private:
-        struct node {
-            std::atomic_flag available_write;
-            std::atomic_flag available_read;
-            T data;
+        static std::size_t const BITMAP_BITS = 64; // Nodes covered by each node_bitmap
 
-            node ()
-                : available_write(ATOMIC_FLAG_INIT)
-                , available_read(ATOMIC_FLAG_INIT) {
-                // Lock available_read until it is available for reading
-                available_read.test_and_set();
-            }
+        // The strictest of the alignments applies, so this never weakens the alignment node would have had anyway
+        struct alignas(PADDING::alignment) alignas(T) node {
+            detail::value_slot<T> data; // Only holds a value while the node is claimed for it
         };
 
         /**
-         * Holds an array of nodes.
+         * The state of 64 consecutive nodes, one bit per node. A set bit in claimed means the node holds a value or
+         * is being written to or read from, a set bit in readable means the node holds a value nobody has popped yet.
+         * Setting a bit with an atomic fetch_or (or clearing it with fetch_and) and checking that it wasn't set
+         * (cleared) already is what claims a node, so a scan only needs one load per 64 nodes and only ever touches
+         * nodes it is likely to get.
+         */
+        struct alignas(PADDING::alignment) alignas(std::uint64_t) node_bitmap {
+            std::atomic<std::uint64_t> claimed;
+            std::atomic<std::uint64_t> readable;
+        };
+
+        // Bitmaps sharing a cache line, which threads scanning from different places in a pool should start apart by
+        static std::size_t const BITMAPS_PER_LINE =
+                sizeof(node_bitmap) < CACHE_LINE_SIZE ? CACHE_LINE_SIZE / sizeof(node_bitmap) : 1;
+
+        // Pools start on a cache line, so that the bitmaps of each home shard share a line
+        static std::size_t const POOL_ALIGNMENT = std::max(std::max(alignof(node), alignof(node_bitmap)),
+                                                           CACHE_LINE_SIZE);
+
+        /**
+         * Holds an array of nodes, in one block of memory with their bitmaps in front of them.
          */
         struct pool {
-            std::vector<node> node_array;
+            node_bitmap* bitmaps;
+            node* node_array;
+            std::size_t bitmap_count;
             std::size_t size;
-            pool* next;
+            std::atomic<pool*> next; // Changes when compaction unlinks the pool after it
+            std::shared_ptr<detail::pool_arena> arena; // Where the block came from, nullptr for the heap. Shared,
+                                                       // since retired pools may be freed after the data pool is gone
+
+            static std::size_t bitmap_bytes(std::size_t bitmap_count_) {
+                return (bitmap_count_ * sizeof(node_bitmap) + alignof(node) - 1) / alignof(node) * alignof(node);
+            }
 
-            pool(std::size_t size_)
-                : node_array(size_)
+            /**
+             * Returns the size of the block of a pool with size_ nodes.
+             */
+            static std::size_t block_bytes(std::size_t size_) {
+                return bitmap_bytes((size_ + BITMAP_BITS - 1) / BITMAP_BITS) + size_ * sizeof(node);
+            }
+
+            pool(std::size_t size_, std::shared_ptr<detail::pool_arena> const& arena_)
+                : bitmaps(nullptr)
+                , node_array(nullptr)
+                , bitmap_count((size_ + BITMAP_BITS - 1) / BITMAP_BITS)
+                , size(size_)
                 , next(nullptr)
-                , size(size_) {
+                , arena(arena_) {
+                void* block = arena ? arena->allocate(block_bytes(size), POOL_ALIGNMENT) : nullptr;
+                if (!block) {
+                    arena.reset();
+                    block = detail::allocate_aligned(block_bytes(size), POOL_ALIGNMENT);
+                }
+
+                bitmaps = static_cast<node_bitmap*>(block);
+                node_array = reinterpret_cast<node*>(static_cast<char*>(block) + bitmap_bytes(bitmap_count));
+                for (std::size_t index = 0; index < bitmap_count; ++index) {
+                    auto bitmap = ::new (static_cast<void*>(&bitmaps[index])) node_bitmap;
+                    bitmap->claimed.store(0, std::memory_order_relaxed);
+                    bitmap->readable.store(0, std::memory_order_relaxed);
+                }
+                for (std::size_t index = 0; index < size; ++index) {
+                    ::new (static_cast<void*>(&node_array[index])) node;
+                }
+
+                // The bits past the last node are permanently claimed so that pushes never pick them
+                if (size % BITMAP_BITS) {
+                    bitmaps[bitmap_count - 1].claimed.store(~std::uint64_t(0) << (size % BITMAP_BITS),
+                                                            std::memory_order_relaxed);
+                }
             }
+
+            ~pool() {
+                // Nobody can be pushing or popping anymore, so the readable nodes are exactly the ones holding a value
+                for (std::size_t index = 0; index < bitmap_count; ++index) {
+                    auto readable = bitmaps[index].readable.load(std::memory_order_acquire);
+                    for (; readable; readable &= readable - 1) {
+                        node_array[index * BITMAP_BITS + detail::count_trailing_zeros(readable)].data.destroy();
+                    }
+                }
+
+                if (arena) {
+                    arena->deallocate(bitmaps, block_bytes(size));
+                } else {
+                    detail::free_aligned(bitmaps);
+                }
+            }
+
+            pool(const pool &other) = delete;
+            pool &operator=(const pool &other) = delete;
         };
 
-        std::atomic<pool*> pool_head;
+        std::atomic<pool*> pool_head; // Pools are retired through ccl::reclaim, so traversals pin themselves first
         std::atomic_flag thread_helper;
+        shrink_policy policy;
+        growth_policy growth;
+        std::shared_ptr<detail::pool_arena> arena; // Reserved by the growth policy, or nullptr
+
+        std::mutex maintenance_mutex; // Held while compacting or clearing, the only times pools are unlinked
+        std::atomic<std::size_t> empty_scans; // Pops that passed over an empty pool since the last compaction
+        detail::striped_counter value_count; // Pushed and not yet popped, striped so counting stays uncontended
+
+        std::thread helper;
+        std::atomic<bool> helper_stopping;
+        event_count helper_events;
+
+#ifdef CCL_ENABLE_STATS
+        detail::sharded<detail::pool_counters> statistics;
+#endif
+
+        /**
+         * Adds a new, larger pool as the head of the pool list.
+         */
+        void grow() {
+            auto old_head = pool_head.load();
+            // The cost of allocation on the heap is expensive, so even if old_head is outdated, the size calculated
+            // is fine to use.
+            auto new_size = std::max(static_cast<std::size_t>(old_head->size * growth.growth_rate), old_head->size + 1);
+            auto new_pool = new pool(new_size, arena);
+            do {
+                new_pool->next = old_head;
+            } while (!pool_head.compare_exchange_weak(old_head, new_pool));
+        }
+
+        /**
+         * Returns the bitmap of a pool with bitmap_count bitmaps that the calling thread starts its scans at. Every
+         * thread has its own home shard (one cache line of bitmaps) in each pool, so that threads don't all fight over
+         * the first nodes, and wraps around into the other shards when its own is full or empty.
+         */
+        static std::size_t home_bitmap(std::size_t bitmap_count) {
+            auto shards = (bitmap_count + BITMAPS_PER_LINE - 1) / BITMAPS_PER_LINE;
+            return detail::scale_seed(detail::thread_seed(), shards) * BITMAPS_PER_LINE;
+        }
+
+        /**
+         * Returns the lowest maximum set bits of bits (or all of them if it has fewer).
+         */
+        static std::uint64_t lowest_bits(std::uint64_t bits, std::size_t maximum) {
+            if (maximum >= BITMAP_BITS) return bits;
+
+            std::uint64_t lowest = 0;
+            for (; bits && maximum; --maximum) {
+                auto bit = bits & (~bits + 1);
+                lowest |= bit;
+                bits ^= bit;
+            }
+            return lowest;
+        }
+
+        /**
+         * Claims up to maximum open nodes of current_pool for writing, calling write(node_entry) on each one, which
+         * must produce the node's value. Returns how many nodes were written. If write throws, the nodes written so
+         * far keep their values and the rest are released before the exception is passed on.
+         */
+        template<typename WRITE>
+        std::size_t claim_open(pool* current_pool, std::size_t maximum, WRITE write) {
+            std::size_t written = 0;
+            auto bitmap_count = current_pool->bitmap_count;
+            auto start = home_bitmap(bitmap_count);
+            std::size_t step = 0;
+            for (; step < bitmap_count && written < maximum; ++step) {
+                auto index = start + step < bitmap_count ? start + step : start + step - bitmap_count;
+                auto& bitmap = current_pool->bitmaps[index];
+                auto open = ~bitmap.claimed.load(std::memory_order_relaxed);
+                while (open && written < maximum) {
+                    auto wanted = lowest_bits(open, maximum - written);
+                    auto previous = bitmap.claimed.fetch_or(wanted, std::memory_order_acquire);
+                    auto won = wanted & ~previous; // Another thread may have claimed some of them first
+                    open = ~(previous | wanted);
+                    if (!won) continue;
+
+                    std::uint64_t filled = 0;
+                    try {
+                        for (auto bits = won; bits; bits &= bits - 1) {
+                            write(current_pool->node_array[index * BITMAP_BITS + detail::count_trailing_zeros(bits)]);
+                            filled |= bits & (~bits + 1);
+                            ++written;
+                        }
+                    } catch (...) {
+                        // Publish the values already written and give back the nodes that never got one, which would
+                        // otherwise stay claimed forever and leave clear() and compaction waiting on them
+                        bitmap.readable.fetch_or(filled, std::memory_order_release);
+                        bitmap.claimed.fetch_and(~(won & ~filled), std::memory_order_release);
+                        throw;
+                    }
+
+                    // Unlocks the nodes for reading
+                    bitmap.readable.fetch_or(won, std::memory_order_release);
+                }
+            }
+            CCL_STATS(statistics.local().words_scanned.record(step);)
+            return written;
+        }
+
+        /**
+         * Claims up to maximum readable nodes of current_pool, calling read(node_entry) on each one, which must take
+         * the node's value. Returns how many nodes were read.
+         */
+        template<typename READ>
+        std::size_t claim_readable(pool* current_pool, std::size_t maximum, READ read) {
+            std::size_t popped = 0;
+            auto bitmap_count = current_pool->bitmap_count;
+            auto start = home_bitmap(bitmap_count);
+            std::size_t step = 0;
+            for (; step < bitmap_count && popped < maximum; ++step) {
+                auto index = start + step < bitmap_count ? start + step : start + step - bitmap_count;
+                auto& bitmap = current_pool->bitmaps[index];
+                auto readable = bitmap.readable.load(std::memory_order_relaxed);
+                while (readable && popped < maximum) {
+                    auto wanted = lowest_bits(readable, maximum - popped);
+                    auto previous = bitmap.readable.fetch_and(~wanted, std::memory_order_acquire);
+                    auto won = wanted & previous; // Another thread may have popped some of them first
+                    readable = previous & ~wanted;
+                    if (!won) continue;
+
+                    for (auto bits = won; bits; bits &= bits - 1) {
+                        read(current_pool->node_array[index * BITMAP_BITS + detail::count_trailing_zeros(bits)]);
+                        ++popped;
+                    }
+
+                    // Makes the nodes available to be overwritten
+                    bitmap.claimed.fetch_and(~won, std::memory_order_release);
+                }
+            }
+            CCL_STATS(statistics.local().words_scanned.record(step);)
+            return popped;
+        }
+
+        /**
+         * Removes old_pool from the pool list. Other threads only ever add pools at the head, while the caller holds
+         * maintenance_mutex, which makes it the only thread removing any.
+         */
+        void unlink(pool* old_pool) {
+            auto expected = old_pool;
+            if (pool_head.compare_exchange_strong(expected, old_pool->next.load())) return;
+
+            // Pools were added in front of it, one of which now links to it
+            auto previous = expected;
+            while (previous->next.load() != old_pool) {
+                previous = previous->next.load();
+            }
+            previous->next.store(old_pool->next.load());
+        }
+
+        /**
+         * Stores the values in [first, last) for push_bulk and drain, adding each one to stored once it is in a node
+         * (so that a caller catching an exception knows how many made it). Counting them is left to the caller, since
+         * values moved by compaction never left the data pool.
+         */
+        template<typename ITERATOR>
+        void place(ITERATOR first, ITERATOR last, std::size_t& stored) {
+            auto remaining = static_cast<std::size_t>(std::distance(first, last));
+            reclaim::epoch_guard guard;
+            while (remaining) {
+                auto current_pool = pool_head.load();
+                while (current_pool && remaining) {
+                    remaining -= claim_open(current_pool, remaining, [&](node& node_entry) {
+                        node_entry.data.emplace(*first++);
+                        ++stored;
+                    });
+
+                    current_pool = current_pool->next;
+                }
+
+                // Ran out of open entries with values left over, expand the pool and continue
+                if (remaining) grow();
+            }
+        }
+
+        /**
+         * Returns the bits of bitmap index of old_pool that don't stand for a node, which stay claimed for good.
+         */
+        static std::uint64_t past_end_bits(pool* old_pool, std::size_t index) {
+            if (index + 1 == old_pool->bitmap_count && old_pool->size % BITMAP_BITS) {
+                return ~std::uint64_t(0) << (old_pool->size % BITMAP_BITS);
+            }
+            return 0;
+        }
+
+        /**
+         * Claims every node covered by one bitmap of old_pool, calling take(node_entry) on each node holding a value,
+         * which must take the node's value. Afterwards no other thread writes to or reads from those nodes again.
+         * Nodes in the middle of being pushed or popped by another thread are waited for, which only takes as long as
+         * moving one value. Returns how many values were taken.
+         *
+         * If take throws, it must leave that node's value in place. The nodes still holding a value are then made
+         * readable again and every other node is released before the exception is passed on.
+         */
+        template<typename TAKE>
+        std::size_t take_bitmap(pool* old_pool, std::size_t index, TAKE take) {
+            auto& bitmap = old_pool->bitmaps[index];
+            auto const past_end = past_end_bits(old_pool, index);
+            auto owned = past_end;
+
+            std::size_t taken_count = 0;
+            while (true) {
+                // Claim every open node so that nothing new is pushed here, then take the values already pushed
+                owned |= ~bitmap.claimed.fetch_or(~std::uint64_t(0), std::memory_order_acquire);
+                auto taken = bitmap.readable.exchange(0, std::memory_order_acquire);
+                auto bits = taken;
+                try {
+                    for (; bits; bits &= bits - 1) {
+                        take(old_pool->node_array[index * BITMAP_BITS + detail::count_trailing_zeros(bits)]);
+                        ++taken_count;
+                    }
+                } catch (...) {
+                    // Otherwise the bitmap would stay claimed with nothing readable, and the next clear() or
+                    // compaction to get here would wait for it forever
+                    bitmap.readable.fetch_or(bits, std::memory_order_release);
+                    bitmap.claimed.fetch_and(~((owned | taken) & ~bits & ~past_end), std::memory_order_release);
+                    throw;
+                }
+                owned |= taken;
+                if (owned == ~std::uint64_t(0)) return taken_count;
+
+                std::this_thread::yield();
+            }
+        }
+
+        /**
+         * Moves every value out of old_pool into the other pools, leaving old_pool with all of its nodes claimed.
+         *
+         * If moving a value throws, the nodes drained so far are released again and the values taken out but not yet
+         * placed are pushed back, possibly into old_pool itself, which has to stay in the pool list. Only values whose
+         * move throws a second time are lost.
+         */
+        void drain(pool* old_pool) {
+            std::vector<T> moved;
+            moved.reserve(BITMAP_BITS); // So that only T's move constructor can throw while a bitmap is taken
+            std::size_t drained = 0; // Bitmaps whose nodes are all claimed by this thread
+            std::size_t placed = 0; // Values of moved already in another node
+            try {
+                for (std::size_t index = 0; index < old_pool->bitmap_count; ++index) {
+                    placed = 0;
+                    take_bitmap(old_pool, index, [&moved](node& node_entry) {
+                        moved.push_back(std::move(node_entry.data.get()));
+                        node_entry.data.destroy();
+                    });
+                    drained = index + 1;
+
+                    CCL_STATS(detail::count(statistics.local().pushes, moved.size());)
+                    place(std::make_move_iterator(moved.begin()), std::make_move_iterator(moved.end()), placed);
+                    moved.clear();
+                }
+            } catch (...) {
+                for (std::size_t released = 0; released < drained; ++released) {
+                    old_pool->bitmaps[released].claimed.store(past_end_bits(old_pool, released),
+                                                              std::memory_order_release);
+                }
+
+                std::int64_t lost = 0;
+                for (auto value = moved.begin() + static_cast<std::ptrdiff_t>(placed); value != moved.end(); ++value) {
+                    std::size_t stored = 0;
+                    try {
+                        place(std::make_move_iterator(value), std::make_move_iterator(value + 1), stored);
+                    } catch (...) {
+                        ++lost;
+                    }
+                }
+                if (lost) value_count.add(-lost);
+                throw;
+            }
+        }
+
+        /**
+         * Runs one compaction with maintenance_mutex held, returning how many nodes were freed.
+         */
+        std::size_t compact_locked() {
+            empty_scans.store(0, std::memory_order_relaxed);
+
+            reclaim::epoch_guard guard;
+            std::vector<pool*> pools;
+            std::size_t capacity = 0;
+            std::size_t values = 0;
+            for (auto current_pool = pool_head.load(); current_pool; current_pool = current_pool->next) {
+                pools.push_back(current_pool);
+                capacity += current_pool->size;
+                for (std::size_t index = 0; index < current_pool->bitmap_count; ++index) {
+                    values += detail::count_set_bits(current_pool->bitmaps[index].readable.load(
+                            std::memory_order_relaxed));
+                }
+            }
+
+            auto sparse = [this](pool* current_pool) {
+                std::size_t pool_values = 0;
+                for (std::size_t index = 0; index < current_pool->bitmap_count; ++index) {
+                    pool_values += detail::count_set_bits(current_pool->bitmaps[index].readable.load(
+                            std::memory_order_relaxed));
+                }
+                return pool_values <= policy.maximum_occupancy * current_pool->size;
+            };
+
+            // The head pool is the largest, so it is only given up for a smaller one if it is far too large
+            auto wanted_size = std::max(std::max(policy.minimum_capacity, INITIAL_SIZE),
+                                        static_cast<std::size_t>(values * growth.growth_rate) + 1);
+            auto first_candidate = std::size_t(1);
+            if (wanted_size * growth.growth_rate < pools.front()->size && sparse(pools.front())) {
+                auto new_pool = new pool(wanted_size, arena);
+                auto old_head = pool_head.load();
+                do {
+                    new_pool->next = old_head;
+                } while (!pool_head.compare_exchange_weak(old_head, new_pool));
+                capacity += wanted_size;
+                first_candidate = 0;
+            }
+
+            // Oldest (smallest) pools first, their values are moved towards the head
+            std::size_t freed = 0;
+            for (auto index = pools.size(); index-- > first_candidate;) {
+                auto old_pool = pools[index];
+                if (capacity - old_pool->size < policy.minimum_capacity || !sparse(old_pool)) continue;
+
+                drain(old_pool);
+                unlink(old_pool);
+                reclaim::retire(old_pool);
+                capacity -= old_pool->size;
+                freed += old_pool->size;
+                CCL_STATS(detail::count(statistics.local().pools_freed);)
+            }
+            CCL_STATS(if (freed) detail::count(statistics.local().compactions);)
+            return freed;
+        }
+
+        /**
+         * Called by pops that passed over an empty pool, compacting once enough of them did. Never blocks, if another
+         * thread is already compacting there is nothing left to do.
+         */
+        void note_empty_scan() {
+            if (!policy.compaction_interval ||
+                empty_scans.fetch_add(1, std::memory_order_relaxed) + 1 < policy.compaction_interval) return;
+
+            std::unique_lock<std::mutex> lock(maintenance_mutex, std::try_to_lock);
+            if (lock.owns_lock()) {
+                compact_locked();
+            }
+        }
 
     public:
-        data_pool()
-            : thread_helper(ATOMIC_FLAG_INIT) {
+        data_pool(shrink_policy policy_ = shrink_policy())
+            : data_pool(growth_policy(), policy_) {
+        }
+
+        /**
+         * Constructs a data pool whose first pool has room for growth_.initial_capacity values, reserving an arena for
+         * growth_.arena_capacity nodes first if that isn't 0.
+         */
+        explicit data_pool(growth_policy growth_, shrink_policy policy_ = shrink_policy())
+            : thread_helper(ATOMIC_FLAG_INIT)
+            , policy(policy_)
+            , growth(growth_)
+            , empty_scans(0)
+            , helper_stopping(false) {
+            growth.initial_capacity = std::max<std::size_t>(growth.initial_capacity, 1);
+            if (growth.arena_capacity) {
+                arena = std::make_shared<detail::pool_arena>(pool::block_bytes(growth.arena_capacity),
+                                                             growth.huge_pages);
+            }
+
             // Initialize first data pool
-            pool_head = new pool(INITIAL_SIZE);
+            pool_head = new pool(growth.initial_capacity, arena);
         }
 
         ~data_pool() {
+            if (helper.joinable()) {
+                helper_stopping.store(true);
+                helper_events.notify_all();
+                helper.join();
+            }
+
             auto pool_entry = pool_head.load();
             while (pool_entry) {
                 auto old_entry = pool_entry;
@@ -69,80 +697,168 @@ namespace ccl {
         /**
          * Go through the pool to find an open entry to add to.
          */
-        void push(T value) {
+        void push(T const& value) {
+            emplace(value);
+        }
+
+        void push(T&& value) {
+            emplace(std::move(value));
+        }
+
+        /**
+         * Adds a value constructed from args, right in the node it is stored in.
+         */
+        template<typename... ARGS>
+        void emplace(ARGS&&... args) {
+            reclaim::epoch_guard guard;
             while (true) {
                 auto current_pool = pool_head.load();
                 while (current_pool) {
-                    for (auto& node_entry : current_pool->node_array) {
-                        if (!node_entry.available_write.test_and_set()) {
-                            // Node is available to use
-                            node_entry.data = std::move(value);
-
-                            // Unlocks the node for reading
-                            node_entry.available_read.clear();
-
-                            return;
-                        }
+                    auto written = claim_open(current_pool, 1, [&](node& node_entry) {
+                        node_entry.data.emplace(std::forward<ARGS>(args)...);
+                    });
+                    if (written) {
+                        value_count.add(1);
+                        CCL_STATS(detail::count(statistics.local().pushes);)
+                        return;
                     }
 
                     current_pool = current_pool->next;
                 }
 
                 // If we reach this point, we need to expand the pool to try again
-                auto old_head = pool_head.load();
-                auto new_pool = new pool(old_head->size * GROWTH_RATE); // The cost of allocation on the heap is
-                                                                        // expensive, so even if old_head is outdated,
-                                                                        // the size calculated is fine to use.
-                do {
-                    new_pool->next = old_head;
-                } while (!pool_head.compare_exchange_weak(old_head, new_pool));
+                grow();
+            }
+        }
+
+        /**
+         * Pushes the values in [first, last), claiming open entries in a single pass over the pools instead of
+         * rescanning from the first pool for every value.
+         */
+        template<typename ITERATOR>
+        void push_bulk(ITERATOR first, ITERATOR last) {
+            std::size_t pushed = 0;
+            try {
+                place(first, last, pushed);
+            } catch (...) {
+                // The values stored before the one that threw stay in the data pool
+                value_count.add(static_cast<std::int64_t>(pushed));
+                throw;
+            }
+            CCL_STATS(detail::count(statistics.local().pushes, pushed);)
+            if (pushed) value_count.add(static_cast<std::int64_t>(pushed)); // Once for the whole batch
+        }
+
+        /**
+         * Pops up to maximum entries in a single pass over the pools, writing them to output. Returns how many entries
+         * were popped.
+         */
+        template<typename OUTPUT_ITERATOR>
+        std::size_t try_pop_n(OUTPUT_ITERATOR output, std::size_t maximum) {
+            std::size_t popped = 0;
+            bool passed_empty_pool = false;
+            {
+                reclaim::epoch_guard guard;
+                auto head = pool_head.load();
+                for (auto current_pool = head; current_pool && popped < maximum; current_pool = current_pool->next) {
+                    auto pool_popped = claim_readable(current_pool, maximum - popped, [&](node& node_entry) {
+                        *output++ = std::move(node_entry.data.get());
+                        node_entry.data.destroy();
+                    });
+                    passed_empty_pool |= !pool_popped && current_pool != head;
+                    popped += pool_popped;
+                }
             }
+
+            if (popped) value_count.add(-static_cast<std::int64_t>(popped));
+            if (passed_empty_pool) note_empty_scan();
+            CCL_STATS(auto& counters = statistics.local();
+                      detail::count(counters.pops, popped);
+                      if (!popped) detail::count(counters.empty_pops);)
+            return popped;
         }
 
         /**
          * Searches the pool for an available data to pop, returning true if it is able.
          */
         bool try_pop(T& return_value) {
-            auto current_pool = pool_head.load();
-            while (current_pool) {
-                // Iterate through each node looking for a readable node
-                for (auto& node_entry : current_pool->node_array) {
-                    if (!node_entry.available_read.test_and_set()) {
-                        // Gained the lock on this entry, copy the value and make it available to be overwritten
-                        return_value = node_entry.data;
-                        // We overwrite the data since we don't want it to hang around past its lifetime.
-                        node_entry.data = T();
-                        node_entry.available_write.clear();
-                        return true;
-                    }
+            bool popped = false;
+            bool passed_empty_pool = false;
+            {
+                reclaim::epoch_guard guard;
+                auto head = pool_head.load();
+                for (auto current_pool = head; current_pool && !popped; current_pool = current_pool->next) {
+                    // Only the nodes marked readable are looked at, 64 of them per load
+                    popped = claim_readable(current_pool, 1, [&](node& node_entry) {
+                        return_value = std::move(node_entry.data.get());
+                        // We destroy the data since we don't want it to hang around past its lifetime.
+                        node_entry.data.destroy();
+                    }) != 0;
+                    passed_empty_pool |= !popped && current_pool != head;
                 }
-
-                current_pool = current_pool->next;
             }
 
-            // No pools left to read
-            return false;
+            if (popped) value_count.add(-1);
+
+            // Pools that are passed over empty are what compaction gets rid of
+            if (passed_empty_pool) note_empty_scan();
+            CCL_STATS(detail::count(popped ? statistics.local().pops : statistics.local().empty_pops);)
+            return popped;
         }
 
         /**
-         * Removes all entries and "resets" the data pool.
+         * Removes all entries and "resets" the data pool. Values pushed at the same time may be removed as well.
          */
         void clear() {
-            // Sets the pool_head to a completely new data pool
-            auto old_head = pool_head.load();
-            auto new_head = new pool(INITIAL_SIZE);
-            // The while loop is necessary since we need to know what the previous head was before we set the new one
-            while(!pool_head.compare_exchange_weak(old_head, new_head));
+            std::lock_guard<std::mutex> lock(maintenance_mutex);
 
+            // Sets the pool_head to a completely new data pool
+            auto old_head = pool_head.exchange(new pool(growth.initial_capacity, arena));
 
-            // Todo: Add a counter for each pool that is incremented whenever someone is using it
-            // would be much easier if shared_ptr was atomic!
-            // Clean up the old pools
+            // The values are destroyed right away, so that exactly those removed are taken off the count. Other threads
+            // may still be scanning the old pools, so the pools themselves are only freed once they are done.
+            std::size_t removed = 0;
             while (old_head) {
                 auto old_entry = old_head;
                 old_head = old_head->next;
-                //delete old_entry;
+                for (std::size_t index = 0; index < old_entry->bitmap_count; ++index) {
+                    removed += take_bitmap(old_entry, index, [](node& node_entry) {
+                        node_entry.data.destroy();
+                    });
+                }
+                reclaim::retire(old_entry);
+                CCL_STATS(detail::count(statistics.local().pools_freed);)
             }
+            value_count.add(-static_cast<std::int64_t>(removed));
+        }
+
+        /**
+         * Returns how many values the data pool holds, adding up the count that pushes and pops keep on their own
+         * stripes. Values pushed or popped while the stripes are read may or may not be counted, while values being
+         * moved by compaction are counted throughout.
+         */
+        std::size_t size_approx() const {
+            return value_count.load();
+        }
+
+        /**
+         * Returns whether the data pool holds no values. It should be noted that another thread may have already
+         * pushed a value by the time the returned boolean is used.
+         */
+        bool empty() const {
+            return size_approx() == 0;
+        }
+
+        /**
+         * Moves the values of sparsely used pools into the others and frees the emptied pools, as decided by the
+         * shrink policy. Pops passing over empty pools call this on their own, so it is only needed to shrink the data
+         * pool right away. Returns how many nodes were freed.
+         *
+         * Values are briefly out of the data pool while they are moved, during which pops can miss them.
+         */
+        std::size_t compact() {
+            std::lock_guard<std::mutex> lock(maintenance_mutex);
+            return compact_locked();
         }
 
         /**
@@ -151,21 +867,45 @@ namespace ccl {
          * structure don't have to iterate through many empty nodes to find a value to pop and keeps the data in the
          * most active and largest pools for temporal/spatial locality.
          *
-         * NOTE: This is a test feature and returns false if the feature is not available.
+         * The helper compacts every helper_interval of the shrink policy until the data pool is destroyed. Returns
+         * true once the helper is running, calling it again has no effect.
          */
         bool enable_helper() {
             if (!thread_helper.test_and_set()) {
+                helper = std::thread([this]() {
+                    while (true) {
+                        auto key = helper_events.prepare_wait();
+                        if (helper_stopping.load()) {
+                            helper_events.cancel_wait();
+                            return;
+                        }
+                        helper_events.wait_until(key, std::chrono::steady_clock::now() + policy.helper_interval);
+                        if (helper_stopping.load()) return;
 
+                        compact();
+                    }
+                });
             }
 
-            return false;
+            return true;
         }
+
+#ifdef CCL_ENABLE_STATS
+        /**
+         * Returns the statistics gathered so far, added up over all threads, along with the current pool list. Values
+         * moved by compaction count as pushed again. Only available when compiled with CCL_ENABLE_STATS.
+         */
+        pool_stats stats() {
+            auto snapshot = detail::collect<pool_stats>(statistics);
+            reclaim::epoch_guard guard;
+            for (auto current_pool = pool_head.load(); current_pool; current_pool = current_pool->next) {
+                ++snapshot.pool_count;
+                snapshot.capacity += current_pool->size;
+            }
+            return snapshot;
+        }
+#endif
     };
 }
 
-#endif //CCL_DATA_POOL_HPP
-
-/**
- *  Notes:
- *    - Consider using shared_ptr for pools to handle destructing.
- */
\ No newline at end of file
+#endif //CCL_DATA_POOL_HPP
\ No newline at end of file
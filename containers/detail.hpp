@@ -0,0 +1,336 @@
+//
+// Small helpers shared by the container implementations. Nothing here is part of the public interface.
+//
+
+#ifndef CCL_DETAIL_HPP
+#define CCL_DETAIL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace ccl {
+    std::size_t const CACHE_LINE_SIZE = 64; // Fields written by different threads are kept this far apart
+    std::size_t const COUNTER_STRIPES = 16; // Stripes of a counter shared by every thread, see detail::striped_counter
+
+    namespace detail {
+        /**
+         * Scrambles a user provided hash so that all of its bits are well distributed (std::hash of an integer is
+         * commonly the identity). The mix is a bijection, so distinct hashes remain distinct.
+         */
+        inline std::size_t mix_hash(std::size_t hash) {
+            std::uint64_t mixed = hash;
+            mixed ^= mixed >> 33;
+            mixed *= 0xff51afd7ed558ccdULL;
+            mixed ^= mixed >> 33;
+            return static_cast<std::size_t>(mixed);
+        }
+
+        /**
+         * Returns a value unique to the calling thread, spread evenly over 64 bits. Consecutive threads get values a
+         * golden ratio apart, so the top bits of the seeds of any number of threads are as far apart as they can be.
+         */
+        inline std::uint64_t thread_seed() {
+            static std::atomic<std::uint64_t> thread_count(0);
+            static thread_local std::uint64_t seed =
+                    (thread_count.fetch_add(1, std::memory_order_relaxed) + 1) * 0x9e3779b97f4a7c15ULL;
+            return seed;
+        }
+
+        /**
+         * Maps seed to [0, range) by its top bits.
+         */
+        inline std::size_t scale_seed(std::uint64_t seed, std::size_t range) {
+            return static_cast<std::size_t>(((seed >> 32) * range) >> 32);
+        }
+
+        /**
+         * Returns the amount of hardware threads, or 1 if it can't be determined.
+         */
+        inline std::size_t hardware_threads() {
+            auto cores = std::thread::hardware_concurrency();
+            return cores ? cores : 1;
+        }
+
+        /**
+         * Calls task(index) for every index in [0, task_count), spread over up to thread_count threads (the calling
+         * thread being one of them), which take the next index whenever they finish one. Once a task throws, no more
+         * are started and the first exception is rethrown after all of the threads are done.
+         */
+        template<typename TASK>
+        void parallel_for(std::size_t task_count, std::size_t thread_count, TASK task) {
+            std::atomic<std::size_t> next_task(0);
+            std::exception_ptr failure;
+            std::mutex failure_mutex;
+            auto work = [&]() {
+                for (auto index = next_task.fetch_add(1); index < task_count; index = next_task.fetch_add(1)) {
+                    try {
+                        task(index);
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(failure_mutex);
+                        if (!failure) failure = std::current_exception();
+                        next_task.store(task_count);
+                    }
+                }
+            };
+
+            std::vector<std::thread> helpers;
+            auto helper_count = (thread_count < task_count ? thread_count : task_count);
+            for (std::size_t helper = 1; helper < helper_count; ++helper) {
+                try {
+                    helpers.emplace_back(work);
+                } catch (std::system_error const&) {
+                    break; // Out of threads, make do with those already running
+                }
+            }
+            work();
+            for (auto& helper : helpers) {
+                helper.join();
+            }
+            if (failure) std::rethrow_exception(failure);
+        }
+
+        /**
+         * Tells the processor that this is a spin-wait loop, which saves power and frees up pipeline resources for a
+         * sibling hyper-thread.
+         */
+        inline void cpu_relax() {
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+            __builtin_ia32_pause();
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+            _mm_pause();
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+            asm volatile("yield");
+#endif
+        }
+
+        /**
+         * Allocates memory starting at a multiple of alignment (a power of two), to be freed with free_aligned.
+         * Before C++17, operator new only guarantees the alignment of std::max_align_t.
+         */
+        inline void* allocate_aligned(std::size_t size, std::size_t alignment) {
+            // Over-allocate, keeping the address of the whole allocation right in front of the aligned memory
+            auto memory = static_cast<char*>(::operator new(size + alignment + sizeof(void*)));
+            auto address = reinterpret_cast<std::uintptr_t>(memory + sizeof(void*));
+            auto aligned = memory + sizeof(void*) + ((alignment - address % alignment) % alignment);
+            reinterpret_cast<void**>(aligned)[-1] = memory;
+            return aligned;
+        }
+
+        inline void free_aligned(void* pointer) {
+            if (pointer) {
+                ::operator delete(static_cast<void**>(pointer)[-1]);
+            }
+        }
+
+        /**
+         * Base for the internal types aligned to a cache line, making new and new[] respect that alignment.
+         */
+        struct cache_aligned_allocation {
+            static void* operator new(std::size_t size) {
+                return allocate_aligned(size, CACHE_LINE_SIZE);
+            }
+
+            static void* operator new[](std::size_t size) {
+                return allocate_aligned(size, CACHE_LINE_SIZE);
+            }
+
+            static void operator delete(void* pointer) {
+                free_aligned(pointer);
+            }
+
+            static void operator delete[](void* pointer) {
+                free_aligned(pointer);
+            }
+        };
+
+        /**
+         * Room for one T that is constructed and destroyed explicitly, so that T needs no default constructor and
+         * nothing is constructed until there is a value to put there. The owner keeps track of whether it holds one.
+         */
+        template<typename T>
+        class value_slot {
+        private:
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+        public:
+            template<typename... ARGS>
+            void emplace(ARGS&&... args) {
+                ::new (static_cast<void*>(&storage)) T(std::forward<ARGS>(args)...);
+            }
+
+            void destroy() {
+                get().~T();
+            }
+
+            T& get() {
+                return *reinterpret_cast<T*>(&storage);
+            }
+        };
+
+        /**
+         * A count that only one thread at a time changes (the combiner, or the holder of a lock), while any thread may
+         * read it. Changing it is a plain load and store rather than a read-modify-write, so keeping it costs the
+         * writer next to nothing, and readers never race with it.
+         */
+        class owned_counter {
+        private:
+            std::atomic<std::size_t> value;
+
+        public:
+            owned_counter()
+                : value(0) {
+            }
+
+            void add(std::size_t amount) {
+                value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+            }
+
+            void subtract(std::size_t amount) {
+                value.store(value.load(std::memory_order_relaxed) - amount, std::memory_order_relaxed);
+            }
+
+            std::size_t load() const {
+                return value.load(std::memory_order_relaxed);
+            }
+        };
+
+        /**
+         * A count that any thread may change, split into COUNTER_STRIPES stripes on cache lines of their own. A thread
+         * always changes the same stripe, picked from its seed, so threads rarely share a line, and reading adds all
+         * of the stripes up. A stripe may go below zero when values are removed by another thread than the one that
+         * added them, only the sum means anything.
+         */
+        class striped_counter {
+        private:
+            struct alignas(CACHE_LINE_SIZE) stripe : cache_aligned_allocation {
+                std::atomic<std::int64_t> value;
+
+                stripe()
+                    : value(0) {
+                }
+            };
+
+            std::unique_ptr<stripe[]> stripes;
+
+        public:
+            striped_counter()
+                : stripes(new stripe[COUNTER_STRIPES]) {
+            }
+
+            void add(std::int64_t amount) {
+                stripes[scale_seed(thread_seed(), COUNTER_STRIPES)].value.fetch_add(amount,
+                                                                                    std::memory_order_relaxed);
+            }
+
+            /**
+             * Returns the sum of the stripes, which is only exact while nobody changes them. Stripes changed during
+             * the read may make the sum briefly negative, in which case it counts as 0.
+             */
+            std::size_t load() const {
+                std::int64_t sum = 0;
+                for (std::size_t index = 0; index < COUNTER_STRIPES; ++index) {
+                    sum += stripes[index].value.load(std::memory_order_relaxed);
+                }
+                return sum > 0 ? static_cast<std::size_t>(sum) : 0;
+            }
+        };
+
+        /**
+         * Allocator that respects the alignment of over-aligned types, for the standard containers holding them.
+         */
+        template<typename T>
+        struct aligned_allocator {
+            using value_type = T;
+
+            aligned_allocator() = default;
+
+            template<typename U>
+            aligned_allocator(aligned_allocator<U> const&) {
+            }
+
+            T* allocate(std::size_t count) {
+                return static_cast<T*>(allocate_aligned(count * sizeof(T), alignof(T)));
+            }
+
+            void deallocate(T* pointer, std::size_t) {
+                free_aligned(pointer);
+            }
+
+            template<typename U>
+            bool operator==(aligned_allocator<U> const&) const {
+                return true;
+            }
+
+            template<typename U>
+            bool operator!=(aligned_allocator<U> const&) const {
+                return false;
+            }
+        };
+
+        /**
+         * Returns the position of the lowest set bit. The value must not be zero.
+         */
+        inline unsigned int count_trailing_zeros(std::uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+            return static_cast<unsigned int>(__builtin_ctzll(value));
+#elif defined(_MSC_VER) && defined(_M_X64)
+            unsigned long index;
+            _BitScanForward64(&index, value);
+            return static_cast<unsigned int>(index);
+#else
+            unsigned int index = 0;
+            while (!(value & 1)) {
+                value >>= 1;
+                ++index;
+            }
+            return index;
+#endif
+        }
+
+        /**
+         * Returns the amount of set bits.
+         */
+        inline unsigned int count_set_bits(std::uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+            return static_cast<unsigned int>(__builtin_popcountll(value));
+#else
+            unsigned int count = 0;
+            for (; value; value &= value - 1) {
+                ++count;
+            }
+            return count;
+#endif
+        }
+
+        /**
+         * Returns the amount of bits needed to represent the value, 0 for 0.
+         */
+        inline unsigned int bit_width(std::uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+            return value ? 64 - static_cast<unsigned int>(__builtin_clzll(value)) : 0;
+#else
+            unsigned int width = 0;
+            for (; value; value >>= 1) {
+                ++width;
+            }
+            return width;
+#endif
+        }
+    }
+}
+
+#endif //CCL_DETAIL_HPP
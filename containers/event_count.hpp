@@ -0,0 +1,121 @@
+//
+// Lets threads sleep until another thread signals that something they may be waiting on has happened.
+//
+
+#ifndef CCL_EVENT_COUNT_HPP
+#define CCL_EVENT_COUNT_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace ccl {
+    /**
+     * An event count: a counter of notifications that a thread can block on until it changes. Waiting happens in two
+     * steps so that no notification is lost in between checking a condition and going to sleep,
+     *
+     *     auto key = events.prepare_wait();
+     *     if (condition_holds()) {
+     *         events.cancel_wait();
+     *     } else {
+     *         events.wait(key); // Returns immediately if notify_all() was called after prepare_wait()
+     *     }
+     *
+     * notify_all() only touches the mutex when somebody is actually waiting, so signalling is a single atomic
+     * increment in the common case.
+     */
+    class event_count {
+    private:
+        std::atomic<unsigned int> epoch;
+        std::atomic<unsigned int> waiter_count;
+        std::mutex mutex;
+        std::condition_variable condition;
+
+    public:
+        event_count()
+            : epoch(0)
+            , waiter_count(0) {
+        }
+
+        event_count(const event_count &other) = delete;
+        event_count &operator=(const event_count &other) = delete;
+
+        /**
+         * Registers the thread as a waiter, returning the key to pass to wait(). Must be followed by exactly one call
+         * to either wait(), wait_until() or cancel_wait().
+         */
+        unsigned int prepare_wait() {
+            // Both operations are sequentially consistent, so either the notifier sees this thread as a waiter or this
+            // thread sees the new epoch.
+            waiter_count.fetch_add(1);
+            return epoch.load();
+        }
+
+        /**
+         * Unregisters a thread that decided not to wait after all.
+         */
+        void cancel_wait() {
+            waiter_count.fetch_sub(1);
+        }
+
+        /**
+         * Registers the thread as a waiter and then calls check(), unregistering it again if check() returns true or
+         * throws. Otherwise the thread stays registered under key, which it then passes to wait() or wait_until().
+         */
+        template<typename CHECK>
+        bool prepare_wait(unsigned int& key, CHECK check) {
+            key = prepare_wait();
+            bool done;
+            try {
+                done = check();
+            } catch (...) {
+                cancel_wait();
+                throw;
+            }
+            if (done) {
+                cancel_wait();
+            }
+            return done;
+        }
+
+        /**
+         * Blocks until notify_all() has been called since the prepare_wait() that returned key.
+         */
+        void wait(unsigned int key) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [&]() { return epoch.load() != key; });
+            }
+            waiter_count.fetch_sub(1);
+        }
+
+        /**
+         * Same as wait(), but gives up at the deadline. Returns false if it timed out without being notified.
+         */
+        template<typename CLOCK, typename DURATION>
+        bool wait_until(unsigned int key, std::chrono::time_point<CLOCK, DURATION> const& deadline) {
+            bool notified;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                notified = condition.wait_until(lock, deadline, [&]() { return epoch.load() != key; });
+            }
+            waiter_count.fetch_sub(1);
+            return notified;
+        }
+
+        /**
+         * Wakes every thread waiting on a key from before this call.
+         */
+        void notify_all() {
+            epoch.fetch_add(1);
+            if (waiter_count.load() != 0) {
+                // Taking the mutex makes sure a waiter that already checked the epoch is asleep before being notified
+                { std::lock_guard<std::mutex> lock(mutex); }
+                condition.notify_all();
+            }
+        }
+    };
+}
+
+#endif //CCL_EVENT_COUNT_HPP
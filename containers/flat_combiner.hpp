@@ -0,0 +1,531 @@
+//
+// Flat combining around any sequential data structure, which the stack, queue and priority queue are built on.
+//  - Based on "Flat Combining and the Synchronization-Parallelism Tradeoff" by D. Hendler, I. Incze, N. Shavit and
+//    M. Tzafrir, outlined here: http://www.cs.bgu.ac.il/~hendlerd/papers/flat-combining.pdf
+//
+
+#ifndef CCL_FLAT_COMBINER_HPP
+#define CCL_FLAT_COMBINER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <utility>
+
+#include "detail.hpp"
+#include "event_count.hpp"
+#include "numa.hpp"
+#include "publication.hpp"
+#include "stats.hpp"
+
+namespace ccl {
+    /**
+     * Base of the requests a flat_combiner publishes. A request type adds whatever fields its operations need: which
+     * operation to apply, the values it takes, a pointer to a batch, room for the results. The thread fills them in
+     * before submitting the request, the combiner reads them and writes the results, and the thread reads the results
+     * once submit returns. If applying the request threw instead, submit rethrows the exception.
+     */
+    class combining_request {
+    private:
+        template<typename SEQUENTIAL, typename OPERATIONS>
+        friend class flat_combiner;
+
+        static unsigned char const IDLE = 0; // Belongs to its thread
+        static unsigned char const PENDING = 1; // Submitted, waiting for a combiner to answer it
+        static unsigned char const APPLYING = 2; // Handed to the operations by a combiner, not answered yet
+        static unsigned char const ANSWERED = 3; // Answered, until its thread sees it
+
+        std::atomic<unsigned char> state;
+        std::exception_ptr error; // What applying the request threw, if it did
+
+    public:
+        combining_request()
+            : state(IDLE) {
+        }
+
+        combining_request(const combining_request &other) = delete;
+        combining_request &operator=(const combining_request &other) = delete;
+
+        /**
+         * Hands the request back to its thread, which the operations do once they applied it. Releasing publishes the
+         * results written to the request to the thread. The thread may reuse the request right away, so the combiner
+         * must not touch it afterwards.
+         */
+        void answer() {
+            state.store(ANSWERED, std::memory_order_release);
+        }
+    };
+
+    /**
+     * Applies the requests of any number of threads to a SEQUENTIAL (single-threaded) data structure. Each thread
+     * publishes its requests in a publication record of its own, and whichever thread takes the combiner lock makes a
+     * pass over the publication list and applies every pending request, so the structure is only ever used by one
+     * thread at a time and most threads never touch it at all.
+     *
+     * OPERATIONS, which is the operation set of the structure, provides
+     *  - request: the type of the requests, derived from combining_request and default constructible. Each thread has
+     *    one per flat_combiner, so its fields may be reused from one request to the next.
+     *  - unsigned int apply(SEQUENTIAL& sequential, request& pending): applies a pending request and answers it, or
+     *    keeps it to be applied together with the other requests of the pass.
+     *  - unsigned int finish_pass(SEQUENTIAL& sequential): answers every request the pass kept.
+     *  - void abandon_pass(): called once apply or finish_pass threw, forgets every request the pass kept without
+     *    answering it. The combiner answers those requests with the exception.
+     *  - void notify(unsigned int events): called after the combiner released its lock, with the events returned by
+     *    apply and finish_pass ORed together, to wake threads waiting for the structure to change. Another combiner
+     *    may be running by then, so it may only touch state that is safe to share, like an event_count.
+     * Everything else the operations hold is only used by the combiner, like the structure itself.
+     *
+     * How much a combiner does when it takes the lock is decided by a combining_policy. With more than one cluster the
+     * combining is hierarchical: each cluster has a publication list and combiner lock of its own, and its combiner
+     * also holds a mutex on the structure while it applies the requests of its cluster.
+     */
+    template<typename SEQUENTIAL, typename OPERATIONS>
+    class flat_combiner {
+    public:
+        using request = typename OPERATIONS::request;
+
+    private:
+        struct cluster;
+
+        /**
+         * Shared by the thread it belongs to and the combiner, see detail::owned_record. Each record has the cache
+         * line(s) to itself, since its thread and the combiner keep writing to it.
+         */
+        struct alignas(CACHE_LINE_SIZE) publication_record : request, detail::owned_record,
+                                                              detail::cache_aligned_allocation {
+            cluster* home; // Whose publication list the record is published on
+            publication_record* next;
+            publication_record* registry_next; // Links every record of the combiner, whether active or not
+            unsigned int age;
+            std::atomic<bool> active;
+
+            publication_record()
+                : owned_record(&destroy_record)
+                , home(nullptr)
+                , next(nullptr)
+                , registry_next(nullptr)
+                , age(0)
+                , active(false) {
+            }
+        };
+
+        static void destroy_record(detail::owned_record* record) {
+            delete static_cast<publication_record*>(record);
+        }
+
+        /**
+         * A publication list and the lock of its combiner, shared by the threads of one cluster.
+         */
+        struct alignas(CACHE_LINE_SIZE) cluster : detail::cache_aligned_allocation {
+            std::atomic<publication_record*> publication_head;
+
+            alignas(CACHE_LINE_SIZE) std::atomic<bool> combiner_lock;
+
+            // Only accessed by the cluster's combiner
+            alignas(CACHE_LINE_SIZE) unsigned int combining_pass_counter;
+            unsigned int passes_since_cleanup; // Passes since the cluster's combiner last freed abandoned records
+
+            alignas(CACHE_LINE_SIZE) event_count combining_passes; // Notified after every combining pass of the
+                                                                   // cluster, for threads parked on their record
+
+            cluster()
+                : publication_head(nullptr)
+                , combiner_lock(false)
+                , combining_pass_counter(0)
+                , passes_since_cleanup(0) {
+            }
+        };
+
+        // The fields are grouped by how often and by whom they are written, each group starting on its own cache
+        // line, so that threads spinning on the lock or pushing their record don't keep stealing the lines holding
+        // the structure from the combiner.
+        std::uint64_t const container_id; // Key of the combiner in each thread's table of publication records
+        std::atomic<publication_record*> registry_head; // Only written when a thread submits for the first time
+        combining_policy const policy;
+        std::size_t const cluster_count;
+        std::unique_ptr<cluster[]> clusters;
+
+        alignas(CACHE_LINE_SIZE) std::mutex storage_mutex; // Only used with more than one cluster
+
+        // Only accessed by the combiner, except for OPERATIONS::notify
+        alignas(CACHE_LINE_SIZE) SEQUENTIAL storage;
+        OPERATIONS operation_set;
+
+#ifdef CCL_ENABLE_STATS
+        detail::sharded<detail::combining_counters> statistics;
+#endif
+
+        template<typename SEQUENTIAL_ARGUMENTS, typename OPERATION_ARGUMENTS, std::size_t... SEQUENTIAL_INDICES,
+                 std::size_t... OPERATION_INDICES>
+        flat_combiner(combining_policy const& policy_, SEQUENTIAL_ARGUMENTS& sequential_arguments,
+                      OPERATION_ARGUMENTS& operation_arguments, std::index_sequence<SEQUENTIAL_INDICES...>,
+                      std::index_sequence<OPERATION_INDICES...>)
+            : container_id(detail::next_container_id())
+            , registry_head(nullptr)
+            , policy(checked(policy_))
+            , cluster_count(policy_.clusters ? policy_.clusters : numa::node_count())
+            , clusters(new cluster[cluster_count])
+            , storage(std::get<SEQUENTIAL_INDICES>(std::move(sequential_arguments))...)
+            , operation_set(std::get<OPERATION_INDICES>(std::move(operation_arguments))...) {
+        }
+
+        /**
+         * Returns the policy with maximum_record_age raised to at least 1, since the combiner also frees abandoned
+         * records once every that many passes.
+         */
+        static combining_policy checked(combining_policy policy_) {
+            policy_.maximum_record_age = std::max(policy_.maximum_record_age, 1u);
+            return policy_;
+        }
+
+        /**
+         * Frees the records of threads that exited, once they are no longer on a publication list.
+         */
+        void free_abandoned_records() {
+            auto current_record = registry_head.load(std::memory_order_acquire);
+            publication_record* previous_record = nullptr;
+            while (current_record) {
+                auto next_record = current_record->registry_next;
+                if (!current_record->active.load(std::memory_order_acquire) &&
+                    !current_record->owned_by(detail::RECORD_THREAD_OWNER)) {
+                    detail::unlink(registry_head, previous_record, current_record, &publication_record::registry_next);
+                    current_record->release(detail::RECORD_CONTAINER_OWNER);
+                } else {
+                    previous_record = current_record;
+                }
+                current_record = next_record;
+            }
+        }
+
+        /**
+         * Makes one pass over the cluster's publication list, handing every pending request to the operations.
+         * Returns how many requests it answered, adding the events of the operations to events.
+         */
+        std::size_t combining_pass(cluster& home, unsigned int& events) {
+            auto combining_pass_counter = ++home.combining_pass_counter;
+            std::size_t answered = 0;
+
+            // Traverse publication list from the head, updating age of non-idle records and applying requests
+            auto current_record = home.publication_head.load(std::memory_order_acquire);
+            publication_record* previous_record = nullptr;
+            CCL_STATS(std::size_t visited = 0;)
+            while (current_record) {
+                CCL_STATS(++visited;)
+                // Read ahead, since a record removed from the list may be pushed back onto it by its thread at any time
+                auto next_record = current_record->next;
+
+                // Acquiring the state makes the request published along with it visible
+                auto state = current_record->state.load(std::memory_order_acquire);
+                if (state != combining_request::IDLE) {
+                    // Update the age of all non-idle records and apply the pending requests
+                    current_record->age = combining_pass_counter;
+                    if (state == combining_request::PENDING) {
+                        ++answered;
+                        current_record->state.store(combining_request::APPLYING, std::memory_order_relaxed);
+                        events |= operation_set.apply(storage, *current_record);
+                    }
+                } else if (combining_pass_counter - current_record->age > policy.maximum_record_age ||
+                           !current_record->owned_by(detail::RECORD_THREAD_OWNER)) {
+                    // Idle records are removed from the publication list if they become too old, or right away if
+                    // their thread exited
+                    CCL_STATS(if (current_record->owned_by(detail::RECORD_THREAD_OWNER)) {
+                        detail::count(statistics.local().records_aged_out);
+                    })
+                    detail::unlink(home.publication_head, previous_record, current_record, &publication_record::next);
+                    // Releasing makes sure next_record was read before the thread can push the record back on
+                    current_record->active.store(false, std::memory_order_release);
+
+                    current_record = next_record;
+                    continue;
+                }
+
+                // Record the previous record in case we need to remove a record
+                previous_record = current_record;
+                current_record = next_record;
+            }
+
+            if (++home.passes_since_cleanup >= policy.maximum_record_age) {
+                home.passes_since_cleanup = 0;
+                free_abandoned_records();
+            }
+            events |= operation_set.finish_pass(storage);
+
+            CCL_STATS(auto& counters = statistics.local();
+                      detail::count(counters.passes);
+                      detail::count(counters.requests, answered);
+                      counters.requests_per_pass.record(answered);
+                      counters.publication_list_length.record(visited);)
+            return answered;
+        }
+
+        /**
+         * Answers the requests of the cluster that the operations were handed but didn't answer before applying one of
+         * them threw error, so that their threads rethrow it from submit instead of waiting forever.
+         */
+        void fail_pass(cluster& home, std::exception_ptr const& error) {
+            operation_set.abandon_pass();
+            auto current_record = home.publication_head.load(std::memory_order_acquire);
+            while (current_record) {
+                // Read ahead, since the thread may reuse its request as soon as it is answered
+                auto next_record = current_record->next;
+                if (current_record->state.load(std::memory_order_relaxed) == combining_request::APPLYING) {
+                    current_record->error = error;
+                    current_record->answer();
+                }
+                current_record = next_record;
+            }
+        }
+
+        /**
+         * Releases the cluster's combiner lock and wakes the threads waiting on it and on the operations once the
+         * combiner is done, however its passes ended.
+         */
+        struct combiner_release {
+            flat_combiner& owner;
+            cluster& home;
+            unsigned int const& events;
+
+            ~combiner_release() {
+                // Sequentially consistent, so that a thread which failed to take the lock right after registering on
+                // combining_passes is guaranteed to be seen (and woken) by the notify below
+                home.combiner_lock.store(false, std::memory_order_seq_cst);
+
+                // Only wake threads after releasing the lock, so that a woken thread is able to become the next
+                // combiner
+                home.combining_passes.notify_all();
+                if (events) {
+                    owner.operation_set.notify(events);
+                }
+            }
+        };
+
+        /**
+         * Handles the pending requests of the cluster, making as many passes as the policy asks for before releasing
+         * the lock. Called while holding the cluster's combiner lock.
+         */
+        void combiner(cluster& home) {
+            unsigned int events = 0;
+            unsigned int passes = 0;
+            std::size_t answered;
+            CCL_STATS(detail::count(statistics.local().lock_acquisitions);)
+            combiner_release release{*this, home, events}; // Runs after storage_lock is unlocked, being declared first
+
+            // The combiners of the other clusters take turns with this one. Meanwhile the threads of this cluster keep
+            // publishing, so the longer the wait, the larger the batch this combiner gets to apply.
+            std::unique_lock<std::mutex> storage_lock(storage_mutex, std::defer_lock);
+            if (cluster_count > 1) {
+                storage_lock.lock();
+            }
+            try {
+                do {
+                    answered = combining_pass(home, events);
+                    ++passes;
+                } while (policy.another_pass(passes, answered));
+            } catch (...) {
+                fail_pass(home, std::current_exception());
+            }
+        };
+
+        /**
+         * Pushes the record onto its cluster's publication list, unless it already is on it.
+         */
+        void activate(publication_record* record) {
+            // Acquiring pairs with the combiner deactivating the record, after which it no longer reads record->next
+            if (!record->active.load(std::memory_order_acquire)) {
+                record->active.store(true, std::memory_order_relaxed);
+
+                // Append as the new head
+                auto& publication_head = record->home->publication_head;
+                auto old_head = publication_head.load(std::memory_order_relaxed);
+                do {
+                    record->next = old_head;
+                } while (!publication_head.compare_exchange_weak(old_head, record, std::memory_order_release,
+                                                                 std::memory_order_relaxed));
+            }
+        }
+
+        /**
+         * Picks the cluster of a thread that submits for the first time: one of the clusters of the NUMA node it is
+         * running on, which with one cluster per node is the node's own.
+         */
+        cluster* home_cluster() {
+            if (cluster_count == 1) return &clusters[0];
+
+            auto nodes = numa::node_count();
+            auto node = numa::current_node();
+            auto first = node * cluster_count / nodes;
+            auto last = (node + 1) * cluster_count / nodes;
+            if (last <= first) return &clusters[first];
+            return &clusters[first + detail::scale_seed(detail::thread_seed(), last - first)];
+        }
+
+        /**
+         * Takes the cluster's combiner lock if it is free. The lock is only read first, so that threads waiting on it
+         * don't keep invalidating the lock's cache line with failed test-and-sets.
+         */
+        static bool try_lock_combiner(cluster& home) {
+            return !home.combiner_lock.load(std::memory_order_relaxed) &&
+                   !home.combiner_lock.exchange(true, std::memory_order_acquire);
+        }
+
+    public:
+        /**
+         * Constructs the SEQUENTIAL structure from sequential_arguments and the OPERATIONS from operation_arguments,
+         * like the piecewise constructor of std::pair (std::forward_as_tuple builds either).
+         */
+        template<typename... SEQUENTIAL_ARGUMENTS, typename... OPERATION_ARGUMENTS>
+        flat_combiner(combining_policy const& policy_, std::tuple<SEQUENTIAL_ARGUMENTS...> sequential_arguments,
+                      std::tuple<OPERATION_ARGUMENTS...> operation_arguments)
+            : flat_combiner(policy_, sequential_arguments, operation_arguments,
+                            std::index_sequence_for<SEQUENTIAL_ARGUMENTS...>(),
+                            std::index_sequence_for<OPERATION_ARGUMENTS...>()) {
+        }
+
+        /**
+         * Frees the publication records of threads that exited, leaving the others to be freed by their thread.
+         */
+        ~flat_combiner() {
+            auto record = registry_head.load();
+            while (record) {
+                auto next_record = record->registry_next;
+                record->release(detail::RECORD_CONTAINER_OWNER);
+                record = next_record;
+            }
+        }
+
+        // Disallow copying a combiner
+        flat_combiner(const flat_combiner &other) = delete;
+        flat_combiner &operator=(const flat_combiner &other) = delete;
+
+        /**
+         * Returns the calling thread's request, creating its publication record the first time the thread uses the
+         * combiner. The thread fills the request in and then submits it.
+         */
+        request& thread_request() {
+            auto& thread_records = detail::thread_records();
+            auto thread_publication_record = static_cast<publication_record*>(thread_records.find(container_id));
+
+            // First check if thread has a publication record for this combiner
+            if (thread_publication_record == nullptr) {
+                // Allocate a publication record for thread, registering it with the combiner so that whichever of
+                // the two outlives the other frees it
+                thread_publication_record = new publication_record;
+                thread_publication_record->home = home_cluster();
+                auto old_registry_head = registry_head.load(std::memory_order_relaxed);
+                do {
+                    thread_publication_record->registry_next = old_registry_head;
+                } while (!registry_head.compare_exchange_weak(old_registry_head, thread_publication_record,
+                                                              std::memory_order_release, std::memory_order_relaxed));
+                thread_records.add(container_id, thread_publication_record);
+            }
+            return *thread_publication_record;
+        }
+
+        /**
+         * Publishes the calling thread's request and waits until a combiner has answered it, combining itself
+         * whenever the combiner lock is free. The thread first spins, then yields, and finally parks until the
+         * current combining pass is over, so a thread stuck behind other combiners doesn't keep a core busy. Once
+         * this returns the request belongs to the thread again, holding the results.
+         *
+         * If applying a request throws, the combiner answers every request its pass was handed but didn't answer yet
+         * with the exception, which their threads then rethrow from here. The structure is left as the failed
+         * operation left it, and the requests that failed may or may not have been applied in part.
+         */
+        void submit(request& pending) {
+            auto record = static_cast<publication_record*>(&pending);
+            auto& home = *record->home;
+
+            // Releasing the state publishes the request to the combiner that acquires it
+            record->state.store(combining_request::PENDING, std::memory_order_release);
+            activate(record);
+
+            // Only a combiner answers the request. Acquiring the answer makes the results the combiner wrote to the
+            // request visible.
+            unsigned int attempts = 0;
+            while (record->state.load(std::memory_order_acquire) != combining_request::ANSWERED) {
+                if (!record->active.load(std::memory_order_acquire)) {
+                    // Combiner decided that record is too old, add it again to publication list
+                    activate(record);
+                } else if (try_lock_combiner(home)) {
+                    // Got the lock
+                    combiner(home);
+                } else if (attempts < SPIN_ATTEMPTS) {
+                    ++attempts;
+                    detail::cpu_relax();
+                } else if (attempts < SPIN_ATTEMPTS + YIELD_ATTEMPTS) {
+                    // For programs where the thread count accessing this data structure is higher than the core count
+                    // available, this prevents wasteful empty CAS loops waiting for a lock that is fighting to be
+                    // scheduled by the OS.
+                    ++attempts;
+                    std::this_thread::yield();
+                } else {
+                    // Park until the combiner holding the lock is done. Checking the lock again after registering as a
+                    // waiter guarantees that somebody will notify this thread once they release it.
+                    auto key = home.combining_passes.prepare_wait();
+                    if (record->state.load(std::memory_order_acquire) == combining_request::ANSWERED) {
+                        home.combining_passes.cancel_wait();
+                    } else if (!home.combiner_lock.exchange(true, std::memory_order_seq_cst)) {
+                        home.combining_passes.cancel_wait();
+                        combiner(home);
+                    } else {
+                        CCL_STATS(detail::count(statistics.local().parks);)
+                        home.combining_passes.wait(key);
+                    }
+                }
+            }
+
+            // Request processed; acknowledge it. A combiner no longer touches the request of an idle record.
+            record->state.store(combining_request::IDLE, std::memory_order_relaxed);
+
+            // attempts counted the spins first, then the yields
+            CCL_STATS(if (attempts) {
+                auto& counters = statistics.local();
+                detail::count(counters.spins, std::min(attempts, SPIN_ATTEMPTS));
+                if (attempts > SPIN_ATTEMPTS) detail::count(counters.yields, attempts - SPIN_ATTEMPTS);
+            })
+
+            if (record->error) {
+                std::exception_ptr error;
+                std::swap(error, record->error);
+                std::rethrow_exception(error);
+            }
+        }
+
+        /**
+         * The structure the requests are applied to. Only the combiner may use it while other threads submit requests.
+         */
+        SEQUENTIAL& sequential() {
+            return storage;
+        }
+
+        /**
+         * The operation set, whose notify() side any thread may use (to wait on its event counts, or read the counts
+         * the combiner keeps, say).
+         */
+        OPERATIONS& operations() {
+            return operation_set;
+        }
+
+        OPERATIONS const& operations() const {
+            return operation_set;
+        }
+
+#ifdef CCL_ENABLE_STATS
+        /**
+         * Returns the combining statistics gathered so far, added up over all threads. Only available when compiled
+         * with CCL_ENABLE_STATS.
+         */
+        combining_stats stats() const {
+            return detail::collect<combining_stats>(statistics);
+        }
+#endif
+    };
+}
+
+#endif //CCL_FLAT_COMBINER_HPP
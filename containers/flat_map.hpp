@@ -0,0 +1,612 @@
+//
+// Open addressing alternative to ccl::map.
+//  - The table layout (a control byte per slot, probed a group of 16 at a time) follows the "Swiss table" design used
+//    by Abseil's flat_hash_map, described here: https://abseil.io/about/design/swisstables
+//
+
+#ifndef CCL_FLAT_MAP_HPP
+#define CCL_FLAT_MAP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <mutex>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CCL_FLAT_MAP_SSE2
+#endif
+
+#include "detail.hpp"
+#include "stats.hpp"
+
+namespace ccl {
+    std::size_t const FLAT_MAP_GROUP_SIZE = 16; // Slots whose control bytes are probed at once
+    std::size_t const FLAT_MAP_STRIPES_PER_CORE = 4; // Lock stripes allocated per hardware thread by default
+
+    /**
+     * A hashmap that supports concurrent operations, storing its entries inline in an open addressing table.
+     *
+     * Where ccl::map chases a pointer per tree level, flat_map keeps one control byte per slot (7 bits of the hash, or
+     * an empty/deleted marker) next to a flat array of slots. A lookup compares a whole group of 16 control bytes with
+     * one SIMD instruction and only then looks at the slots whose bits matched, so a hit usually touches the control
+     * group and the slot itself. Keys are partitioned into lock stripes, each owning an independent table that grows
+     * while only holding its own lock.
+     *
+     * Unlike ccl::map, readers take the stripe lock (entries are stored in place, so they can't be read while a writer
+     * moves them). The read-modify-write operations (try_emplace, update, compute, erase_if, fetch_add) change the
+     * entry in its slot during the same probe that found it.
+     */
+    template<typename KEY_TYPE, typename T, typename HASH = std::hash<KEY_TYPE>,
+             typename KEY_EQUAL = std::equal_to<KEY_TYPE>>
+    class flat_map {
+    private:
+        HASH hash_function;
+        KEY_EQUAL key_equal;
+
+        // Control byte values. Full slots hold the low 7 bits of their hash, so they are never negative.
+        static std::int8_t const EMPTY = -128;
+        static std::int8_t const DELETED = -2;
+
+        struct slot {
+            KEY_TYPE key;
+            T value;
+
+            template<typename... ARGS>
+            slot(KEY_TYPE key_, ARGS&&... args)
+                : key(std::move(key_))
+                , value(std::forward<ARGS>(args)...) {
+            }
+        };
+
+        /**
+         * Bit set of the slots in a group that matched, bit n being slot n of the group.
+         */
+        struct group_mask {
+            std::uint32_t bits;
+
+            explicit operator bool() const { return bits != 0; }
+
+            unsigned int lowest() const { return detail::count_trailing_zeros(bits); }
+
+            void clear_lowest() { bits &= bits - 1; }
+        };
+
+        /**
+         * The 16 control bytes of a group.
+         */
+        struct group {
+#if defined(CCL_FLAT_MAP_SSE2)
+            __m128i control;
+
+            explicit group(std::int8_t const* position)
+                : control(_mm_loadu_si128(reinterpret_cast<__m128i const*>(position))) {
+            }
+
+            group_mask match(std::int8_t hash) const {
+                auto matched = _mm_cmpeq_epi8(_mm_set1_epi8(hash), control);
+                return group_mask{static_cast<std::uint32_t>(_mm_movemask_epi8(matched))};
+            }
+
+            group_mask match_empty() const {
+                return match(EMPTY);
+            }
+
+            group_mask match_empty_or_deleted() const {
+                // Both markers are negative, so their sign bit is all that needs checking
+                return group_mask{static_cast<std::uint32_t>(_mm_movemask_epi8(control))};
+            }
+#else
+            std::int8_t control[FLAT_MAP_GROUP_SIZE];
+
+            explicit group(std::int8_t const* position) {
+                std::memcpy(control, position, FLAT_MAP_GROUP_SIZE);
+            }
+
+            group_mask match(std::int8_t hash) const {
+                std::uint32_t bits = 0;
+                for (std::size_t index = 0; index < FLAT_MAP_GROUP_SIZE; ++index) {
+                    bits |= static_cast<std::uint32_t>(control[index] == hash) << index;
+                }
+                return group_mask{bits};
+            }
+
+            group_mask match_empty() const {
+                return match(EMPTY);
+            }
+
+            group_mask match_empty_or_deleted() const {
+                std::uint32_t bits = 0;
+                for (std::size_t index = 0; index < FLAT_MAP_GROUP_SIZE; ++index) {
+                    bits |= static_cast<std::uint32_t>(control[index] < 0) << index;
+                }
+                return group_mask{bits};
+            }
+#endif
+        };
+
+        /**
+         * A lock stripe and the table it owns, aligned to a cache line of its own. Everything is only accessed while
+         * holding the stripe's mutex.
+         */
+        struct alignas(CACHE_LINE_SIZE) stripe : detail::cache_aligned_allocation {
+            std::mutex mutex;
+            detail::lock_counters locks; // Locks the mutex, counting how contended it is with CCL_ENABLE_STATS
+            std::unique_ptr<std::int8_t[]> control;
+            slot* slots;
+            std::size_t group_count_mask; // (amount of groups) - 1
+            std::size_t size;
+            std::size_t growth_left; // Empty slots that may still be filled before the table must grow
+
+            stripe()
+                : slots(nullptr)
+                , group_count_mask(0)
+                , size(0)
+                , growth_left(0) {
+            }
+        };
+
+        std::unique_ptr<stripe[]> stripes;
+        std::size_t stripe_mask;
+        unsigned int stripe_shift; // Bits of the hash used to select a stripe
+
+#ifdef CCL_ENABLE_STATS
+        detail::sharded<detail::map_counters> statistics;
+#endif
+
+        /**
+         * Most slots a table with the given capacity may fill before it grows (a load factor of 7/8).
+         */
+        static std::size_t maximum_load(std::size_t capacity) {
+            return capacity - capacity / 8;
+        }
+
+        /**
+         * Gives the stripe a fresh table of (at least) the given amount of groups, moving every entry over. The new
+         * table is filled in on the side and only then swapped in, so if hashing a key or copying an entry throws,
+         * the stripe keeps its old table untouched. Entries are moved rather than copied when that can't throw.
+         */
+        void resize(stripe& stripe_, std::size_t group_count) {
+            std::size_t groups = 1;
+            while (groups < group_count) {
+                groups <<= 1;
+            }
+            auto capacity = groups * FLAT_MAP_GROUP_SIZE;
+            auto old_capacity = stripe_.slots ? (stripe_.group_count_mask + 1) * FLAT_MAP_GROUP_SIZE : 0;
+
+            std::unique_ptr<std::int8_t[]> new_control(new std::int8_t[capacity]);
+            std::memset(new_control.get(), EMPTY, capacity);
+            std::vector<std::size_t> positions; // New position of every full old slot, in order
+            positions.reserve(stripe_.size);
+            for (std::size_t index = 0; index < old_capacity; ++index) {
+                if (stripe_.control[index] >= 0) {
+                    auto hash = detail::mix_hash(hash_function(stripe_.slots[index].key)) >> stripe_shift;
+                    auto position = find_free(new_control.get(), groups - 1, hash);
+                    new_control[position] = hash_bits(hash);
+                    positions.push_back(position);
+                }
+            }
+
+            auto new_slots = static_cast<slot*>(detail::allocate_aligned(capacity * sizeof(slot), alignof(slot)));
+            std::size_t constructed = 0;
+            try {
+                for (std::size_t index = 0; index < old_capacity; ++index) {
+                    if (stripe_.control[index] >= 0) {
+                        auto& old_slot = stripe_.slots[index];
+                        ::new (static_cast<void*>(&new_slots[positions[constructed]]))
+                                slot(std::move_if_noexcept(old_slot.key), std::move_if_noexcept(old_slot.value));
+                        ++constructed;
+                    }
+                }
+            } catch (...) {
+                // Only copies can throw, so the old entries are all still there
+                for (std::size_t index = 0; index < constructed; ++index) {
+                    new_slots[positions[index]].~slot();
+                }
+                detail::free_aligned(new_slots);
+                throw;
+            }
+
+            // Nothing below throws
+            stripe_.control.swap(new_control);
+            std::swap(stripe_.slots, new_slots);
+            stripe_.group_count_mask = groups - 1;
+            stripe_.growth_left = maximum_load(capacity) - stripe_.size;
+            for (std::size_t index = 0; index < old_capacity; ++index) {
+                if (new_control[index] >= 0) {
+                    new_slots[index].~slot();
+                }
+            }
+            detail::free_aligned(new_slots);
+        }
+
+        /**
+         * Returns the 7 bits of the hash stored in a full slot's control byte.
+         */
+        static std::int8_t hash_bits(std::size_t hash) {
+            return static_cast<std::int8_t>(hash & 0x7F);
+        }
+
+        inline void set_control(stripe& stripe_, std::size_t position, std::int8_t value) {
+            stripe_.control[position] = value;
+        }
+
+        /**
+         * Returns the first empty or deleted slot along the hash's probe sequence in the control bytes of a table with
+         * group_count_mask + 1 groups.
+         */
+        static std::size_t find_free(std::int8_t const* control, std::size_t group_count_mask, std::size_t hash) {
+            auto group_index = (hash >> 7) & group_count_mask;
+            for (std::size_t probe = 1;; ++probe) {
+                group current_group(&control[group_index * FLAT_MAP_GROUP_SIZE]);
+                auto available = current_group.match_empty_or_deleted();
+                if (available) {
+                    return group_index * FLAT_MAP_GROUP_SIZE + available.lowest();
+                }
+                // Triangular probing visits every group when the group count is a power of two
+                group_index = (group_index + probe) & group_count_mask;
+            }
+        }
+
+        std::size_t find_free(stripe& stripe_, std::size_t hash) {
+            return find_free(stripe_.control.get(), stripe_.group_count_mask, hash);
+        }
+
+        /**
+         * Returns the slot holding the key, or the stripe's capacity if the key isn't in the table.
+         */
+        template<typename LOOKUP_TYPE>
+        std::size_t find_position(stripe& stripe_, LOOKUP_TYPE const& key, std::size_t hash) {
+            auto capacity = (stripe_.group_count_mask + 1) * FLAT_MAP_GROUP_SIZE;
+            if (!stripe_.slots) return capacity;
+
+            auto group_index = (hash >> 7) & stripe_.group_count_mask;
+            for (std::size_t probe = 1; probe <= stripe_.group_count_mask + 1; ++probe) {
+                group current_group(&stripe_.control[group_index * FLAT_MAP_GROUP_SIZE]);
+                for (auto matches = current_group.match(hash_bits(hash)); matches; matches.clear_lowest()) {
+                    auto position = group_index * FLAT_MAP_GROUP_SIZE + matches.lowest();
+                    if (key_equal(stripe_.slots[position].key, key)) {
+                        CCL_STATS(statistics.local().probe_lengths.record(probe);)
+                        return position;
+                    }
+                }
+
+                if (current_group.match_empty()) {
+                    // The key would have been placed in this group
+                    CCL_STATS(statistics.local().probe_lengths.record(probe);)
+                    return capacity;
+                }
+                group_index = (group_index + probe) & stripe_.group_count_mask;
+            }
+
+            return capacity;
+        }
+
+        template<typename LOOKUP_TYPE>
+        bool find(LOOKUP_TYPE const& key, T& value) {
+            auto hash = detail::mix_hash(hash_function(key));
+            auto& stripe_ = stripes[hash & stripe_mask];
+            hash >>= stripe_shift;
+            CCL_STATS(detail::count(statistics.local().lookups);)
+            std::lock_guard<std::mutex> lock(stripe_.locks.lock(stripe_.mutex), std::adopt_lock);
+
+            auto position = find_position(stripe_, key, hash);
+            if (position == (stripe_.group_count_mask + 1) * FLAT_MAP_GROUP_SIZE) {
+                return false;
+            }
+
+            value = stripe_.slots[position].value;
+            return true;
+        }
+
+        template<typename LOOKUP_TYPE>
+        bool erase(LOOKUP_TYPE const& key) {
+            auto hash = detail::mix_hash(hash_function(key));
+            auto& stripe_ = stripes[hash & stripe_mask];
+            hash >>= stripe_shift;
+            std::lock_guard<std::mutex> lock(stripe_.locks.lock(stripe_.mutex), std::adopt_lock);
+
+            auto position = find_position(stripe_, key, hash);
+            if (position == (stripe_.group_count_mask + 1) * FLAT_MAP_GROUP_SIZE) {
+                return false;
+            }
+
+            erase_at(stripe_, position);
+            return true;
+        }
+
+        /**
+         * Destroys the entry in the full slot at position.
+         */
+        void erase_at(stripe& stripe_, std::size_t position) {
+            stripe_.slots[position].~slot();
+            --stripe_.size;
+
+            // A group that still has an empty slot has never been full, so no probe sequence ever continued past it
+            // and the slot can simply become empty again. Otherwise it must stay a tombstone.
+            group current_group(&stripe_.control[position - position % FLAT_MAP_GROUP_SIZE]);
+            if (current_group.match_empty()) {
+                set_control(stripe_, position, EMPTY);
+                ++stripe_.growth_left;
+            } else {
+                set_control(stripe_, position, DELETED);
+            }
+        }
+
+        /**
+         * Returns a free slot for a new key with the hash, growing the table if it is out of room, and marks it as
+         * full. The caller constructs the slot.
+         */
+        std::size_t claim_free(stripe& stripe_, std::size_t hash) {
+            if (!stripe_.slots) {
+                resize(stripe_, 1);
+            }
+            auto position = find_free(stripe_, hash);
+            if (stripe_.growth_left == 0 && stripe_.control[position] == EMPTY) {
+                // Out of room. Grow unless most of the used slots are only tombstones, rebuilding at the same size
+                // clears those.
+                auto capacity = (stripe_.group_count_mask + 1) * FLAT_MAP_GROUP_SIZE;
+                auto groups = stripe_.group_count_mask + 1;
+                resize(stripe_, stripe_.size * 2 >= maximum_load(capacity) ? groups * 2 : groups);
+                position = find_free(stripe_, hash);
+            }
+
+            if (stripe_.control[position] == EMPTY) {
+                --stripe_.growth_left;
+            }
+            set_control(stripe_, position, hash_bits(hash));
+            return position;
+        }
+
+        /**
+         * Inserts a value constructed from args, or assigns it to the value of an existing key. Returns whether the
+         * key was new.
+         */
+        template<typename... ARGS>
+        bool assign(KEY_TYPE key, ARGS&&... args) {
+            auto hash = detail::mix_hash(hash_function(key));
+            auto& stripe_ = stripes[hash & stripe_mask];
+            hash >>= stripe_shift;
+            std::lock_guard<std::mutex> lock(stripe_.locks.lock(stripe_.mutex), std::adopt_lock);
+
+            auto position = find_position(stripe_, key, hash);
+            if (position != (stripe_.group_count_mask + 1) * FLAT_MAP_GROUP_SIZE) {
+                stripe_.slots[position].value = T(std::forward<ARGS>(args)...);
+                return false;
+            }
+
+            position = claim_free(stripe_, hash);
+            new (&stripe_.slots[position]) slot(std::move(key), std::forward<ARGS>(args)...);
+            ++stripe_.size;
+            return true;
+        }
+
+    public:
+        flat_map()
+            : flat_map(detail::hardware_threads() * FLAT_MAP_STRIPES_PER_CORE) {
+        }
+
+        /**
+         * Constructs a map with (at least) the provided amount of lock stripes, rounded up to a power of two.
+         */
+        explicit flat_map(std::size_t stripe_count, HASH const& hash = HASH(), KEY_EQUAL const& equal = KEY_EQUAL())
+            : hash_function(hash)
+            , key_equal(equal)
+            , stripe_mask(0)
+            , stripe_shift(0) {
+            while ((stripe_mask + 1) < stripe_count) {
+                stripe_mask = (stripe_mask << 1) | 1;
+                ++stripe_shift;
+            }
+            stripes.reset(new stripe[stripe_mask + 1]);
+        }
+
+        ~flat_map() {
+            for (std::size_t index = 0; index <= stripe_mask; ++index) {
+                auto& stripe_ = stripes[index];
+                if (!stripe_.slots) continue;
+
+                auto capacity = (stripe_.group_count_mask + 1) * FLAT_MAP_GROUP_SIZE;
+                for (std::size_t position = 0; position < capacity; ++position) {
+                    if (stripe_.control[position] >= 0) {
+                        stripe_.slots[position].~slot();
+                    }
+                }
+                detail::free_aligned(stripe_.slots);
+            }
+        }
+
+        // Disallow copying a map
+        flat_map(const flat_map &other) = delete;
+        flat_map &operator=(const flat_map &other) = delete;
+
+        /**
+         * Inserts value into map, overwriting the value of an existing key.
+         */
+        void insert(KEY_TYPE key, T value) {
+            emplace(std::move(key), std::move(value));
+        }
+
+        /**
+         * Inserts a value constructed from args into the map, overwriting the value of an existing key like insert.
+         * A new key's value is constructed right in its slot.
+         */
+        template<typename... ARGS>
+        void emplace(KEY_TYPE key, ARGS&&... args) {
+            assign(std::move(key), std::forward<ARGS>(args)...);
+        }
+
+        /**
+         * Same as insert, but returns true if the key was inserted and false if an existing value was overwritten.
+         */
+        bool insert_or_assign(KEY_TYPE key, T value) {
+            return assign(std::move(key), std::move(value));
+        }
+
+        /**
+         * Inserts a value constructed from args unless the key is already in the map, returning whether it was
+         * inserted. An existing value is left alone, and nothing is constructed for it.
+         */
+        template<typename... ARGS>
+        bool try_emplace(KEY_TYPE key, ARGS&&... args) {
+            auto hash = detail::mix_hash(hash_function(key));
+            auto& stripe_ = stripes[hash & stripe_mask];
+            hash >>= stripe_shift;
+            std::lock_guard<std::mutex> lock(stripe_.locks.lock(stripe_.mutex), std::adopt_lock);
+
+            if (find_position(stripe_, key, hash) != (stripe_.group_count_mask + 1) * FLAT_MAP_GROUP_SIZE) {
+                return false;
+            }
+
+            auto position = claim_free(stripe_, hash);
+            new (&stripe_.slots[position]) slot(std::move(key), std::forward<ARGS>(args)...);
+            ++stripe_.size;
+            return true;
+        }
+
+        /**
+         * Calls function(T& value) on the key's value, in its slot, if the key is in the map, returning whether it
+         * was. The function runs while holding the stripe lock, so it should be short.
+         */
+        template<typename FUNCTION>
+        bool update(KEY_TYPE const& key, FUNCTION function) {
+            auto hash = detail::mix_hash(hash_function(key));
+            auto& stripe_ = stripes[hash & stripe_mask];
+            hash >>= stripe_shift;
+            std::lock_guard<std::mutex> lock(stripe_.locks.lock(stripe_.mutex), std::adopt_lock);
+
+            auto position = find_position(stripe_, key, hash);
+            if (position == (stripe_.group_count_mask + 1) * FLAT_MAP_GROUP_SIZE) {
+                return false;
+            }
+
+            function(stripe_.slots[position].value);
+            return true;
+        }
+
+        /**
+         * Calls function(T& value, bool found) on the key's value, or on a value initialized T if the key isn't in the
+         * map. If the function returns true the value it leaves is stored under the key (inserting the key if it is
+         * new), and if it returns false the key is erased (or not inserted). Returns whether the key is in the map
+         * afterwards.
+         */
+        template<typename FUNCTION>
+        bool compute(KEY_TYPE key, FUNCTION function) {
+            auto hash = detail::mix_hash(hash_function(key));
+            auto& stripe_ = stripes[hash & stripe_mask];
+            hash >>= stripe_shift;
+            std::lock_guard<std::mutex> lock(stripe_.locks.lock(stripe_.mutex), std::adopt_lock);
+
+            auto position = find_position(stripe_, key, hash);
+            if (position != (stripe_.group_count_mask + 1) * FLAT_MAP_GROUP_SIZE) {
+                if (function(stripe_.slots[position].value, true)) return true;
+
+                erase_at(stripe_, position);
+                return false;
+            }
+
+            T value = T();
+            if (!function(value, false)) return false;
+
+            position = claim_free(stripe_, hash);
+            new (&stripe_.slots[position]) slot(std::move(key), std::move(value));
+            ++stripe_.size;
+            return true;
+        }
+
+        /**
+         * Erases the key if predicate(T const& value) returns true for its value, returning whether it was erased.
+         */
+        template<typename PREDICATE>
+        bool erase_if(KEY_TYPE const& key, PREDICATE predicate) {
+            auto hash = detail::mix_hash(hash_function(key));
+            auto& stripe_ = stripes[hash & stripe_mask];
+            hash >>= stripe_shift;
+            std::lock_guard<std::mutex> lock(stripe_.locks.lock(stripe_.mutex), std::adopt_lock);
+
+            auto position = find_position(stripe_, key, hash);
+            if (position == (stripe_.group_count_mask + 1) * FLAT_MAP_GROUP_SIZE) {
+                return false;
+            }
+
+            T const& value = stripe_.slots[position].value;
+            if (!predicate(value)) return false;
+
+            erase_at(stripe_, position);
+            return true;
+        }
+
+        /**
+         * Adds delta to the key's value, inserting the key with a value of delta if it is new, and returns the value
+         * from before (0 for a new key). Only available for arithmetic values other than bool. Unlike ccl::map's, it
+         * takes the stripe lock like every other write.
+         */
+        template<typename U = T, typename = typename std::enable_if<
+                std::is_arithmetic<U>::value && !std::is_same<U, bool>::value>::type>
+        T fetch_add(KEY_TYPE key, T delta) {
+            T previous = T();
+            compute(std::move(key), [&](T& value, bool) {
+                previous = value;
+                value += delta;
+                return true;
+            });
+            return previous;
+        }
+
+        /**
+         * Modifies reference to value at corresponding key, returning true if it exists.
+         */
+        bool try_at(KEY_TYPE key, T& value) {
+            return find(key, value);
+        }
+
+        /**
+         * Heterogeneous version of try_at, available when HASH and KEY_EQUAL are transparent.
+         */
+        template<typename LOOKUP_TYPE, typename H = HASH, typename E = KEY_EQUAL,
+                 typename = typename H::is_transparent, typename = typename E::is_transparent>
+        bool try_at(LOOKUP_TYPE const& key, T& value) {
+            return find(key, value);
+        }
+
+        /**
+         * If map has entry with provided key, deletes entry and returns true.
+         */
+        bool try_erase(KEY_TYPE key) {
+            return erase(key);
+        }
+
+        /**
+         * Heterogeneous version of try_erase, available when HASH and KEY_EQUAL are transparent.
+         */
+        template<typename LOOKUP_TYPE, typename H = HASH, typename E = KEY_EQUAL,
+                 typename = typename H::is_transparent, typename = typename E::is_transparent>
+        bool try_erase(LOOKUP_TYPE const& key) {
+            return erase(key);
+        }
+
+#ifdef CCL_ENABLE_STATS
+        /**
+         * Returns the statistics gathered so far, added up over all threads. probe_lengths holds the groups each
+         * probe sequence visited, for lookups and writes alike. Only available when compiled with CCL_ENABLE_STATS.
+         */
+        map_stats stats() const {
+            auto snapshot = detail::collect<map_stats>(statistics);
+            snapshot.stripes.resize(stripe_mask + 1);
+            for (std::size_t index = 0; index <= stripe_mask; ++index) {
+                stripes[index].locks.add_to(snapshot.stripes[index]);
+                stripes[index].locks.add_to(snapshot.locks);
+            }
+            return snapshot;
+        }
+#endif
+    };
+}
+
+#endif //CCL_FLAT_MAP_HPP
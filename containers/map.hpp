@@ -7,48 +7,331 @@
 #ifndef CCL_MAP_HPP
 #define CCL_MAP_HPP
 
+#include <algorithm>
 #include <cstddef>
-#include <array>
+#include <cstdint>
+#include <atomic>
 #include <functional>
+#include <iterator>
+#include <memory>
 #include <utility>
 #include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "detail.hpp"
+#include "numa.hpp"
+#include "reclaim.hpp"
+#include "stats.hpp"
 
 namespace ccl {
-    std::size_t const BUCKET_SIZE = 19; // May need to change this to scale with available cores on computer
+    std::size_t const INITIAL_BUCKET_COUNT = 4; // Buckets each stripe starts with (must be a power of two)
+    std::size_t const STRIPES_PER_CORE = 4; // Lock stripes allocated per hardware thread by the default constructor
+    double const MAXIMUM_LOAD_FACTOR = 1.0; // Average entries per bucket before a stripe splits another bucket
+    unsigned int const OPTIMISTIC_READ_ATTEMPTS = 8; // Lock-free read attempts before a reader takes the stripe lock
 
     /**
      * A hashmap that supports concurrent operations.
+     *
+     * Keys are partitioned into lock stripes, and each stripe owns a growable table of buckets (each bucket being an
+     * AVL tree). Stripes grow independently using linear hashing: whenever a stripe's load factor is exceeded, exactly
+     * one of its buckets is split in two. Growing is therefore incremental (no operation ever rehashes a whole table) and
+     * only ever blocks the one stripe being split, never the whole map.
+     *
+     * Writers exclude each other with the stripe's mutex, but readers take no lock at all. Each stripe is a seqlock:
+     * writers make the stripe's sequence odd while they restructure it, and readers retry if the sequence changed while
+     * they were traversing. Nodes are never modified once readers can reach them (overwriting a value replaces the
+     * node), and unlinked nodes and tables are retired through ccl::reclaim so a reader never touches freed memory.
+     *
+     * Trees are ordered by hash and every node stores its full key, so keys whose hashes collide are kept apart. The
+     * first key seen for a hash sits in the tree and further keys with that same hash are chained behind it.
+     *
+     * If both HASH and KEY_EQUAL define is_transparent, lookups accept any key type they can hash and compare against
+     * KEY_TYPE (for example a string_view against std::string keys) without constructing a temporary KEY_TYPE.
+     *
+     * Read-modify-write operations (try_emplace, update, compute, erase_if, fetch_add) find the key and change it in a
+     * single traversal while holding the stripe lock, so no other write to the key can land in between. Arithmetic
+     * values (of up to 64 bits) are kept in a std::atomic, which lets fetch_add change them in place without any lock.
+     *
+     * bulk_insert loads a whole range at once, building the trees of empty buckets directly as balanced trees, and
+     * for_each and parallel_for_each visit every entry while writers carry on, copying out one bucket at a time.
+     *
+     * The PLACEMENT policy decides which NUMA node the buckets and nodes of each stripe are allocated on:
+     * shared_placement (the default) leaves that to the allocator, while numa_placement (see ccl::numa_map) splits the
+     * stripes between the nodes and keeps all of a stripe's memory on the node that owns it.
      */
-    template<typename KEY_TYPE, typename T>
+    template<typename KEY_TYPE, typename T, typename HASH = std::hash<KEY_TYPE>,
+             typename KEY_EQUAL = std::equal_to<KEY_TYPE>, typename PLACEMENT = shared_placement>
     class map {
     private:
-        std::hash<KEY_TYPE> hash_function;
+        HASH hash_function;
+        KEY_EQUAL key_equal;
+
+        // Values that fetch_add changes in place, so that readers copying one meanwhile see either the old or the new
+        // value. Larger arithmetic types aren't lock-free on every platform.
+        static bool const atomic_values = std::is_arithmetic<T>::value && sizeof(T) <= sizeof(std::uint64_t);
+        using stored_value = typename std::conditional<atomic_values, std::atomic<T>, T>::type;
 
         /**
          * A node entry in a binary tree.
          */
         struct node {
-            T value;
+            KEY_TYPE key;
+            stored_value value;
             std::size_t hash_value;
-            std::uint8_t height; // 8 bit is enough because height = log2(num_entries/bucket_size), which for 8 bits
+            std::uint8_t height; // 8 bit is enough because height = log2(num_entries/bucket_count), which for 8 bits
                                  // can hold roughly 10^78 entries...
 
-            node* lesser_key_node; // left
-            node* greater_key_node; // right
+            // Written by the stripe's writer (release) and read concurrently by lock-free readers (acquire)
+            std::atomic<node*> lesser_key_node; // left
+            std::atomic<node*> greater_key_node; // right
+            std::atomic<node*> next_collision; // Next node with this same hash (only the one in the tree has children)
 
-            node(T value_, std::size_t hash)
-                    : value(value_)
+            template<typename... ARGS>
+            node(KEY_TYPE key_, std::size_t hash, ARGS&&... args)
+                    : key(std::move(key_))
+                    , value(std::forward<ARGS>(args)...)
                     , hash_value(hash)
                     , height(1)
                     , lesser_key_node(nullptr)
-                    , greater_key_node(nullptr) {
+                    , greater_key_node(nullptr)
+                    , next_collision(nullptr) {
+            }
+
+            // Accessors for the writer, which holds the stripe lock
+            node* lesser() const { return lesser_key_node.load(std::memory_order_relaxed); }
+            node* greater() const { return greater_key_node.load(std::memory_order_relaxed); }
+            void lesser(node* node_) { lesser_key_node.store(node_, std::memory_order_release); }
+            void greater(node* node_) { greater_key_node.store(node_, std::memory_order_release); }
+            node* collision() const { return next_collision.load(std::memory_order_relaxed); }
+            void collision(node* node_) { next_collision.store(node_, std::memory_order_release); }
+        };
+
+        /**
+         * An array of bucket roots. Its capacity never changes, when a stripe outgrows it the array is copied into a
+         * larger one and the old one is retired.
+         */
+        struct bucket_array {
+            std::size_t capacity;
+            std::atomic<node*>* roots; // Placed on the node of the stripe
+
+            bucket_array(std::size_t capacity_, std::size_t placement_node)
+                : capacity(capacity_)
+                , roots(static_cast<std::atomic<node*>*>(
+                        PLACEMENT::allocate(capacity_ * sizeof(std::atomic<node*>), placement_node))) {
+                for (std::size_t index = 0; index < capacity; ++index) {
+                    ::new (static_cast<void*>(&roots[index])) std::atomic<node*>(nullptr);
+                }
+            }
+
+            ~bucket_array() {
+                PLACEMENT::deallocate(roots);
+            }
+
+            bucket_array(const bucket_array &other) = delete;
+            bucket_array &operator=(const bucket_array &other) = delete;
+        };
+
+        /**
+         * A lock stripe, holding its own bucket table whose structure is only modified while holding the stripe's
+         * mutex. Its fields fill whole cache lines, so the sequence readers poll on never shares a line with another
+         * stripe.
+         *
+         * The one change made without the mutex is fetch_add's, which adds to an atomic value in place. The adder
+         * counts itself in in_place_writers and then finds the node like a lock-free reader, giving up if the sequence
+         * is odd. A write_lock makes the sequence odd and then waits until in_place_writers drops to zero, so every
+         * node an adder found stays linked until it is done with it.
+         *
+         * The table is addressed using linear hashing. Buckets below split_index have already been split for the
+         * current round and are addressed with one extra bit of the hash.
+         */
+        struct alignas(CACHE_LINE_SIZE) stripe : detail::cache_aligned_allocation {
+            std::mutex mutex;
+            detail::lock_counters locks; // Locks the mutex, counting how contended it is with CCL_ENABLE_STATS
+            std::atomic<unsigned int> sequence; // Odd while a writer is modifying the stripe
+            std::atomic<bucket_array*> buckets;
+            std::atomic<std::size_t> level_mask; // (bucket count at the start of this split round) - 1
+            std::atomic<std::size_t> split_index; // Next bucket to be split
+            std::size_t bucket_count; // Only used by writers
+            detail::owned_counter entry_count; // Only changed by writers, size_approx reads it from any thread
+            std::size_t placement_node; // NUMA node the stripe's buckets and nodes are allocated on
+            std::atomic<unsigned int> in_place_writers; // Threads in fetch_add's lock-free path, which writers wait out
+
+            stripe()
+                : sequence(0)
+                , buckets(nullptr)
+                , level_mask(INITIAL_BUCKET_COUNT - 1)
+                , split_index(0)
+                , bucket_count(INITIAL_BUCKET_COUNT)
+                , placement_node(0)
+                , in_place_writers(0) {
+            }
+
+            /**
+             * Allocates the initial buckets on the given node, which the stripe's nodes are then allocated on as well.
+             */
+            void place(std::size_t node_) {
+                placement_node = node_;
+                buckets.store(new bucket_array(INITIAL_BUCKET_COUNT, node_), std::memory_order_relaxed);
+            }
+
+            ~stripe() {
+                delete buckets.load();
+            }
+
+            std::atomic<node*>& root(std::size_t index) {
+                return buckets.load(std::memory_order_relaxed)->roots[index];
             }
         };
 
-        // 19 buckets are used to hold map entries bucket = (key % bucket_size)
-        std::array<node*, BUCKET_SIZE> buckets;
-        // Each bucket gets its own mutex so that lock contention is dramatically reduced
-        std::array<std::mutex, BUCKET_SIZE> bucket_mutexes;
+        /**
+         * Holds a stripe's lock and marks the stripe as being modified for as long as it exists.
+         */
+        class write_lock {
+        private:
+            stripe& stripe_;
+            std::lock_guard<std::mutex> lock;
+
+        public:
+            explicit write_lock(stripe& stripe__)
+                : stripe_(stripe__)
+                , lock(stripe__.locks.lock(stripe__.mutex), std::adopt_lock) {
+                stripe_.sequence.store(stripe_.sequence.load(std::memory_order_relaxed) + 1,
+                                       std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release); // Sequence is odd before any change is visible
+
+                if (atomic_values) {
+                    // Either this thread sees an adder's increment, or the adder sees the odd sequence and backs off.
+                    // The node an adder found must stay in place until it is done with it.
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    while (stripe_.in_place_writers.load(std::memory_order_acquire)) {
+                        detail::cpu_relax();
+                    }
+                }
+            }
+
+            ~write_lock() {
+                stripe_.sequence.store(stripe_.sequence.load(std::memory_order_relaxed) + 1,
+                                       std::memory_order_release);
+            }
+        };
+
+        std::unique_ptr<stripe[]> stripes;
+        std::size_t stripe_mask;
+        unsigned int stripe_shift; // Bits of the hash used to select a stripe
+
+#ifdef CCL_ENABLE_STATS
+        detail::sharded<detail::map_counters> statistics;
+#endif
+
+        /**
+         * Allocates a node on the stripe's NUMA node.
+         */
+        template<typename... ARGS>
+        static node* create_node(stripe const& stripe_, ARGS&&... args) {
+            auto memory = PLACEMENT::allocate(sizeof(node), stripe_.placement_node);
+            try {
+                return ::new (memory) node(std::forward<ARGS>(args)...);
+            } catch (...) {
+                PLACEMENT::deallocate(memory);
+                throw;
+            }
+        }
+
+        static void destroy_node(void* old_node) {
+            if (old_node) {
+                static_cast<node*>(old_node)->~node();
+                PLACEMENT::deallocate(old_node);
+            }
+        }
+
+        /**
+         * Frees the node once no reader can still be traversing it.
+         */
+        static void retire_node(node* old_node) {
+            reclaim::retire(old_node, &destroy_node);
+        }
+
+        /**
+         * Returns the stripe a hash belongs to.
+         */
+        inline stripe& stripe_for(std::size_t hash) {
+            return stripes[hash & stripe_mask];
+        }
+
+        /**
+         * Returns the bucket index in its stripe for the given hash.
+         */
+        inline std::size_t bucket_index(std::size_t level_mask, std::size_t split_index, std::size_t hash) const {
+            auto local_hash = hash >> stripe_shift;
+            auto index = local_hash & level_mask;
+            if (index < split_index) {
+                // Bucket was already split this round, so one more bit of the hash is needed
+                index = local_hash & ((level_mask << 1) | 1);
+            }
+            return index;
+        }
+
+        /**
+         * Bucket index for a writer, which holds the stripe lock.
+         */
+        inline std::size_t bucket_index(stripe const& stripe_, std::size_t hash) const {
+            return bucket_index(stripe_.level_mask.load(std::memory_order_relaxed),
+                                stripe_.split_index.load(std::memory_order_relaxed), hash);
+        }
+
+        /**
+         * Searches the stripe without taking its lock. Returns false if a writer interfered with the search, otherwise
+         * sets found to the matching node (or nullptr if there is none). Must be called while pinned.
+         */
+        template<typename LOOKUP_TYPE>
+        bool optimistic_find(stripe& stripe_, LOOKUP_TYPE const& key, std::size_t hash, node*& found) {
+            auto sequence = stripe_.sequence.load(std::memory_order_acquire);
+            if (sequence & 1) {
+                // A writer is busy with this stripe
+                return false;
+            }
+
+            auto level_mask = stripe_.level_mask.load(std::memory_order_relaxed);
+            auto split_index = stripe_.split_index.load(std::memory_order_relaxed);
+            auto table = stripe_.buckets.load(std::memory_order_acquire);
+            auto index = bucket_index(level_mask, split_index, hash);
+            if (index >= table->capacity) {
+                // Saw the split pointer of a larger table than the one read, the stripe changed under us
+                return false;
+            }
+
+            found = nullptr;
+            auto current_node = table->roots[index].load(std::memory_order_acquire);
+            // A tree being restructured can be seen in an inconsistent state, so bound the walk. No valid tree comes
+            // close to this height (see node::height).
+            for (unsigned int steps = 0; current_node; ++steps) {
+                if (steps == 256) {
+                    return false;
+                }
+
+                if (hash > current_node->hash_value) {
+                    current_node = current_node->greater_key_node.load(std::memory_order_acquire);
+                } else if (hash < current_node->hash_value) {
+                    current_node = current_node->lesser_key_node.load(std::memory_order_acquire);
+                } else {
+                    // Same hash, but it may belong to another key. Chains only ever point forward, so no bound is
+                    // needed here.
+                    for (; current_node; current_node = current_node->next_collision.load(std::memory_order_acquire)) {
+                        if (key_equal(current_node->key, key)) {
+                            found = current_node;
+                            break;
+                        }
+                    }
+                    break;
+                }
+            }
+
+            // Validate that no writer touched the stripe while we were reading it
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return stripe_.sequence.load(std::memory_order_relaxed) == sequence;
+        }
 
         /**
          * Returns height of a node (empty node is zero).
@@ -60,16 +343,16 @@ namespace ccl {
         /**
          * Returns the balance factor of a given node.
          */
-        inline unsigned int balance_factor(node* node_) {
-            return height(node_->greater_key_node) - height(node_->lesser_key_node);
+        inline int balance_factor(node* node_) {
+            return height(node_->greater()) - height(node_->lesser());
         }
 
         /**
          * Corrects the height value for the given node (assuming height is correct for children nodes).
          */
         void fix_height(node* node_) {
-            auto lesser_node_height = height(node_->lesser_key_node);
-            auto greater_node_height = height(node_->greater_key_node);
+            auto lesser_node_height = height(node_->lesser());
+            auto greater_node_height = height(node_->greater());
             node_->height = (lesser_node_height > greater_node_height ? lesser_node_height : greater_node_height) + 1;
         }
 
@@ -77,9 +360,9 @@ namespace ccl {
          * Right rotation around node_.
          */
         inline node* rotate_right(node* node_) {
-            node* result = node_->lesser_key_node;
-            node_->lesser_key_node = result->greater_key_node;
-            result->greater_key_node = node_;
+            node* result = node_->lesser();
+            node_->lesser(result->greater());
+            result->greater(node_);
             fix_height(node_);
             fix_height(result);
             return result;
@@ -89,9 +372,9 @@ namespace ccl {
          * Left rotation around node_.
          */
         inline node* rotate_left(node* node_) {
-            node* result = node_->greater_key_node;
-            node_->greater_key_node = result->lesser_key_node;
-            result->lesser_key_node = node_;
+            node* result = node_->greater();
+            node_->greater(result->lesser());
+            result->lesser(node_);
             fix_height(node_);
             fix_height(result);
             return result;
@@ -104,14 +387,14 @@ namespace ccl {
             fix_height(node_);
             if (balance_factor(node_) == 2) {
                 // Too high on right side
-                if (balance_factor(node_->greater_key_node) < 0)
-                    node_->greater_key_node = rotate_right(node_->greater_key_node);
+                if (balance_factor(node_->greater()) < 0)
+                    node_->greater(rotate_right(node_->greater()));
                 return rotate_left(node_);
             }
             if (balance_factor(node_) == -2) {
                 // Too high on left side
-                if (balance_factor(node_->lesser_key_node) > 0)
-                    node_->lesser_key_node = rotate_left(node_->lesser_key_node);
+                if (balance_factor(node_->lesser()) > 0)
+                    node_->lesser(rotate_left(node_->lesser()));
                 return rotate_right(node_);
             }
 
@@ -120,17 +403,94 @@ namespace ccl {
         }
 
         /**
-         * Inserts node for tree with provided base node.
+         * Finds the key in the tree with provided base node and lets the visitor decide what becomes of it, returning
+         * the new base node. If the key is in the tree, visitor.existing(node) returns the node to put in its place:
+         * the node itself to keep it, a new node holding the new value to replace it with, or nullptr to erase the
+         * key. Otherwise visitor.create() returns the node to insert, or nullptr to leave the tree as it is. create is
+         * the last thing to use the key, so it may move from it. Sets size_change to 1 or -1 if an entry was inserted
+         * or erased.
          */
-        node* insert(node* base_node, T value, std::size_t hash_value) {
+        template<typename LOOKUP_TYPE, typename VISITOR>
+        node* upsert(node* base_node, LOOKUP_TYPE const& key, std::size_t hash, VISITOR& visitor, int& size_change) {
+            if (!base_node) {
+                auto new_node = visitor.create();
+                if (new_node) {
+                    size_change = 1;
+                }
+                return new_node;
+            }
+            if (hash < base_node->hash_value)
+                base_node->lesser(upsert(base_node->lesser(), key, hash, visitor, size_change));
+            else if (hash > base_node->hash_value)
+                base_node->greater(upsert(base_node->greater(), key, hash, visitor, size_change));
+            else
+                return upsert_collision(base_node, key, visitor, size_change);
+
+            return balance(base_node);
+        }
+
+        /**
+         * upsert for the chain of keys sharing the tree node's hash, returning the node that now sits in the tree.
+         */
+        template<typename LOOKUP_TYPE, typename VISITOR>
+        node* upsert_collision(node* tree_node, LOOKUP_TYPE const& key, VISITOR& visitor, int& size_change) {
+            if (key_equal(tree_node->key, key)) {
+                auto new_node = visitor.existing(tree_node);
+                if (new_node == tree_node) return tree_node;
+                if (new_node) return replace(tree_node, new_node);
+
+                size_change = -1;
+                return detach(tree_node);
+            }
+
+            auto previous_node = tree_node;
+            for (auto current_node = tree_node->collision(); current_node; current_node = current_node->collision()) {
+                if (key_equal(current_node->key, key)) {
+                    auto new_node = visitor.existing(current_node);
+                    if (!new_node) {
+                        previous_node->collision(current_node->collision());
+                        retire_node(current_node);
+                        size_change = -1;
+                    } else if (new_node != current_node) {
+                        previous_node->collision(replace(current_node, new_node));
+                    }
+                    return tree_node;
+                }
+                previous_node = current_node;
+            }
+
+            // First time this key is seen, chain it right behind the tree node
+            if (auto new_node = visitor.create()) {
+                size_change = 1;
+                new_node->collision(tree_node->collision());
+                tree_node->collision(new_node);
+            }
+            return tree_node;
+        }
+
+        /**
+         * Puts the new node holding the new value in the old node's place in the tree or chain, since readers may be
+         * copying the old value right now. The old node is retired.
+         */
+        node* replace(node* old_node, node* new_node) {
+            new_node->height = old_node->height;
+            new_node->lesser(old_node->lesser());
+            new_node->greater(old_node->greater());
+            new_node->collision(old_node->collision());
+            retire_node(old_node);
+            return new_node;
+        }
+
+        /**
+         * Links an already allocated (detached) node into the tree with provided base node.
+         */
+        node* link(node* base_node, node* new_node) {
             if (!base_node)
-                return new node(std::move(value), std::move(hash_value));
-            if (hash_value < base_node->hash_value)
-                base_node->lesser_key_node = insert(base_node->lesser_key_node, std::move(value), std::move(hash_value));
-            else if (hash_value > base_node->hash_value)
-                base_node->greater_key_node = insert(base_node->greater_key_node, std::move(value), std::move(hash_value));
-            else if (hash_value == base_node->hash_value)
-                base_node->value = std::move(value);
+                return new_node;
+            if (new_node->hash_value < base_node->hash_value)
+                base_node->lesser(link(base_node->lesser(), new_node));
+            else
+                base_node->greater(link(base_node->greater(), new_node));
 
             return balance(base_node);
         }
@@ -139,45 +499,46 @@ namespace ccl {
          * Finds node with smallest hash in tree.
          */
         node* find_minimum_hash(node* base_node) {
-            return base_node->lesser_key_node ? find_minimum_hash(base_node->lesser_key_node) : base_node;
+            return base_node->lesser() ? find_minimum_hash(base_node->lesser()) : base_node;
         }
 
         /**
          * Removes the node with the smallest hash in tree.
          */
         node* remove_minimum_hash(node* base_node) {
-            if (base_node->lesser_key_node == 0)
-                return base_node->greater_key_node;
+            if (base_node->lesser() == 0)
+                return base_node->greater();
 
-            base_node->lesser_key_node = remove_minimum_hash(base_node->lesser_key_node);
+            base_node->lesser(remove_minimum_hash(base_node->lesser()));
 
             return balance(base_node);
         }
 
         /**
-         * Remove node with provided key from tree.
+         * Unlinks the tree node, returning the subtree that takes its place. The node is retired.
          */
-        node* remove(node* base_node, std::size_t hash_value, bool& result) {
-            if (!base_node) return nullptr;
-            if (hash_value < base_node->hash_value)
-                base_node->lesser_key_node = remove(base_node->lesser_key_node, hash_value, result);
-            else if (hash_value > base_node->hash_value)
-                base_node->greater_key_node = remove(base_node->greater_key_node, hash_value, result);
-            else {
-                auto left_node = base_node->lesser_key_node;
-                auto right_node = base_node->greater_key_node;
-                delete base_node;
-                result = true; // Removed element
+        node* detach(node* base_node) {
+            if (auto next_node = base_node->collision()) {
+                // Promote the next key with this hash into the tree node's place
+                next_node->height = base_node->height;
+                next_node->lesser(base_node->lesser());
+                next_node->greater(base_node->greater());
+                retire_node(base_node);
+                return next_node;
+            }
 
-                if (!right_node)
-                    return left_node;
+            auto left_node = base_node->lesser();
+            auto right_node = base_node->greater();
+            retire_node(base_node); // Readers may still be traversing it
 
-                auto min = find_minimum_hash(right_node);
-                min->greater_key_node = remove_minimum_hash(right_node);
-                min->lesser_key_node = left_node;
+            if (!right_node)
+                return left_node;
 
-                return balance(min);
-            }
+            auto min = find_minimum_hash(right_node);
+            min->greater(remove_minimum_hash(right_node));
+            min->lesser(left_node);
+
+            return balance(min);
         }
 
         /**
@@ -185,79 +546,811 @@ namespace ccl {
          */
         node* delete_children(node* base_node) {
             if (base_node) {
-                delete delete_children(base_node->lesser_key_node);
-                delete delete_children(base_node->greater_key_node);
+                destroy_node(delete_children(base_node->lesser()));
+                destroy_node(delete_children(base_node->greater()));
+
+                // Along with the keys chained behind it
+                auto current_node = base_node->collision();
+                while (current_node) {
+                    auto old_node = current_node;
+                    current_node = current_node->collision();
+                    destroy_node(old_node);
+                }
             }
 
             return base_node;
         }
 
+
+        /**
+         * Detaches every node of the tree, appending them to the provided list (linked through greater_key_node).
+         */
+        void detach_all(node* base_node, node*& detached) {
+            if (!base_node) return;
+            detach_all(base_node->lesser(), detached);
+            detach_all(base_node->greater(), detached);
+
+            base_node->lesser(nullptr);
+            base_node->height = 1;
+            base_node->greater(detached);
+            detached = base_node;
+        }
+
+        /**
+         * Splits the next bucket of the stripe in two, moving the entries that now address the new bucket. Must be
+         * called while holding the stripe's write lock.
+         */
+        void split_bucket(stripe& stripe_) {
+            auto old_index = stripe_.split_index.load(std::memory_order_relaxed);
+            auto level_mask = stripe_.level_mask.load(std::memory_order_relaxed);
+            auto new_mask = (level_mask << 1) | 1;
+
+            // The new bucket is always appended, since bucket_count == level_mask + 1 + split_index
+            auto table = stripe_.buckets.load(std::memory_order_relaxed);
+            if (stripe_.bucket_count == table->capacity) {
+                // Out of room, move the roots into an array twice as large
+                auto larger_table = new bucket_array(table->capacity * 2, stripe_.placement_node);
+                for (std::size_t index = 0; index < table->capacity; ++index) {
+                    larger_table->roots[index].store(table->roots[index].load(std::memory_order_relaxed),
+                                                     std::memory_order_relaxed);
+                }
+                stripe_.buckets.store(larger_table, std::memory_order_release);
+                reclaim::retire(table);
+            }
+            auto new_index = stripe_.bucket_count++;
+
+            node* detached = nullptr;
+            detach_all(stripe_.root(old_index).load(std::memory_order_relaxed), detached);
+            node* old_root = nullptr;
+            node* new_root = nullptr;
+            while (detached) {
+                auto current_node = detached;
+                detached = detached->greater();
+                current_node->greater(nullptr);
+
+                if (((current_node->hash_value >> stripe_shift) & new_mask) == old_index) {
+                    old_root = link(old_root, current_node);
+                } else {
+                    new_root = link(new_root, current_node);
+                }
+            }
+            stripe_.root(old_index).store(old_root, std::memory_order_release);
+            stripe_.root(new_index).store(new_root, std::memory_order_release);
+
+            // Advance the split pointer, starting a new round once every bucket of this round has been split
+            if (old_index + 1 > level_mask) {
+                stripe_.level_mask.store(new_mask, std::memory_order_relaxed);
+                stripe_.split_index.store(0, std::memory_order_relaxed);
+            } else {
+                stripe_.split_index.store(old_index + 1, std::memory_order_relaxed);
+            }
+        }
+
+        /**
+         * Looks up the key, copying its value if found.
+         */
+        template<typename LOOKUP_TYPE>
+        bool find(LOOKUP_TYPE const& key, T& value) {
+            auto hash = detail::mix_hash(hash_function(key));
+            auto& stripe_ = stripe_for(hash);
+            reclaim::epoch_guard guard; // Found node can't be freed before we are done copying its value
+            CCL_STATS(detail::count(statistics.local().lookups);)
+
+            node* found = nullptr;
+            for (unsigned int attempt = 0; attempt < OPTIMISTIC_READ_ATTEMPTS; ++attempt) {
+                if (optimistic_find(stripe_, key, hash, found)) {
+                    if (!found) return false;
+
+                    // Values are never modified once published (other than atomically), so this is safe even if the
+                    // node is erased meanwhile
+                    value = found->value;
+                    return true;
+                }
+                CCL_STATS(detail::count(statistics.local().optimistic_retries);)
+                std::this_thread::yield();
+            }
+
+            // Writers are too busy with this stripe, wait for them instead
+            CCL_STATS(detail::count(statistics.local().locked_lookups);)
+            std::lock_guard<std::mutex> lock(stripe_.locks.lock(stripe_.mutex), std::adopt_lock);
+            auto current_node = stripe_.root(bucket_index(stripe_, hash)).load(std::memory_order_relaxed);
+            while (current_node) {
+                if (hash > current_node->hash_value) {
+                    current_node = current_node->greater();
+                } else if (hash < current_node->hash_value) {
+                    current_node = current_node->lesser();
+                } else {
+                    for (; current_node; current_node = current_node->collision()) {
+                        if (key_equal(current_node->key, key)) {
+                            value = current_node->value;
+                            return true;
+                        }
+                    }
+                    return false;
+                }
+            }
+
+            return false;
+        }
+
+        /**
+         * An upsert visitor made of two callables.
+         */
+        template<typename CREATE, typename EXISTING>
+        struct visitor {
+            CREATE create;
+            EXISTING existing;
+        };
+
+        template<typename CREATE, typename EXISTING>
+        static visitor<CREATE, EXISTING> make_visitor(CREATE create, EXISTING existing) {
+            return visitor<CREATE, EXISTING>{create, existing};
+        }
+
+        static node* no_node() {
+            return nullptr;
+        }
+
+        /**
+         * Runs upsert on the key's bucket while holding the stripe's write lock, splitting a bucket if that added an
+         * entry. Returns upsert's size change.
+         */
+        template<typename LOOKUP_TYPE, typename VISITOR>
+        int modify(stripe& stripe_, LOOKUP_TYPE const& key, std::size_t hash, VISITOR visitor) {
+            write_lock lock(stripe_);
+
+            auto& root = stripe_.root(bucket_index(stripe_, hash));
+            int size_change = 0;
+            root.store(upsert(root.load(std::memory_order_relaxed), key, hash, visitor, size_change),
+                       std::memory_order_release);
+
+            if (size_change < 0) {
+                stripe_.entry_count.subtract(1);
+            } else if (size_change > 0) {
+                stripe_.entry_count.add(1);
+                if (stripe_.entry_count.load() > stripe_.bucket_count * MAXIMUM_LOAD_FACTOR) {
+                    // Stripe is getting crowded, split one bucket to keep the trees shallow
+                    split_bucket(stripe_);
+                }
+            }
+            return size_change;
+        }
+
+        /**
+         * Erases the key, returning true if it was in the map.
+         */
+        template<typename LOOKUP_TYPE>
+        bool erase(LOOKUP_TYPE const& key) {
+            auto hash = detail::mix_hash(hash_function(key));
+            return modify(stripe_for(hash), key, hash, make_visitor(&no_node, [](node*) { return no_node(); })) < 0;
+        }
+
+        /**
+         * Inserts a node holding the value constructed from args, replacing the node of an existing key. Returns
+         * whether the key was new.
+         */
+        template<typename... ARGS>
+        bool assign(KEY_TYPE key, ARGS&&... args) {
+            auto hash = detail::mix_hash(hash_function(key));
+            auto& stripe_ = stripe_for(hash);
+            auto new_node = create_node(stripe_, std::move(key), hash, std::forward<ARGS>(args)...);
+            return modify(stripe_, new_node->key, hash, make_visitor([new_node]() { return new_node; },
+                                                                     [new_node](node*) { return new_node; })) > 0;
+        }
+
+        /**
+         * Returns the node taking the place of existing once function(T& value) has changed its value, or nullptr if
+         * the function returned false. An atomic value is changed in place, which is safe while holding the write
+         * lock since fetch_add's lock-free path is waited out.
+         */
+        template<typename FUNCTION>
+        node* change_value(stripe const&, node* existing, FUNCTION& function, std::true_type) {
+            T value = existing->value.load(std::memory_order_relaxed);
+            if (!function(value)) return nullptr;
+
+            existing->value.store(value, std::memory_order_relaxed);
+            return existing;
+        }
+
+        /**
+         * Any other value is changed on a copy, which replaces the node, since lock-free readers may be copying the old
+         * value right now. T must therefore be copyable, as it must for try_at.
+         */
+        template<typename FUNCTION>
+        node* change_value(stripe const& stripe_, node* existing, FUNCTION& function, std::false_type) {
+            T value(existing->value);
+            if (!function(value)) return nullptr;
+
+            return create_node(stripe_, existing->key, existing->hash_value, std::move(value));
+        }
+
+        template<typename U = T>
+        static U add(std::atomic<U>& value, U delta, std::true_type) {
+            return value.fetch_add(delta, std::memory_order_relaxed);
+        }
+
+        /**
+         * Floating point atomics have no fetch_add before C++20.
+         */
+        template<typename U = T>
+        static U add(std::atomic<U>& value, U delta, std::false_type) {
+            auto current = value.load(std::memory_order_relaxed);
+            while (!value.compare_exchange_weak(current, current + delta, std::memory_order_relaxed)) {
+            }
+            return current;
+        }
+
+        /**
+         * Adds delta to the key's value without taking the lock, if the key is in the map and no writer is busy with
+         * the stripe. Returns false if it couldn't.
+         */
+        template<typename LOOKUP_TYPE>
+        bool try_add_in_place(stripe& stripe_, LOOKUP_TYPE const& key, std::size_t hash, T delta, T& previous) {
+            reclaim::epoch_guard guard; // The search may walk through nodes that were just unlinked
+
+            // While counted, no writer gets past its write_lock, so a node found now stays in the map until the value
+            // has been changed
+            stripe_.in_place_writers.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            node* found = nullptr;
+            bool added = optimistic_find(stripe_, key, hash, found) && found;
+            if (added) {
+                previous = add(found->value, delta, std::is_integral<T>());
+            }
+            stripe_.in_place_writers.fetch_sub(1, std::memory_order_release);
+            return added;
+        }
+
+        /**
+         * Copies out the nodes of the tree with provided base node whose bucket was home in the layout (level_mask,
+         * split_index), appending them to entries. Safe without the stripe lock while pinned, but then a writer may
+         * leave the walk in an inconsistent tree, so it gives up (returning false) rather than going deeper than any
+         * valid tree does.
+         */
+        bool copy_home(node* base_node, std::size_t home, std::size_t level_mask, std::size_t split_index,
+                       std::vector<std::pair<KEY_TYPE, T>>& entries, unsigned int depth = 0) {
+            if (!base_node) return true;
+            if (depth == 256) return false;
+
+            if (bucket_index(level_mask, split_index, base_node->hash_value) == home) {
+                for (auto current_node = base_node; current_node;
+                     current_node = current_node->next_collision.load(std::memory_order_acquire)) {
+                    entries.emplace_back(current_node->key, current_node->value);
+                }
+            }
+            return copy_home(base_node->lesser_key_node.load(std::memory_order_acquire), home, level_mask, split_index,
+                             entries, depth + 1) &&
+                   copy_home(base_node->greater_key_node.load(std::memory_order_acquire), home, level_mask,
+                             split_index, entries, depth + 1);
+        }
+
+        /**
+         * Copies out the entries of bucket home of the layout (level_mask, split_index) from the current table. Since
+         * buckets only ever split, those entries can only have moved to the buckets whose index matches home in the
+         * bits that addressed it. Returns false if a writer interfered, like optimistic_find. Must be called while
+         * pinned, or while holding the stripe lock (which never fails).
+         */
+        bool copy_bucket(stripe& stripe_, std::size_t home, std::size_t level_mask, std::size_t split_index,
+                         std::vector<std::pair<KEY_TYPE, T>>& entries) {
+            entries.clear();
+            auto current_mask = stripe_.level_mask.load(std::memory_order_relaxed);
+            auto current_split = stripe_.split_index.load(std::memory_order_relaxed);
+            auto table = stripe_.buckets.load(std::memory_order_acquire);
+            auto bucket_count = current_mask + 1 + current_split;
+            if (bucket_count > table->capacity) return false;
+
+            auto stride = (home < split_index ? (level_mask << 1) | 1 : level_mask) + 1;
+            for (auto index = home; index < bucket_count; index += stride) {
+                if (!copy_home(table->roots[index].load(std::memory_order_acquire), home, level_mask, split_index,
+                               entries)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /**
+         * Calls function(key, value) on every entry of the stripe. Each bucket (of the layout the stripe had when the
+         * visit started) is copied out as a consistent snapshot, without locking unless writers keep interfering,
+         * and the function runs on the copy with no lock held.
+         */
+        template<typename FUNCTION>
+        void visit(stripe& stripe_, FUNCTION& function) {
+            std::size_t level_mask = 0;
+            std::size_t split_index = 0;
+            std::vector<std::pair<KEY_TYPE, T>> entries;
+            for (std::size_t home = 0; home < level_mask + 1 + split_index; ++home) {
+                bool copied = false;
+                {
+                    reclaim::epoch_guard guard; // Nodes being copied can't be freed meanwhile
+                    for (unsigned int attempt = 0; attempt < OPTIMISTIC_READ_ATTEMPTS && !copied; ++attempt) {
+                        auto sequence = stripe_.sequence.load(std::memory_order_acquire);
+                        if (!(sequence & 1)) {
+                            if (home == 0) {
+                                level_mask = stripe_.level_mask.load(std::memory_order_relaxed);
+                                split_index = stripe_.split_index.load(std::memory_order_relaxed);
+                            }
+                            copied = copy_bucket(stripe_, home, level_mask, split_index, entries);
+                            std::atomic_thread_fence(std::memory_order_acquire);
+                            copied = copied && stripe_.sequence.load(std::memory_order_relaxed) == sequence;
+                        }
+                        if (!copied) std::this_thread::yield();
+                    }
+                }
+                if (!copied) {
+                    // Writers are too busy with this stripe, briefly hold them off instead
+                    std::lock_guard<std::mutex> lock(stripe_.locks.lock(stripe_.mutex), std::adopt_lock);
+                    if (home == 0) {
+                        level_mask = stripe_.level_mask.load(std::memory_order_relaxed);
+                        split_index = stripe_.split_index.load(std::memory_order_relaxed);
+                    }
+                    copy_bucket(stripe_, home, level_mask, split_index, entries);
+                }
+
+                for (auto const& entry : entries) {
+                    function(entry.first, entry.second);
+                }
+            }
+        }
+
+        /**
+         * Builds a balanced tree out of the (detached) tree nodes in [first, last), which are sorted by hash.
+         */
+        node* build_tree(node* const* first, node* const* last) {
+            if (first == last) return nullptr;
+
+            auto middle = first + (last - first) / 2;
+            auto base_node = *middle;
+            base_node->lesser(build_tree(first, middle));
+            base_node->greater(build_tree(middle + 1, last));
+            fix_height(base_node);
+            return base_node;
+        }
+
+        /**
+         * An entry of a bulk insert, with its hash.
+         */
+        template<typename ITERATOR>
+        struct bulk_entry {
+            std::size_t hash;
+            ITERATOR position;
+        };
+
+        /**
+         * Inserts the entries of one stripe, holding its write lock throughout. The stripe first splits as many
+         * buckets as the entries will need, so that a bucket is only ever touched once. Empty buckets get a balanced
+         * tree built from their sorted entries, the others get their entries inserted one by one.
+         */
+        template<typename ITERATOR>
+        void bulk_insert_stripe(stripe& stripe_, bulk_entry<ITERATOR>* first, bulk_entry<ITERATOR>* last) {
+            if (first == last) return;
+
+            write_lock lock(stripe_);
+            auto count = static_cast<std::size_t>(last - first);
+            while (stripe_.entry_count.load() + count > stripe_.bucket_count * MAXIMUM_LOAD_FACTOR) {
+                split_bucket(stripe_);
+            }
+
+            // By bucket and then by hash, keeping equal keys in input order so that the last one wins
+            std::stable_sort(first, last, [this, &stripe_](bulk_entry<ITERATOR> const& left,
+                                                           bulk_entry<ITERATOR> const& right) {
+                auto left_index = bucket_index(stripe_, left.hash);
+                auto right_index = bucket_index(stripe_, right.hash);
+                return left_index < right_index || (left_index == right_index && left.hash < right.hash);
+            });
+
+            std::vector<node*> tree_nodes;
+            while (first != last) {
+                auto index = bucket_index(stripe_, first->hash);
+                auto bucket_end = first;
+                while (bucket_end != last && bucket_index(stripe_, bucket_end->hash) == index) {
+                    ++bucket_end;
+                }
+
+                auto& root = stripe_.root(index);
+                if (root.load(std::memory_order_relaxed)) {
+                    for (; first != bucket_end; ++first) {
+                        auto new_node = create_node(stripe_, (*first->position).first, first->hash,
+                                                    (*first->position).second);
+                        auto overwrite = make_visitor([new_node]() { return new_node; },
+                                                      [new_node](node*) { return new_node; });
+                        int size_change = 0;
+                        root.store(upsert(root.load(std::memory_order_relaxed), new_node->key, first->hash, overwrite,
+                                          size_change), std::memory_order_release);
+                        stripe_.entry_count.add(static_cast<std::size_t>(size_change)); // Overwrites never erase
+                    }
+                    continue;
+                }
+
+                tree_nodes.clear();
+                try {
+                    for (; first != bucket_end; ++first) {
+                        auto new_node = create_node(stripe_, (*first->position).first, first->hash,
+                                                    (*first->position).second);
+                        auto tree_node = tree_nodes.empty() ? nullptr : tree_nodes.back();
+                        if (!tree_node || tree_node->hash_value != first->hash) {
+                            tree_nodes.push_back(new_node);
+                            stripe_.entry_count.add(1);
+                            continue;
+                        }
+
+                        // Same hash as the tree node before it, find out whether it is the same key too
+                        auto previous_node = static_cast<node*>(nullptr);
+                        auto current_node = tree_node;
+                        while (current_node && !key_equal(current_node->key, new_node->key)) {
+                            previous_node = current_node;
+                            current_node = current_node->collision();
+                        }
+                        if (!current_node) {
+                            previous_node->collision(new_node);
+                            stripe_.entry_count.add(1);
+                        } else {
+                            // A later value for the key, nobody can see the earlier node yet
+                            new_node->collision(current_node->collision());
+                            if (previous_node) {
+                                previous_node->collision(new_node);
+                            } else {
+                                tree_nodes.back() = new_node;
+                            }
+                            destroy_node(current_node);
+                        }
+                    }
+                } catch (...) {
+                    // Nothing of this bucket is linked in yet
+                    for (auto tree_node : tree_nodes) {
+                        while (tree_node) {
+                            auto next_node = tree_node->collision();
+                            destroy_node(tree_node);
+                            stripe_.entry_count.subtract(1);
+                            tree_node = next_node;
+                        }
+                    }
+                    throw;
+                }
+                root.store(build_tree(tree_nodes.data(), tree_nodes.data() + tree_nodes.size()),
+                           std::memory_order_release);
+            }
+        }
+
     public:
-        map() {
-            // Initialize all buckets to empty
-            for (std::size_t index = 0; index < BUCKET_SIZE; ++index) {
-                buckets[index] = nullptr;
+        map()
+            : map(detail::hardware_threads() * STRIPES_PER_CORE) {
+        }
+
+        /**
+         * Constructs a map with (at least) the provided amount of lock stripes, rounded up to a power of two. A good
+         * value is a small multiple of the amount of threads expected to access the map concurrently.
+         */
+        explicit map(std::size_t stripe_count, HASH const& hash = HASH(), KEY_EQUAL const& equal = KEY_EQUAL())
+            : hash_function(hash)
+            , key_equal(equal)
+            , stripe_mask(0)
+            , stripe_shift(0) {
+            while ((stripe_mask + 1) < stripe_count) {
+                stripe_mask = (stripe_mask << 1) | 1;
+                ++stripe_shift;
+            }
+            stripes.reset(new stripe[stripe_mask + 1]);
+            for (std::size_t index = 0; index <= stripe_mask; ++index) {
+                stripes[index].place(PLACEMENT::node_of(index, stripe_mask + 1));
             }
         }
 
         ~map() {
             // Clean up all nodes in the buckets
-            for (std::size_t index = 0; index < BUCKET_SIZE; ++index) {
-                delete delete_children(buckets[index]);
+            for (std::size_t index = 0; index <= stripe_mask; ++index) {
+                auto& stripe_ = stripes[index];
+                for (std::size_t bucket = 0; bucket < stripe_.bucket_count; ++bucket) {
+                    destroy_node(delete_children(stripe_.root(bucket).load(std::memory_order_relaxed)));
+                }
             }
         }
 
+        // Disallow copying a map
+        map(const map &other) = delete;
+        map &operator=(const map &other) = delete;
+
         /**
          * Inserts value into map.
          */
         void insert(KEY_TYPE key, T value) {
-            auto hash = hash_function(key);
-            auto bucket_to_add = hash % BUCKET_SIZE;
-            std::lock_guard<std::mutex> lock(bucket_mutexes[bucket_to_add]);
+            emplace(std::move(key), std::move(value));
+        }
 
-            // Navigate through bucket to find an open node
-            auto current_node = buckets[bucket_to_add];
-            buckets[bucket_to_add] = insert(current_node, std::move(value), std::move(hash));
+        /**
+         * Inserts a value constructed from args into the map, overwriting the value of an existing key like insert.
+         * The value is constructed right in its node, before the stripe is locked.
+         */
+        template<typename... ARGS>
+        void emplace(KEY_TYPE key, ARGS&&... args) {
+            assign(std::move(key), std::forward<ARGS>(args)...);
         }
 
         /**
-         * Modifies reference to value at corresponding key, returning true if it exists.
+         * Same as insert, but returns true if the key was inserted and false if an existing value was overwritten.
          */
-        bool try_at(KEY_TYPE key, T& value) {
-            auto hash = hash_function(key);
-            auto bucket_to_add = hash % BUCKET_SIZE;
-            std::lock_guard<std::mutex> lock(bucket_mutexes[bucket_to_add]);
+        bool insert_or_assign(KEY_TYPE key, T value) {
+            return assign(std::move(key), std::move(value));
+        }
 
-            // Navigate through bucket to find an open node
-            auto current_node = buckets[bucket_to_add];
-            while (current_node) {
-                if (hash > current_node->hash_value) {
-                    current_node = current_node->greater_key_node;
-                } else if (hash < current_node->hash_value) {
-                    current_node = current_node->lesser_key_node;
-                } else {
-                    value = current_node->value;
-                    return true;
+        /**
+         * Inserts a value constructed from args unless the key is already in the map, returning whether it was
+         * inserted. An existing value is left alone, and nothing is constructed for it.
+         */
+        template<typename... ARGS>
+        bool try_emplace(KEY_TYPE key, ARGS&&... args) {
+            auto hash = detail::mix_hash(hash_function(key));
+            auto& stripe_ = stripe_for(hash);
+            return modify(stripe_, key, hash, make_visitor(
+                    [&]() { return create_node(stripe_, std::move(key), hash, std::forward<ARGS>(args)...); },
+                    [](node* existing) { return existing; })) > 0;
+        }
+
+        /**
+         * Calls function(T& value) on the key's value if the key is in the map, returning whether it was. The function
+         * runs while holding the stripe lock, so it should be short. Lock-free readers see either the old or the new
+         * value: an arithmetic value is changed in place, any other is changed on a copy that then replaces the node,
+         * so (like try_at) update and compute need a copyable T.
+         */
+        template<typename FUNCTION>
+        bool update(KEY_TYPE const& key, FUNCTION function) {
+            auto hash = detail::mix_hash(hash_function(key));
+            auto& stripe_ = stripe_for(hash);
+            bool found = false;
+            auto change = [&](T& value) {
+                function(value);
+                return true;
+            };
+            modify(stripe_, key, hash, make_visitor(&no_node, [&](node* existing) {
+                found = true;
+                return change_value(stripe_, existing, change, std::integral_constant<bool, atomic_values>());
+            }));
+            return found;
+        }
+
+        /**
+         * Calls function(T& value, bool found) on the key's value, or on a value initialized T if the key isn't in the
+         * map. If the function returns true the value it leaves is stored under the key (inserting the key if it is
+         * new), and if it returns false the key is erased (or not inserted). Returns whether the key is in the map
+         * afterwards.
+         */
+        template<typename FUNCTION>
+        bool compute(KEY_TYPE key, FUNCTION function) {
+            auto hash = detail::mix_hash(hash_function(key));
+            auto& stripe_ = stripe_for(hash);
+            bool present = false;
+            auto change = [&](T& value) {
+                return function(value, true);
+            };
+            modify(stripe_, key, hash, make_visitor(
+                    [&]() -> node* {
+                        T value = T();
+                        if (!function(value, false)) return nullptr;
+
+                        present = true;
+                        return create_node(stripe_, std::move(key), hash, std::move(value));
+                    },
+                    [&](node* existing) {
+                        auto new_node = change_value(stripe_, existing, change,
+                                                     std::integral_constant<bool, atomic_values>());
+                        present = new_node != nullptr;
+                        return new_node;
+                    }));
+            return present;
+        }
+
+        /**
+         * Erases the key if predicate(T const& value) returns true for its value, returning whether it was erased.
+         */
+        template<typename PREDICATE>
+        bool erase_if(KEY_TYPE const& key, PREDICATE predicate) {
+            auto hash = detail::mix_hash(hash_function(key));
+            return modify(stripe_for(hash), key, hash, make_visitor(&no_node, [&](node* existing) {
+                T const& value = existing->value;
+                return predicate(value) ? nullptr : existing;
+            })) < 0;
+        }
+
+        /**
+         * Adds delta to the key's value, inserting the key with a value of delta if it is new, and returns the value
+         * from before (0 for a new key). Only available for arithmetic values of up to 64 bits, other than bool.
+         *
+         * While no writer is busy with the key's stripe, an existing key is found without a lock (like try_at) and its
+         * value changed in place with an atomic read-modify-write, so threads adding to the same stripe don't wait on
+         * each other. Writers wait for the adders that are already on their way before changing the stripe.
+         */
+        template<typename U = T, typename = typename std::enable_if<
+                map<KEY_TYPE, U, HASH, KEY_EQUAL, PLACEMENT>::atomic_values && !std::is_same<U, bool>::value>::type>
+        T fetch_add(KEY_TYPE key, T delta) {
+            auto hash = detail::mix_hash(hash_function(key));
+            auto& stripe_ = stripe_for(hash);
+            T previous = T();
+            if (try_add_in_place(stripe_, key, hash, delta, previous)) return previous;
+
+            modify(stripe_, key, hash, make_visitor(
+                    [&]() { return create_node(stripe_, std::move(key), hash, delta); },
+                    [&](node* existing) {
+                        previous = add(existing->value, delta, std::is_integral<T>());
+                        return existing;
+                    }));
+            return previous;
+        }
+
+        /**
+         * Inserts every entry of the forward iterator range [first, last), whose elements have the key as first and the
+         * value as second (like std::pair<KEY_TYPE, T>), overwriting the values of existing keys like insert. A key
+         * appearing more than once ends up with its last value. Pass std::make_move_iterator to move the keys and
+         * values.
+         *
+         * The entries are hashed and grouped by stripe up front, and then up to thread_count threads (the calling
+         * thread being one of them) each insert the entries of one stripe at a time, growing the stripe once and
+         * building the tree of each empty bucket directly from its sorted entries. A stripe is locked while its
+         * entries go in, so its readers and writers wait for it. Other than that the map may be used as usual
+         * meanwhile.
+         */
+        template<typename ITERATOR>
+        void bulk_insert(ITERATOR first, ITERATOR last, std::size_t thread_count = detail::hardware_threads()) {
+            static_assert(std::is_base_of<std::forward_iterator_tag,
+                                          typename std::iterator_traits<ITERATOR>::iterator_category>::value,
+                          "bulk_insert goes over the range more than once, so it needs forward iterators");
+
+            std::vector<bulk_entry<ITERATOR>> entries;
+            entries.reserve(static_cast<std::size_t>(std::distance(first, last)));
+            for (; first != last; ++first) {
+                entries.push_back(bulk_entry<ITERATOR>{0, first});
+            }
+
+            // Hash in parallel, in chunks large enough to be worth a thread
+            std::size_t const chunk_size = 4096;
+            detail::parallel_for((entries.size() + chunk_size - 1) / chunk_size, thread_count, [&](std::size_t chunk) {
+                auto chunk_end = std::min(entries.size(), (chunk + 1) * chunk_size);
+                for (auto index = chunk * chunk_size; index < chunk_end; ++index) {
+                    entries[index].hash = detail::mix_hash(hash_function((*entries[index].position).first));
                 }
+            });
+
+            // Group by stripe with a counting sort
+            std::vector<std::size_t> stripe_begin(stripe_mask + 2, 0);
+            for (auto const& entry : entries) {
+                ++stripe_begin[(entry.hash & stripe_mask) + 1];
+            }
+            for (std::size_t index = 1; index < stripe_begin.size(); ++index) {
+                stripe_begin[index] += stripe_begin[index - 1];
             }
+            std::vector<bulk_entry<ITERATOR>> grouped(entries.size(), bulk_entry<ITERATOR>{0, last});
+            {
+                auto next = stripe_begin;
+                for (auto const& entry : entries) {
+                    grouped[next[entry.hash & stripe_mask]++] = entry;
+                }
+            }
+            entries.clear();
+            entries.shrink_to_fit();
 
-            return false;
+            detail::parallel_for(stripe_mask + 1, thread_count, [&](std::size_t index) {
+                bulk_insert_stripe(stripes[index], grouped.data() + stripe_begin[index],
+                                   grouped.data() + stripe_begin[index + 1]);
+            });
+        }
+
+        /**
+         * Calls function(KEY_TYPE const& key, T const& value) on every entry, on copies taken one bucket at a time
+         * (T must be copyable, as for try_at). Writers are not held up: each bucket is copied optimistically like
+         * try_at reads, and only if writers keep interfering is the stripe locked for as long as the copy takes.
+         *
+         * The visit is weakly consistent. Each bucket is a snapshot of some moment during the visit, so every key that
+         * is in the map throughout is visited exactly once, while keys inserted or erased meanwhile may or may not be.
+         * The function runs with no lock held, so it may use the map itself.
+         */
+        template<typename FUNCTION>
+        void for_each(FUNCTION function) {
+            for (std::size_t index = 0; index <= stripe_mask; ++index) {
+                visit(stripes[index], function);
+            }
+        }
+
+        /**
+         * for_each spread over up to thread_count threads (the calling thread being one of them), each visiting one
+         * stripe at a time, so the function must be safe to call concurrently. If it throws, the threads stop taking
+         * stripes and the first exception is rethrown once they are done.
+         */
+        template<typename FUNCTION>
+        void parallel_for_each(FUNCTION function, std::size_t thread_count = detail::hardware_threads()) {
+            detail::parallel_for(stripe_mask + 1, thread_count, [&](std::size_t index) {
+                visit(stripes[index], function);
+            });
+        }
+
+        /**
+         * Modifies reference to value at corresponding key, returning true if it exists. Takes no lock unless writers
+         * keep interfering with the lookup.
+         */
+        bool try_at(KEY_TYPE key, T& value) {
+            return find(key, value);
+        }
+
+        /**
+         * Heterogeneous version of try_at, available when HASH and KEY_EQUAL are transparent.
+         */
+        template<typename LOOKUP_TYPE, typename H = HASH, typename E = KEY_EQUAL,
+                 typename = typename H::is_transparent, typename = typename E::is_transparent>
+        bool try_at(LOOKUP_TYPE const& key, T& value) {
+            return find(key, value);
         }
 
         /**
          * If map has entry with provided key, deletes entry and returns true.
          */
         bool try_erase(KEY_TYPE key) {
-            auto hash = hash_function(key);
-            auto bucket_to_add = hash % BUCKET_SIZE;
-            std::lock_guard<std::mutex> lock(bucket_mutexes[bucket_to_add]);
+            return erase(key);
+        }
 
-            bool result = false;
-            buckets[bucket_to_add] = remove(buckets[bucket_to_add], std::move(hash), result);
+        /**
+         * Heterogeneous version of try_erase, available when HASH and KEY_EQUAL are transparent.
+         */
+        template<typename LOOKUP_TYPE, typename H = HASH, typename E = KEY_EQUAL,
+                 typename = typename H::is_transparent, typename = typename E::is_transparent>
+        bool try_erase(LOOKUP_TYPE const& key) {
+            return erase(key);
+        }
 
-            return result;
+        /**
+         * Returns how many entries the map holds, adding up the count every stripe's writers keep. No lock is taken,
+         * so entries inserted or erased while the stripes are read may or may not be counted.
+         */
+        std::size_t size_approx() const {
+            std::size_t entries = 0;
+            for (std::size_t index = 0; index <= stripe_mask; ++index) {
+                entries += stripes[index].entry_count.load();
+            }
+            return entries;
+        }
+
+        /**
+         * Returns whether the map holds no entries, stopping at the first stripe that has some. Like size_approx, it
+         * takes no lock.
+         */
+        bool empty() const {
+            for (std::size_t index = 0; index <= stripe_mask; ++index) {
+                if (stripes[index].entry_count.load()) return false;
+            }
+            return true;
         }
+
+#ifdef CCL_ENABLE_STATS
+        /**
+         * Returns the statistics gathered so far, added up over all threads, along with the current height of every
+         * bucket's tree. Each stripe is locked in turn while its trees are measured. Only available when compiled
+         * with CCL_ENABLE_STATS.
+         */
+        map_stats stats() {
+            auto snapshot = detail::collect<map_stats>(statistics);
+            snapshot.stripes.resize(stripe_mask + 1);
+            for (std::size_t index = 0; index <= stripe_mask; ++index) {
+                auto& stripe_ = stripes[index];
+                stripe_.locks.add_to(snapshot.stripes[index]);
+                stripe_.locks.add_to(snapshot.locks);
+
+                std::lock_guard<std::mutex> lock(stripe_.mutex);
+                for (std::size_t bucket = 0; bucket < stripe_.bucket_count; ++bucket) {
+                    snapshot.bucket_heights.record(height(stripe_.root(bucket).load(std::memory_order_relaxed)));
+                }
+            }
+            return snapshot;
+        }
+#endif
     };
+
+    /**
+     * ccl::map whose lock stripes are split evenly between the NUMA nodes, each stripe keeping its buckets and nodes
+     * in the memory of the node that owns it. On a machine with several sockets this spreads a large map's memory
+     * (and the memory bandwidth spent on it) over all of the sockets, instead of leaving it on the node of the thread
+     * that happened to touch it first. Lookups still go to whichever node owns the key's stripe.
+     */
+    template<typename KEY_TYPE, typename T, typename HASH = std::hash<KEY_TYPE>,
+             typename KEY_EQUAL = std::equal_to<KEY_TYPE>>
+    using numa_map = map<KEY_TYPE, T, HASH, KEY_EQUAL, numa_placement>;
 }
 
 #endif //CCL_MAP_HPP
@@ -0,0 +1,150 @@
+//
+// Lock-free queue for any number of producer threads and a single consumer thread.
+//  - Based on D. Vyukov's intrusive MPSC node-based queue
+//    (http://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue).
+//
+
+#ifndef CCL_MPSC_QUEUE_HPP
+#define CCL_MPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+#include "detail.hpp"
+
+namespace ccl {
+    /**
+     * Queue (FIFO) for a channel with many producers and a single consumer. Any thread may push, but only one thread
+     * may pop at any time. A push is a single exchange on the tail plus a release store linking the node in, and a
+     * pop an acquire load of the next node, so producers never wait on each other or on a combiner and the consumer
+     * never writes to anything the producers read.
+     *
+     * The consumer keeps a stub node in front of the values, which is the node it popped last. Each push allocates a
+     * node through the allocator, which the consumer frees once it has popped the value after it.
+     *
+     * NOTE: A producer that is preempted in between swapping itself in as the tail and linking the previous tail to
+     * its node hides its value, and every value pushed after it, until it resumes. try_pop may therefore return false
+     * even though the pushes of other threads have already returned; it never loses their values, nor pops them out
+     * of order.
+     */
+    template<typename T, typename ALLOCATOR = std::allocator<T>>
+    class mpsc_queue {
+    private:
+        struct node {
+            std::atomic<node*> next;
+            detail::value_slot<T> value; // Holds a value unless it is the stub
+
+            node()
+                : next(nullptr) {
+            }
+        };
+
+        using allocator_type = typename std::allocator_traits<ALLOCATOR>::template rebind_alloc<node>;
+        using allocator_traits = std::allocator_traits<allocator_type>;
+
+        allocator_type allocator;
+
+        alignas(CACHE_LINE_SIZE) std::atomic<node*> tail; // Last node pushed, swapped by the producers
+
+        alignas(CACHE_LINE_SIZE) node* head; // Only accessed by the consumer, the stub in front of the next value
+
+        node* create_node() {
+            auto new_node = allocator_traits::allocate(allocator, 1);
+            allocator_traits::construct(allocator, new_node);
+            return new_node;
+        }
+
+        void destroy_node(node* old_node) {
+            allocator_traits::destroy(allocator, old_node);
+            allocator_traits::deallocate(allocator, old_node, 1);
+        }
+
+    public:
+        explicit mpsc_queue(ALLOCATOR const& allocator_ = ALLOCATOR())
+            : allocator(allocator_)
+            , tail(nullptr)
+            , head(nullptr) {
+            head = create_node();
+            tail.store(head);
+        }
+
+        /**
+         * Destroys the values left in the queue. No thread may be using the queue anymore.
+         */
+        ~mpsc_queue() {
+            while (auto next = head->next.load()) {
+                next->value.destroy();
+                destroy_node(head);
+                head = next;
+            }
+            destroy_node(head);
+        }
+
+        // Keep the producer and consumer fields on their own cache lines when the queue is allocated with new
+        static void* operator new(std::size_t size) {
+            return detail::allocate_aligned(size, alignof(mpsc_queue));
+        }
+
+        static void operator delete(void* pointer) {
+            detail::free_aligned(pointer);
+        }
+
+        // Disallow copying a queue
+        mpsc_queue(const mpsc_queue &other) = delete;
+        mpsc_queue &operator=(const mpsc_queue &other) = delete;
+
+        /**
+         * Pushes a value constructed from the provided arguments.
+         */
+        template<typename... ARGS>
+        void emplace(ARGS&&... args) {
+            auto new_node = create_node();
+            try {
+                new_node->value.emplace(std::forward<ARGS>(args)...);
+            } catch (...) {
+                destroy_node(new_node);
+                throw;
+            }
+
+            // The exchange orders producers among themselves, the release store hands the value to the consumer
+            auto previous = tail.exchange(new_node, std::memory_order_acq_rel);
+            previous->next.store(new_node, std::memory_order_release);
+        }
+
+        void push(T const& new_value) {
+            emplace(new_value);
+        }
+
+        void push(T&& new_value) {
+            emplace(std::move(new_value));
+        }
+
+        /**
+         * Returns true if the reference variable given is set to the value at the front of the queue (assuming the
+         * queue is not empty). Only the consumer thread may call this.
+         */
+        bool try_pop(T& return_value) {
+            auto next = head->next.load(std::memory_order_acquire);
+            if (!next) return false;
+
+            // The popped node becomes the new stub, so only the value is destroyed now
+            return_value = std::move(next->value.get());
+            next->value.destroy();
+            destroy_node(head);
+            head = next;
+            return true;
+        }
+
+        /**
+         * Only meaningful on the consumer thread, and even there a value that is being pushed may be missed (see the
+         * note on the class).
+         */
+        bool empty() const {
+            return !head->next.load(std::memory_order_acquire);
+        }
+    };
+}
+
+#endif //CCL_MPSC_QUEUE_HPP
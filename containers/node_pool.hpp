@@ -0,0 +1,109 @@
+//
+// Recycles the nodes of a container instead of returning them to the allocator.
+//
+
+#ifndef CCL_NODE_POOL_HPP
+#define CCL_NODE_POOL_HPP
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace ccl {
+    std::size_t const MAXIMUM_FREE_NODES = 1024; // Freed nodes a container keeps around to be reused
+
+    /**
+     * Hands out nodes allocated with the provided allocator, keeping freed ones on a free list so that the next
+     * allocation doesn't need to go through the allocator at all.
+     *
+     * NOTE: This is not thread-safe. The flat combining containers only use it from inside a combining pass, where the
+     * combiner lock already guarantees exclusive access.
+     */
+    template<typename NODE, typename ALLOCATOR>
+    class node_pool {
+    private:
+        using allocator_type = typename std::allocator_traits<ALLOCATOR>::template rebind_alloc<NODE>;
+        using allocator_traits = std::allocator_traits<allocator_type>;
+
+        /**
+         * What a freed node's memory holds while it waits on the free list.
+         */
+        struct free_node {
+            free_node* next;
+        };
+
+        static_assert(sizeof(NODE) >= sizeof(free_node) && alignof(NODE) >= alignof(free_node),
+                      "Nodes must be able to hold a free list pointer");
+
+        allocator_type allocator;
+        free_node* free_nodes;
+        std::size_t free_node_count;
+
+        /**
+         * Keeps the memory of a node that holds no value for a later create(), unless the free list is already full.
+         */
+        void recycle(NODE* old_node) {
+            if (free_node_count < MAXIMUM_FREE_NODES) {
+                auto freed = ::new (static_cast<void*>(old_node)) free_node;
+                freed->next = free_nodes;
+                free_nodes = freed;
+                ++free_node_count;
+            } else {
+                allocator_traits::deallocate(allocator, old_node, 1);
+            }
+        }
+
+    public:
+        explicit node_pool(ALLOCATOR const& allocator_ = ALLOCATOR())
+            : allocator(allocator_)
+            , free_nodes(nullptr)
+            , free_node_count(0) {
+        }
+
+        ~node_pool() {
+            while (free_nodes) {
+                auto old_node = free_nodes;
+                free_nodes = free_nodes->next;
+                allocator_traits::deallocate(allocator, reinterpret_cast<NODE*>(old_node), 1);
+            }
+        }
+
+        node_pool(const node_pool &other) = delete;
+        node_pool &operator=(const node_pool &other) = delete;
+
+        /**
+         * Constructs a node with the provided arguments, reusing a freed node if there is one. If the constructor
+         * throws, the node goes back to the free list.
+         */
+        template<typename... ARGS>
+        NODE* create(ARGS&&... args) {
+            NODE* new_node;
+            if (free_nodes) {
+                new_node = reinterpret_cast<NODE*>(free_nodes);
+                free_nodes = free_nodes->next;
+                --free_node_count;
+            } else {
+                new_node = allocator_traits::allocate(allocator, 1);
+            }
+
+            try {
+                allocator_traits::construct(allocator, new_node, std::forward<ARGS>(args)...);
+            } catch (...) {
+                recycle(new_node);
+                throw;
+            }
+            return new_node;
+        }
+
+        /**
+         * Destroys the node, keeping its memory for a later create() unless the free list is already full.
+         */
+        void destroy(NODE* old_node) {
+            allocator_traits::destroy(allocator, old_node);
+            recycle(old_node);
+        }
+    };
+}
+
+#endif //CCL_NODE_POOL_HPP
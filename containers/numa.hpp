@@ -0,0 +1,323 @@
+//
+// NUMA topology of the machine, and memory placed on a chosen NUMA node.
+//
+
+#ifndef CCL_NUMA_HPP
+#define CCL_NUMA_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "detail.hpp"
+
+namespace ccl {
+    std::size_t const NUMA_CHUNK_SIZE = std::size_t(1) << 18; // Memory a node heap maps at once, which is also the
+                                                              // alignment of every mapping
+    std::size_t const NUMA_SMALLEST_BLOCK = 16; // Smallest block a node heap hands out
+    std::size_t const NUMA_LARGEST_BLOCK = std::size_t(1) << 14; // Larger allocations get a mapping of their own
+    std::size_t const NUMA_HEAP_SHARDS = 8; // Free lists each node heap keeps per block size, spread over the threads
+
+    /**
+     * The NUMA nodes of the machine, and memory placed on one of them. On a multi-socket machine each socket (or part
+     * of one) is a node with memory of its own, which its cores reach faster than the memory of the other nodes.
+     *
+     * Only Linux is supported: the nodes are read from sysfs, and memory is placed by binding it to a node with the
+     * mbind system call, without linking to libnuma. Everywhere else (and on a Linux kernel without NUMA support)
+     * the machine has a single node and memory is allocated as usual.
+     */
+    namespace numa {
+        namespace detail {
+            /**
+             * Returns the largest number in a sysfs list like "0-3,8,10-11", or -1 for an empty list.
+             */
+            inline long last_in_list(std::string const& list) {
+                long last = -1;
+                long number = -1;
+                for (auto character : list) {
+                    if (character >= '0' && character <= '9') {
+                        number = (number < 0 ? 0 : number * 10) + (character - '0');
+                    } else {
+                        last = std::max(last, number);
+                        number = -1;
+                    }
+                }
+                return std::max(last, number);
+            }
+
+            inline std::size_t read_node_count() {
+#if defined(__linux__)
+                std::ifstream online("/sys/devices/system/node/online");
+                std::string list;
+                if (std::getline(online, list)) {
+                    auto last = last_in_list(list);
+                    if (last >= 0) return static_cast<std::size_t>(last) + 1;
+                }
+#endif
+                return 1;
+            }
+        }
+
+        /**
+         * Returns the amount of NUMA nodes, at least 1.
+         */
+        inline std::size_t node_count() {
+            static std::size_t const count = detail::read_node_count();
+            return count;
+        }
+
+        /**
+         * Returns the node the calling thread is running on. The scheduler may move the thread to another node at any
+         * time (unless it is pinned there), so this is only a hint for placing the thread's data.
+         */
+        inline std::size_t current_node() {
+#if defined(__linux__) && defined(SYS_getcpu)
+            unsigned int cpu = 0;
+            unsigned int node = 0;
+            if (::syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+                return node % node_count();
+            }
+#endif
+            return 0;
+        }
+
+        namespace detail {
+            /**
+             * Start of every mapping of a node heap, found by rounding any address in the mapping down to the chunk
+             * size.
+             */
+            struct chunk_header {
+                std::size_t node;
+                std::size_t block_size; // Of every block in the chunk, 0 if the mapping holds a single large allocation
+                std::size_t mapping_size;
+            };
+
+            std::size_t const LARGE_OFFSET = 4096; // Of a large allocation from the start of its mapping, keeping it
+                                                   // page aligned
+
+            /**
+             * Maps size bytes (a multiple of the page size) at an address aligned to NUMA_CHUNK_SIZE, preferably on the
+             * given node. Pages are only allocated when they are first touched, wherever the toucher runs, but the
+             * kernel then takes them from the preferred node while it has memory left.
+             */
+            inline void* map_memory(std::size_t size, std::size_t node) {
+#if defined(__linux__)
+                auto length = size + NUMA_CHUNK_SIZE;
+                auto memory = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (memory == MAP_FAILED) throw std::bad_alloc();
+
+                // Trim the mapping down to the aligned part
+                auto start = reinterpret_cast<std::uintptr_t>(memory);
+                auto aligned = (start + NUMA_CHUNK_SIZE - 1) & ~(NUMA_CHUNK_SIZE - 1);
+                if (aligned != start) {
+                    ::munmap(memory, aligned - start);
+                }
+                if (aligned + size != start + length) {
+                    ::munmap(reinterpret_cast<void*>(aligned + size), start + length - aligned - size);
+                }
+
+                // MPOL_PREFERRED, which falls back to the other nodes instead of failing. Without NUMA support in
+                // the kernel (or permission to use it) the pages simply come from wherever they are touched first.
+                int const preferred_policy = 1;
+                std::size_t const bits = sizeof(unsigned long) * 8;
+                std::vector<unsigned long> mask(node / bits + 1);
+                mask[node / bits] |= 1UL << (node % bits);
+                ::syscall(SYS_mbind, aligned, size, preferred_policy, mask.data(), mask.size() * bits + 1, 0);
+                return reinterpret_cast<void*>(aligned);
+#else
+                (void) node;
+                return ccl::detail::allocate_aligned(size, NUMA_CHUNK_SIZE);
+#endif
+            }
+
+            inline void unmap_memory(void* memory, std::size_t size) {
+#if defined(__linux__)
+                ::munmap(memory, size);
+#else
+                (void) size;
+                ccl::detail::free_aligned(memory);
+#endif
+            }
+
+            /**
+             * Free blocks of one size on one node, for the threads whose seed picks this shard.
+             */
+            struct alignas(CACHE_LINE_SIZE) heap_shard : ccl::detail::cache_aligned_allocation {
+                std::mutex mutex;
+                void* free_blocks; // Linked through the first word of each block
+                char* next_block; // Never handed out yet, in the chunk the shard carves from
+                char* chunk_end;
+
+                heap_shard()
+                    : free_blocks(nullptr)
+                    , next_block(nullptr)
+                    , chunk_end(nullptr) {
+                }
+            };
+
+            std::size_t const BLOCK_SIZES = 11; // Powers of two from NUMA_SMALLEST_BLOCK to NUMA_LARGEST_BLOCK
+
+            /**
+             * Hands out blocks placed on a single node. Blocks are carved from chunks, each chunk holding blocks of a
+             * single power of two size, which are aligned to that size. A freed block goes back onto a free list of
+             * its node and size, and chunks are never unmapped once they have been carved, so the memory of a node
+             * heap only ever grows to the most it held at once.
+             */
+            class node_heap {
+            private:
+                std::size_t const node;
+                std::unique_ptr<heap_shard[]> shards; // NUMA_HEAP_SHARDS per block size
+
+                heap_shard& shard(std::size_t size_index) {
+                    return shards[size_index * NUMA_HEAP_SHARDS +
+                                  ccl::detail::scale_seed(ccl::detail::thread_seed(), NUMA_HEAP_SHARDS)];
+                }
+
+            public:
+                explicit node_heap(std::size_t node_)
+                    : node(node_)
+                    , shards(new heap_shard[BLOCK_SIZES * NUMA_HEAP_SHARDS]) {
+                }
+
+                void* allocate(std::size_t size_index) {
+                    auto& shard_ = shard(size_index);
+                    std::lock_guard<std::mutex> lock(shard_.mutex);
+                    if (auto block = shard_.free_blocks) {
+                        shard_.free_blocks = *static_cast<void**>(block);
+                        return block;
+                    }
+
+                    auto block_size = NUMA_SMALLEST_BLOCK << size_index;
+                    if (shard_.next_block == shard_.chunk_end) {
+                        auto chunk = static_cast<char*>(map_memory(NUMA_CHUNK_SIZE, node));
+                        ::new (chunk) chunk_header{node, block_size, NUMA_CHUNK_SIZE};
+                        // The blocks start after the header, at the first multiple of their size
+                        shard_.next_block = chunk + (sizeof(chunk_header) + block_size - 1) / block_size * block_size;
+                        shard_.chunk_end = chunk + NUMA_CHUNK_SIZE;
+                    }
+                    auto block = shard_.next_block;
+                    shard_.next_block += block_size;
+                    return block;
+                }
+
+                void deallocate(void* block, std::size_t size_index) {
+                    auto& shard_ = shard(size_index);
+                    std::lock_guard<std::mutex> lock(shard_.mutex);
+                    *static_cast<void**>(block) = shard_.free_blocks;
+                    shard_.free_blocks = block;
+                }
+            };
+
+            /**
+             * Returns the heap of every node. The heaps are never destroyed, since memory they handed out may still be
+             * freed by the destructors of other static objects.
+             */
+            inline std::vector<node_heap*>& heaps() {
+                static auto all_heaps = []() {
+                    auto created = new std::vector<node_heap*>();
+                    for (std::size_t node = 0; node < node_count(); ++node) {
+                        created->push_back(new node_heap(node));
+                    }
+                    return created;
+                }();
+                return *all_heaps;
+            }
+
+            inline chunk_header& header_of(void* pointer) {
+                return *reinterpret_cast<chunk_header*>(reinterpret_cast<std::uintptr_t>(pointer) &
+                                                        ~(NUMA_CHUNK_SIZE - 1));
+            }
+        }
+
+        /**
+         * Allocates size bytes placed on the given node (modulo the amount of nodes), aligned to at least the largest
+         * power of two dividing the size, up to the page size. Freed with deallocate, which needs nothing but the
+         * pointer.
+         */
+        inline void* allocate(std::size_t size, std::size_t node) {
+            node %= node_count();
+            if (size <= NUMA_LARGEST_BLOCK) {
+                std::size_t size_index = 0;
+                while ((NUMA_SMALLEST_BLOCK << size_index) < size) {
+                    ++size_index;
+                }
+                return detail::heaps()[node]->allocate(size_index);
+            }
+
+            auto mapping_size = (size + detail::LARGE_OFFSET + detail::LARGE_OFFSET - 1) & ~(detail::LARGE_OFFSET - 1);
+            auto mapping = static_cast<char*>(detail::map_memory(mapping_size, node));
+            ::new (mapping) detail::chunk_header{node, 0, mapping_size};
+            return mapping + detail::LARGE_OFFSET;
+        }
+
+        inline void deallocate(void* pointer) {
+            if (!pointer) return;
+
+            auto& header = detail::header_of(pointer);
+            if (header.block_size == 0) {
+                detail::unmap_memory(&header, header.mapping_size);
+                return;
+            }
+            std::size_t size_index = 0;
+            while ((NUMA_SMALLEST_BLOCK << size_index) < header.block_size) {
+                ++size_index;
+            }
+            detail::heaps()[header.node]->deallocate(pointer, size_index);
+        }
+    }
+
+    /**
+     * Where a ccl::map puts the memory of its lock stripes. The default keeps it wherever the allocator puts it,
+     * which is on the node of whichever thread first touched it.
+     */
+    struct shared_placement {
+        static std::size_t node_of(std::size_t, std::size_t) {
+            return 0;
+        }
+
+        static void* allocate(std::size_t size, std::size_t) {
+            return ::operator new(size);
+        }
+
+        static void deallocate(void* pointer) {
+            ::operator delete(pointer);
+        }
+    };
+
+    /**
+     * Gives every NUMA node an equal share of a ccl::map's lock stripes, and places the buckets and the nodes of each
+     * stripe on the NUMA node that owns it, so that the memory of a large map is spread over all of the nodes instead
+     * of ending up on one of them.
+     */
+    struct numa_placement {
+        /**
+         * Returns the node owning the stripe with the given index, of stripe_count. Consecutive stripes share a node.
+         */
+        static std::size_t node_of(std::size_t stripe, std::size_t stripe_count) {
+            return stripe * numa::node_count() / stripe_count;
+        }
+
+        static void* allocate(std::size_t size, std::size_t node) {
+            return numa::allocate(size, node);
+        }
+
+        static void deallocate(void* pointer) {
+            numa::deallocate(pointer);
+        }
+    };
+}
+
+#endif //CCL_NUMA_HPP
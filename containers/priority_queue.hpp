@@ -0,0 +1,371 @@
+//
+// Concurrent priority queue, built on flat combining like the stack and queue.
+//
+
+#ifndef CCL_PRIORITY_QUEUE_HPP
+#define CCL_PRIORITY_QUEUE_HPP
+
+#include <algorithm>
+#include <utility>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <chrono>
+#include <vector>
+
+#include "detail.hpp"
+#include "event_count.hpp"
+#include "flat_combiner.hpp"
+#include "stats.hpp"
+#include "storage.hpp"
+
+namespace ccl {
+    /**
+     * Concurrent priority queue. A simplified version of std::priority_queue that allows for concurrent access, where
+     * a pop takes the greatest value by COMPARE (so with std::less, the default, the largest one). Implemented using
+     * flat combining on top of ccl::flat_combiner, outlined here:
+     * http://www.cs.bgu.ac.il/~hendlerd/papers/flat-combining.pdf
+     *
+     * The values are kept in a d-ary heap (sequential::d_ary_heap), which only the combiner touches. Flat combining
+     * suits a heap especially well, since a combining pass sees every pending request at once: the pushes it gathers
+     * are sorted, and each pop takes whichever is greater of the heap's top and the greatest push not taken yet, so a
+     * pushed value that would have ended up on top goes straight from one publication record to the other without
+     * touching the heap (elimination). The pushes left over are then added to the heap as one batch. All requests of
+     * a pass are pending at the same time, so ordering every push before every pop is a valid linearization.
+     */
+    template<typename T, typename COMPARE = std::less<T>, typename ALLOCATOR = std::allocator<T>>
+    class priority_queue {
+    private:
+        using storage_type = sequential::d_ary_heap<T, COMPARE, ALLOCATOR>;
+
+        enum class operation {
+            PUSH,
+            POP,
+            PUSH_BULK,
+            POP_BULK
+        };
+
+        static unsigned int const PUSHED = 1; // Event of a combining pass that added values to the heap
+
+        /**
+         * Gathers the requests of a combining pass, and answers the pops once every push of the pass is known.
+         */
+        struct operations {
+            struct request : combining_request {
+                operation requested;
+                bool succeeded; // Whether a pop got a value
+                detail::value_slot<T> value; // Value to push, or the value popped by the combiner, while there is one
+                std::vector<T>* batch; // Values of a bulk request, owned by the requesting thread
+                std::size_t batch_limit; // Most values a bulk pop may take
+                request* next_pending; // Only used by the combiner, links the pops of a pass in list order
+            };
+
+            COMPARE compare;
+            std::vector<request*> pending_pushes; // Pushes gathered by the current pass, kept to reuse its room
+            request* first_pop;
+            request** last_pop;
+
+            alignas(CACHE_LINE_SIZE) detail::owned_counter size; // Values in the heap, on a line of its own since
+                                                                 // size_approx reads it from any thread
+
+            alignas(CACHE_LINE_SIZE) event_count pushes; // Notified after a combining pass that added values, for
+                                                         // threads blocked in wait_pop
+
+            explicit operations(COMPARE const& compare_)
+                : compare(compare_)
+                , first_pop(nullptr)
+                , last_pop(&first_pop) {
+            }
+
+            /**
+             * Moves the next value to pop into slot, which is the greatest of the heap's top and the first push not
+             * taken yet (pending_pushes being sorted greatest first). Returns false if there is neither.
+             */
+            bool take_greatest(storage_type& storage, std::size_t& next_push, detail::value_slot<T>& slot) {
+                if (next_push < pending_pushes.size() && storage.below(pending_pushes[next_push]->value.get())) {
+                    // Elimination, the pushed value never touches the heap
+                    auto push_request = pending_pushes[next_push++];
+                    slot.emplace(std::move(push_request->value.get()));
+                    push_request->value.destroy();
+
+                    // Answering keeps the pushing thread from reusing its request before the value was moved out of it
+                    push_request->answer();
+                    return true;
+                }
+                if (storage.empty()) return false;
+
+                slot.emplace(std::move(storage.top()));
+                size.subtract(1);
+                try {
+                    storage.pop();
+                } catch (...) {
+                    // The value is already out of the heap, and the request failing with it would never destroy it
+                    slot.destroy();
+                    throw;
+                }
+                return true;
+            }
+
+            unsigned int apply(storage_type& storage, request& pending) {
+                if (pending.requested == operation::PUSH) {
+                    pending_pushes.push_back(&pending);
+                } else if (pending.requested == operation::PUSH_BULK) {
+                    // Bulk pushes go straight into the heap, which is only restored once the pass gathered them all
+                    for (auto& value : *pending.batch) {
+                        storage.emplace_unordered(std::move(value));
+                        size.add(1);
+                    }
+                    pending.answer();
+                    return PUSHED;
+                } else {
+                    pending.next_pending = nullptr;
+                    *last_pop = &pending;
+                    last_pop = &pending.next_pending;
+                }
+                return 0;
+            }
+
+            unsigned int finish_pass(storage_type& storage) {
+                storage.restore();
+                std::size_t next_push = 0;
+                if (first_pop) {
+                    // Sorting the pushes greatest first lets every pop compare just one of them against the heap's top
+                    std::sort(pending_pushes.begin(), pending_pushes.end(), [this](request* left, request* right) {
+                        return compare(right->value.get(), left->value.get());
+                    });
+
+                    for (auto pop_request = first_pop; pop_request; ) {
+                        // Read ahead, since the thread may reuse its request as soon as it is answered
+                        auto next_pop = pop_request->next_pending;
+                        if (pop_request->requested == operation::POP_BULK) {
+                            auto& batch = *pop_request->batch;
+                            detail::value_slot<T> slot;
+                            while (batch.size() < pop_request->batch_limit && take_greatest(storage, next_push, slot)) {
+                                try {
+                                    batch.push_back(std::move(slot.get()));
+                                } catch (...) {
+                                    slot.destroy();
+                                    throw;
+                                }
+                                slot.destroy();
+                            }
+                        } else {
+                            pop_request->succeeded = take_greatest(storage, next_push, pop_request->value);
+                        }
+
+                        // Answering makes sure data is updated before it is signalled
+                        pop_request->answer();
+                        pop_request = next_pop;
+                    }
+                    first_pop = nullptr;
+                    last_pop = &first_pop;
+                }
+
+                // Add whatever was left over to the heap, as one batch
+                unsigned int events = 0;
+                for (; next_push < pending_pushes.size(); ++next_push) {
+                    auto push_request = pending_pushes[next_push];
+                    storage.emplace_unordered(std::move(push_request->value.get()));
+                    push_request->value.destroy();
+                    size.add(1);
+                    push_request->answer();
+                    events = PUSHED;
+                }
+                storage.restore();
+                pending_pushes.clear();
+                return events;
+            }
+
+            /**
+             * The heap may be left unordered, which the next pass restores before taking anything from it.
+             */
+            void abandon_pass() {
+                pending_pushes.clear();
+                first_pop = nullptr;
+                last_pop = &first_pop;
+            }
+
+            void notify(unsigned int events) {
+                if (events & PUSHED) {
+                    pushes.notify_all();
+                }
+            }
+        };
+
+        flat_combiner<storage_type, operations> combiner;
+
+        event_count& pushes() {
+            return combiner.operations().pushes;
+        }
+
+    public:
+        explicit priority_queue(COMPARE const& compare_ = COMPARE(), ALLOCATOR const& allocator = ALLOCATOR())
+            : priority_queue(combining_policy(), compare_, allocator) {
+        }
+
+        /**
+         * Constructs a priority queue whose combiner batches requests according to policy.
+         */
+        explicit priority_queue(combining_policy const& policy_, COMPARE const& compare_ = COMPARE(),
+                                ALLOCATOR const& allocator = ALLOCATOR())
+            : combiner(policy_, std::forward_as_tuple(compare_, allocator), std::forward_as_tuple(compare_)) {
+        }
+
+        // Keep the padding between the field groups intact when the priority queue itself is allocated with new
+        static void* operator new(std::size_t size) {
+            return detail::allocate_aligned(size, alignof(priority_queue));
+        }
+
+        static void operator delete(void* pointer) {
+            detail::free_aligned(pointer);
+        }
+
+        // Disallow copying a priority queue
+        priority_queue(const priority_queue &other) = delete;
+        priority_queue &operator=(const priority_queue &other) = delete;
+
+        /**
+         * Returns true if the reference variable given is set to the greatest value of the priority queue (assuming
+         * it is not empty).
+         */
+        bool try_pop(T& return_value) {
+            auto& pending = combiner.thread_request();
+            pending.requested = operation::POP;
+            combiner.submit(pending);
+
+            if (pending.succeeded) {
+                return_value = std::move(pending.value.get());
+                pending.value.destroy();
+            }
+            return pending.succeeded;
+        }
+
+        /**
+         * Pops the greatest value, blocking until there is one. A blocked thread sleeps until another thread pushes,
+         * so waiting on an empty priority queue costs no CPU time.
+         */
+        void wait_pop(T& return_value) {
+            while (true) {
+                // Registering before trying to pop means that a push landing in between still wakes this thread
+                unsigned int key;
+                if (pushes().prepare_wait(key, [&]() { return try_pop(return_value); })) return;
+                pushes().wait(key);
+            }
+        }
+
+        /**
+         * Same as wait_pop, but gives up once the timeout has passed. Returns false if nothing could be popped in time.
+         */
+        template<typename REP, typename PERIOD>
+        bool wait_pop_for(T& return_value, std::chrono::duration<REP, PERIOD> const& timeout) {
+            auto deadline = std::chrono::steady_clock::now() + timeout;
+            while (true) {
+                unsigned int key;
+                if (pushes().prepare_wait(key, [&]() { return try_pop(return_value); })) return true;
+                if (!pushes().wait_until(key, deadline)) {
+                    // Timed out, but a value may still have been pushed right before then
+                    return try_pop(return_value);
+                }
+            }
+        }
+
+        /**
+         * Pushes a new value into the priority queue.
+         */
+        void push(T const& new_value) {
+            emplace(new_value);
+        }
+
+        void push(T&& new_value) {
+            emplace(std::move(new_value));
+        }
+
+        /**
+         * Pushes a value constructed from args into the priority queue. The value is constructed right in the
+         * thread's publication record, from where the combiner moves it into the heap (or hands it to a pop), so T
+         * doesn't have to be copyable.
+         */
+        template<typename... ARGS>
+        void emplace(ARGS&&... args) {
+            auto& pending = combiner.thread_request();
+            pending.requested = operation::PUSH;
+            pending.value.emplace(std::forward<ARGS>(args)...);
+            try {
+                combiner.submit(pending);
+            } catch (...) {
+                // A push that failed leaves its value in the request
+                pending.value.destroy();
+                throw;
+            }
+        }
+
+        /**
+         * Pushes the values in [first, last) into the priority queue. The whole batch is published as a single
+         * request, so it costs one combining pass instead of one per value, and the heap is restored once for all of
+         * them.
+         */
+        template<typename ITERATOR>
+        void push_bulk(ITERATOR first, ITERATOR last) {
+            std::vector<T> batch(first, last);
+            if (batch.empty()) return;
+
+            auto& pending = combiner.thread_request();
+            pending.requested = operation::PUSH_BULK;
+            pending.batch = &batch;
+            combiner.submit(pending);
+        }
+
+        /**
+         * Pops up to maximum of the greatest values in a single request, writing them to output greatest first.
+         * Returns how many values were popped, which is zero if the priority queue was empty.
+         */
+        template<typename OUTPUT_ITERATOR>
+        std::size_t try_pop_n(OUTPUT_ITERATOR output, std::size_t maximum) {
+            if (maximum == 0) return 0;
+
+            // Reserve up front so that the combiner rarely has to allocate on this thread's behalf
+            std::vector<T> batch;
+            batch.reserve(std::min(maximum, MAXIMUM_BULK_RESERVE));
+
+            auto& pending = combiner.thread_request();
+            pending.requested = operation::POP_BULK;
+            pending.batch = &batch;
+            pending.batch_limit = maximum;
+            combiner.submit(pending);
+
+            for (auto& value : batch) {
+                *output++ = std::move(value);
+            }
+            return batch.size();
+        }
+
+        /**
+         * Returns how many values the priority queue holds, as of the last combining pass. The combiner keeps count as
+         * it goes, so this reads a single atomic without submitting a request or touching the heap.
+         */
+        std::size_t size_approx() const {
+            return combiner.operations().size.load();
+        }
+
+        /**
+         * Returns whether the priority queue is empty. It should be noted that another thread may have already added
+         * an entry to the priority queue by the time the returned boolean is used.
+         */
+        bool empty() const {
+            return size_approx() == 0;
+        }
+
+#ifdef CCL_ENABLE_STATS
+        /**
+         * Returns the combining statistics gathered so far, added up over all threads. Only available when compiled
+         * with CCL_ENABLE_STATS.
+         */
+        combining_stats stats() const {
+            return combiner.stats();
+        }
+#endif
+    };
+}
+
+#endif //CCL_PRIORITY_QUEUE_HPP
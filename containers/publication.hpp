@@ -0,0 +1,184 @@
+//
+// Bookkeeping for the publication records of the flat combining containers.
+//
+
+#ifndef CCL_PUBLICATION_HPP
+#define CCL_PUBLICATION_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ccl {
+    /**
+     * Decides how much work a flat combining container's combiner does each time it takes the combiner lock. A pass
+     * answers every request it finds on the publication list, and each pass the combiner makes while holding the lock
+     * saves the threads that published meanwhile from handing the lock over (and from waiting their turn for it).
+     *
+     * The defaults make a single pass, like a combiner with no policy at all. With adaptive set, the combiner keeps
+     * making passes for as long as each one still finds new requests, so it only stays on while requests keep coming
+     * in, and at low load a pass that comes up empty ends the streak right away.
+     *
+     * A container can also combine hierarchically: its threads are split into clusters (one per NUMA node with
+     * clusters set to 0), each with a publication list and combiner of its own. A cluster's combiner collects the
+     * requests of its threads, which only ever touches records written on the same node, and then applies them to the
+     * container in one go while holding the lock on its values, so those only move between the nodes once per batch.
+     * That costs a mutex handover on every batch, so it is only worth asking for on machines with several nodes under
+     * heavy load, and the default is a single cluster.
+     */
+    struct combining_policy {
+        unsigned int maximum_record_age; // Passes an idle record stays on the publication list before it is removed,
+                                         // at least 1
+        unsigned int minimum_passes; // Passes made every time the lock is taken, even if they find nothing to do
+        bool adaptive; // Keep making passes while the previous one answered a request
+        unsigned int maximum_passes; // Most passes made while holding the lock, bounding what one combiner does
+        std::size_t clusters; // Publication lists the threads are split over, 0 for one per NUMA node
+
+        combining_policy()
+            : maximum_record_age(MAXIMUM_RECORD_AGE)
+            , minimum_passes(1)
+            , adaptive(false)
+            , maximum_passes(16)
+            , clusters(1) {
+        }
+
+        /**
+         * Whether the combiner makes another pass, given the passes it made so far and the requests the last one
+         * answered.
+         */
+        bool another_pass(unsigned int passes, std::size_t answered) const {
+            if (passes < minimum_passes) return true;
+            return adaptive && answered && passes < maximum_passes;
+        }
+    };
+
+    namespace detail {
+        unsigned int const RECORD_THREAD_OWNER = 1; // The thread that publishes requests through the record
+        unsigned int const RECORD_CONTAINER_OWNER = 2; // The container whose publication list the record belongs to
+
+        /**
+         * A publication record is owned by both its thread and its container, since either one may go away first. Each
+         * owner drops its claim when it is done with the record, and whoever drops the last claim destroys it.
+         */
+        struct owned_record {
+            std::atomic<unsigned int> owners;
+            void (*destroy)(owned_record*); // Deletes the record as its full type
+
+            explicit owned_record(void (*destroy_)(owned_record*))
+                : owners(RECORD_THREAD_OWNER | RECORD_CONTAINER_OWNER)
+                , destroy(destroy_) {
+            }
+
+            bool owned_by(unsigned int owner) const {
+                return (owners.load(std::memory_order_acquire) & owner) != 0;
+            }
+
+            /**
+             * Drops the owner's claim on the record, destroying it if the other owner already dropped theirs.
+             */
+            void release(unsigned int owner) {
+                if (owners.fetch_and(~owner, std::memory_order_acq_rel) == owner) {
+                    destroy(this);
+                }
+            }
+        };
+
+        /**
+         * Returns an id that is unique to a container for the whole run of the program. Unlike the container's address,
+         * it is never reused after the container is destroyed.
+         */
+        inline std::uint64_t next_container_id() {
+            static std::atomic<std::uint64_t> last_id(0);
+            return last_id.fetch_add(1, std::memory_order_relaxed) + 1;
+        }
+
+        /**
+         * The publication records of one thread, one for each container the thread used. When the thread exits it
+         * drops its claim on all of them, so that the containers can free them.
+         */
+        class record_table {
+        private:
+            struct entry {
+                std::uint64_t container_id;
+                owned_record* record;
+            };
+
+            std::vector<entry> entries;
+            std::size_t last_found; // Threads tend to use the same container many times in a row
+
+        public:
+            record_table()
+                : last_found(0) {
+            }
+
+            ~record_table() {
+                for (auto& table_entry : entries) {
+                    table_entry.record->release(RECORD_THREAD_OWNER);
+                }
+            }
+
+            record_table(const record_table &other) = delete;
+            record_table &operator=(const record_table &other) = delete;
+
+            /**
+             * Returns the thread's record for the container, or nullptr if it doesn't have one yet.
+             */
+            owned_record* find(std::uint64_t container_id) {
+                if (last_found < entries.size() && entries[last_found].container_id == container_id) {
+                    return entries[last_found].record;
+                }
+
+                for (std::size_t index = 0; index < entries.size(); ++index) {
+                    if (entries[index].container_id == container_id) {
+                        last_found = index;
+                        return entries[index].record;
+                    }
+                }
+                return nullptr;
+            }
+
+            void add(std::uint64_t container_id, owned_record* record) {
+                // Drop the records of containers that were destroyed since, which keeps the table compact
+                entries.erase(std::remove_if(entries.begin(), entries.end(), [](entry& table_entry) {
+                    if (table_entry.record->owned_by(RECORD_CONTAINER_OWNER)) return false;
+
+                    table_entry.record->release(RECORD_THREAD_OWNER);
+                    return true;
+                }), entries.end());
+
+                last_found = entries.size();
+                entries.push_back(entry{container_id, record});
+            }
+        };
+
+        inline record_table& thread_records() {
+            static thread_local record_table table;
+            return table;
+        }
+
+        /**
+         * Removes record from a singly linked list that other threads only ever push onto at the head, while the caller
+         * has the exclusive right to remove from it. previous is the record linking to it, or nullptr if it was the
+         * head when the caller reached it (a record pushed since may have become the head, which a plain store of the
+         * head would lose).
+         */
+        template<typename RECORD>
+        void unlink(std::atomic<RECORD*>& head, RECORD* previous, RECORD* record, RECORD* RECORD::* link) {
+            if (!previous) {
+                auto expected = record;
+                if (head.compare_exchange_strong(expected, record->*link)) return;
+
+                // Records were pushed in front of it, one of which now links to it
+                previous = expected;
+                while (previous->*link != record) {
+                    previous = previous->*link;
+                }
+            }
+            previous->*link = record->*link;
+        }
+    }
+}
+
+#endif //CCL_PUBLICATION_HPP
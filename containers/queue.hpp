@@ -5,169 +5,204 @@
 #ifndef CCL_QUEUE_HPP
 #define CCL_QUEUE_HPP
 
+#include <algorithm>
 #include <utility>
 #include <memory>
 #include <atomic>
 #include <iostream>
 #include <thread>
+#include <chrono>
+#include <vector>
+
+#include "detail.hpp"
+#include "event_count.hpp"
+#include "flat_combiner.hpp"
+#include "stats.hpp"
+#include "storage.hpp"
 
 namespace ccl {
     /**
      * Concurrent queue. A simplified version of std::queue that allows for concurrent access. Implemented using
-     * flat combining, outlined here: http://www.cs.bgu.ac.il/~hendlerd/papers/flat-combining.pdf
+     * flat combining on top of ccl::flat_combiner, outlined here:
+     * http://www.cs.bgu.ac.il/~hendlerd/papers/flat-combining.pdf
+     *
+     * Since the combiner applies every request alone, the elements are kept in a plain sequential container chosen by
+     * the STORAGE policy: linked_storage (the default) keeps a linked list of nodes, recycling freed nodes so that
+     * most combining passes never have to call into the allocator, while contiguous_storage keeps the elements in
+     * fixed size segments and ring_storage in a single circular buffer.
+     *
+     * A queue constructed with a capacity is bounded: pushes wait (or with try_push, fail) while it holds capacity
+     * values, which gives producers backpressure when the consumers fall behind. With ring_storage the room for all
+     * of them is allocated up front, so a bounded queue's memory use is fixed and it never allocates afterwards.
+     *
+     * On a machine with several NUMA nodes the combining can be made hierarchical (see combining_policy::clusters):
+     * the threads of each node publish to a list of their own, whose combiner hands the batch over to the values, so
+     * the records never leave their node and only the values travel between the nodes.
      */
-    template<typename T>
+    template<typename T, typename ALLOCATOR = std::allocator<T>, typename STORAGE = linked_storage>
     class queue {
     private:
-        struct node {
-            node* next;
-            T data;
-
-            node(T data_)
-                    : data(data_)
-                    , next(nullptr) { }
-        };
+        using storage_type = typename STORAGE::template queue<T, ALLOCATOR>;
 
-        enum class RequestType {
+        enum class operation {
             PUSH,
             POP,
-            RESPONSE_PUSH,
-            RESPONSE_POP,
-            RESPONSE_POP_FAIL,
-            NULL_RESPONSE
+            PUSH_BULK,
+            POP_BULK
         };
 
-        struct publication_record {
-            publication_record* next;
-            std::pair<RequestType, T> request;
-            unsigned int age;
-            std::atomic<bool> active;
-        };
+        static unsigned int const PUSHED = 1; // Event of a combining pass that added values to the storage
+        static unsigned int const POPPED = 2; // Event of a combining pass that removed values from it
+
+        /**
+         * Applies each request as the combining pass comes across it, keeping count of the values.
+         */
+        struct operations {
+            struct request : combining_request {
+                operation requested;
+                bool succeeded; // Whether a push found room, or a pop got a value
+                detail::value_slot<T> value; // Value to push, or the value popped by the combiner, while there is one
+                std::vector<T>* batch; // Values of a bulk request, owned by the requesting thread
+                std::size_t batch_limit; // Most values a bulk pop may take
+                std::size_t batch_done; // Values of a bulk push pushed so far, which is less than all of them if the
+                                        // queue filled up
+            };
+
+            std::size_t const capacity; // Most values the queue holds, 0 if it is unbounded
+            alignas(CACHE_LINE_SIZE) detail::owned_counter size; // Values in the storage, on a line of its own since
+                                                                 // size_approx reads it from any thread
+
+            alignas(CACHE_LINE_SIZE) event_count pushes; // Notified after a combining pass that added values, for
+                                                         // threads blocked in wait_pop
+            alignas(CACHE_LINE_SIZE) event_count pops; // Notified after a combining pass that removed values from a
+                                                       // bounded queue, for threads waiting for room to push
+
+            explicit operations(std::size_t capacity_)
+                : capacity(capacity_) {
+            }
+
+            bool has_room() const {
+                return !capacity || size.load() < capacity;
+            }
 
-        node* head;
-        node* tail;
-
-        std::atomic<publication_record*> publication_head;
-        unsigned int combining_pass_counter;
-        std::atomic_flag combiner_lock;
-
-        /**
-         * Handles pending thread requests.
-         */
-        void combiner() {
-            ++combining_pass_counter;
-
-            // Traverse publication list from the head, updating age of non-null records and and processing requests
-            auto current_record = publication_head.load();
-            publication_record* previous_record = nullptr;
-            while (current_record) {
-                std::atomic_thread_fence(std::memory_order_acquire);
-                if (current_record->request.first != RequestType::NULL_RESPONSE) {
-                    // Update the age of all non-null requests and apply the methods they requested
-                    current_record->age = combining_pass_counter;
-
-                    if (current_record->request.first == RequestType::PUSH) {
-                        auto new_tail = new node(current_record->request.second);
-
-                        if (tail)
-                            tail->next = new_tail;
-                        tail = new_tail;
-                        if (!head)
-                            head = tail;
-
-                        current_record->request.first = RequestType::RESPONSE_PUSH;
-                    } else if (current_record->request.first == RequestType::POP) {
-                        if (head) {
-                            current_record->request.second = head->data;
-                            std::atomic_thread_fence(std::memory_order_release); // Make sure data is updated before
-                                                                                 // signalling a response.
-                            current_record->request.first = RequestType::RESPONSE_POP;
-
-                            auto old_head = head;
-                            head = head->next;
-                            std::atomic_thread_fence(std::memory_order_release);
-                            delete old_head;
-                        } else {
-                            current_record->request.first = RequestType::RESPONSE_POP_FAIL;
-                        }
+            unsigned int apply(storage_type& storage, request& pending) {
+                unsigned int events = 0;
+                if (pending.requested == operation::PUSH) {
+                    // A full queue leaves the value with the thread
+                    pending.succeeded = has_room();
+                    if (pending.succeeded) {
+                        storage.emplace(std::move(pending.value.get()));
+                        pending.value.destroy();
+                        size.add(1);
+                        events = PUSHED;
+                    }
+                } else if (pending.requested == operation::POP) {
+                    pending.succeeded = !storage.empty();
+                    if (pending.succeeded) {
+                        pending.value.emplace(std::move(storage.front()));
+                        storage.pop();
+                        size.subtract(1);
+                        events = POPPED;
+                    }
+                } else if (pending.requested == operation::PUSH_BULK) {
+                    // A bounded queue takes as much of the batch as fits
+                    auto& batch = *pending.batch;
+                    auto first = pending.batch_done;
+                    for (; pending.batch_done < batch.size() && has_room(); ++pending.batch_done) {
+                        storage.emplace(std::move(batch[pending.batch_done]));
+                        size.add(1);
+                    }
+                    // A full queue that took nothing has nothing to wake the waiters for
+                    if (pending.batch_done != first) {
+                        events = PUSHED;
                     }
                 } else {
-                    // Null requests are removed from the publication list if they become too old
-                    if (combining_pass_counter - current_record->age > MAXIMUM_RECORD_AGE) {
-                        if (!previous_record) {
-                            publication_head.store(current_record->next);
-                        } else {
-                            previous_record->next = current_record->next;
-                        }
-
-                        current_record->active.store(false);
+                    auto& batch = *pending.batch;
+                    auto first = batch.size();
+                    while (batch.size() < pending.batch_limit && !storage.empty()) {
+                        batch.push_back(std::move(storage.front()));
+                        storage.pop();
+                        size.subtract(1);
+                    }
+                    if (batch.size() != first) {
+                        events = POPPED;
                     }
                 }
 
-                if (current_record->active) {
-                    // Record the previous record in case we need to remove a record
-                    previous_record = current_record;
-                }
-                current_record = current_record->next;
+                // Answering makes sure data is updated before it is signalled
+                pending.answer();
+                return events;
+            }
+
+            unsigned int finish_pass(storage_type&) {
+                return 0;
+            }
+
+            void abandon_pass() {
             }
 
-            combiner_lock.clear();
+            void notify(unsigned int events) {
+                if (events & PUSHED) {
+                    pushes.notify_all();
+                }
+                if ((events & POPPED) && capacity) {
+                    pops.notify_all();
+                }
+            }
         };
 
+        flat_combiner<storage_type, operations> combiner;
+
+        event_count& pushes() {
+            return combiner.operations().pushes;
+        }
+
+        event_count& pops() {
+            return combiner.operations().pops;
+        }
+
         /**
-         * Adds request to thread's
+         * Pushes the value the request holds, returning false if the (bounded) queue is full, in which case the
+         * request still holds it. If the push fails with an exception instead, the value is destroyed.
          */
-        publication_record* add_request(std::pair<RequestType, T> request) {
-            static thread_local publication_record* thread_publication_record = nullptr;
-
-            // First check if thread has a publication record
-            if (thread_publication_record == nullptr) {
-                // Allocate a publication record for thread
-                thread_publication_record = new publication_record;
-                thread_publication_record->next = nullptr;
-                thread_publication_record->age = combining_pass_counter;
-                thread_publication_record->active = false;
+        bool push_once(typename operations::request& pending) {
+            pending.requested = operation::PUSH;
+            try {
+                combiner.submit(pending);
+            } catch (...) {
+                pending.value.destroy();
+                throw;
             }
+            return pending.succeeded;
+        }
 
-            // Update node with new values
-            // May want to be careful about this, since a combiner could read request.first before request.second is
-            // also updated on its cache?
-            thread_publication_record->request.second = std::move(request.second);
-            std::atomic_thread_fence(std::memory_order_release);
-            thread_publication_record->request.first = std::move(request.first);
-
-            // Make sure record is set to active
-            if(!thread_publication_record->active) {
-                thread_publication_record->active = true;
-
-                // Append as the new head
-                auto old_head = publication_head.load();
-                do {
-                    thread_publication_record->next = old_head;
-                } while(!publication_head.compare_exchange_weak(old_head, thread_publication_record));
-            }
+    public:
+        explicit queue(ALLOCATOR const& allocator = ALLOCATOR())
+            : queue(0, allocator) {
+        }
 
-            return thread_publication_record;
+        /**
+         * Constructs a queue holding at most capacity values (0 for no limit).
+         */
+        explicit queue(std::size_t capacity_, ALLOCATOR const& allocator = ALLOCATOR())
+            : queue(capacity_, combining_policy(), allocator) {
         }
 
-    public:
-        queue()
-            : head(nullptr)
-            , tail(nullptr)
-            , combiner_lock(ATOMIC_FLAG_INIT)
-            , combining_pass_counter(0) {
-            // Setup first thread's publication record
-            publication_head.store(nullptr);
-        }
-
-        ~queue() {
-            // Pop queue nodes until head becomes nullptr (reached the tail).
-            // Note: Both constructor and destructor can be assumed sequential, so thread-safety is not an issue.
-            while (head != nullptr) {
-                auto old_head = head;
-                head = head->next;
-                delete old_head;
-            }
+        /**
+         * Constructs a queue holding at most capacity values (0 for no limit), whose combiner batches requests
+         * according to policy.
+         */
+        queue(std::size_t capacity_, combining_policy const& policy_, ALLOCATOR const& allocator = ALLOCATOR())
+            : combiner(policy_, std::forward_as_tuple(allocator, capacity_), std::forward_as_tuple(capacity_)) {
+        }
+
+        // Keep the padding between the field groups intact when the queue itself is allocated with new
+        static void* operator new(std::size_t size) {
+            return detail::allocate_aligned(size, alignof(queue));
+        }
+
+        static void operator delete(void* pointer) {
+            detail::free_aligned(pointer);
         }
 
         // Disallow copying a queue
@@ -179,67 +214,189 @@ namespace ccl {
          *  is not empty).
          */
         bool try_pop(T& return_value) {
-            std::pair<RequestType, T> request = std::make_pair(RequestType::POP, T());
-            auto record = add_request(request);
+            auto& pending = combiner.thread_request();
+            pending.requested = operation::POP;
+            combiner.submit(pending);
+
+            if (pending.succeeded) {
+                return_value = std::move(pending.value.get());
+                pending.value.destroy();
+            }
+            return pending.succeeded;
+        }
+
+        /**
+         * Pops the value at the head of the queue, blocking until there is one. A blocked thread sleeps until another
+         * thread pushes, so waiting on an empty queue costs no CPU time.
+         */
+        void wait_pop(T& return_value) {
+            while (true) {
+                // Registering before trying to pop means that a push landing in between still wakes this thread
+                unsigned int key;
+                if (pushes().prepare_wait(key, [&]() { return try_pop(return_value); })) return;
+                pushes().wait(key);
+            }
+        }
 
-            // Node is prepared, spin waiting on a response or if the lock is open
+        /**
+         * Same as wait_pop, but gives up once the timeout has passed. Returns false if nothing could be popped in time.
+         */
+        template<typename REP, typename PERIOD>
+        bool wait_pop_for(T& return_value, std::chrono::duration<REP, PERIOD> const& timeout) {
+            auto deadline = std::chrono::steady_clock::now() + timeout;
             while (true) {
-                if (record->request.first == RequestType::RESPONSE_POP) {
-                    // Request processed; acknowledge and return
-                    record->request.first = RequestType::NULL_RESPONSE;
-                    std::atomic_thread_fence(std::memory_order_acquire);
-                    return_value = std::move(record->request.second);
-                    return true;
-                } else if (record->request.first == RequestType::RESPONSE_POP_FAIL) {
-                    record->request.first = RequestType::NULL_RESPONSE;
-                    return false;
-                } else if (!record->active) {
-                    // Combiner decided that record is too old, update it and add request again to publication list
-                    record = add_request(request);
-                } else if (!combiner_lock.test_and_set()) {
-                    // Got the lock
-                    combiner();
-                } else {
-                    std::this_thread::yield();
+                unsigned int key;
+                if (pushes().prepare_wait(key, [&]() { return try_pop(return_value); })) return true;
+                if (!pushes().wait_until(key, deadline)) {
+                    // Timed out, but a value may still have been pushed right before then
+                    return try_pop(return_value);
                 }
             }
         }
 
         /**
-         * Pushes a new value onto the queue.
+         * Pushes a new value onto the queue. A bounded queue that is full blocks the thread until there is room for
+         * the value.
+         */
+        void push(T const& new_value) {
+            emplace(new_value);
+        }
+
+        void push(T&& new_value) {
+            emplace(std::move(new_value));
+        }
+
+        /**
+         * Same as push, spelled out for bounded queues.
+         */
+        void wait_push(T const& new_value) {
+            emplace(new_value);
+        }
+
+        void wait_push(T&& new_value) {
+            emplace(std::move(new_value));
+        }
+
+        /**
+         * Pushes a new value onto the queue unless it is bounded and full, returning whether it was pushed. A value
+         * that wasn't pushed is left with the caller.
          */
-        void push(T new_value) {
-            std::pair<RequestType, T> request = std::make_pair(RequestType::PUSH, std::move(new_value));
-            auto record = add_request(request);
+        bool try_push(T const& new_value) {
+            auto& pending = combiner.thread_request();
+            pending.value.emplace(new_value);
+            if (push_once(pending)) return true;
+
+            pending.value.destroy();
+            return false;
+        }
+
+        bool try_push(T&& new_value) {
+            auto& pending = combiner.thread_request();
+            pending.value.emplace(std::move(new_value));
+            if (push_once(pending)) return true;
+
+            // Hand the value back, so that the caller still has it to try again later
+            new_value = std::move(pending.value.get());
+            pending.value.destroy();
+            return false;
+        }
+
+        /**
+         * Pushes a value constructed from args onto the queue. The value is constructed right in the thread's
+         * publication record, from where the combiner moves it into the queue, so T doesn't have to be copyable.
+         * Like push, this blocks while a bounded queue is full, sleeping until a pop makes room.
+         */
+        template<typename... ARGS>
+        void emplace(ARGS&&... args) {
+            auto& pending = combiner.thread_request();
+            pending.value.emplace(std::forward<ARGS>(args)...);
+            if (push_once(pending)) return;
 
-            // Node is prepared, spin waiting on a response or if the lock is open
             while (true) {
-                if (record->request.first == RequestType::RESPONSE_PUSH) {
-                    // Request processed; acknowledge and return
-                    record->request.first = RequestType::NULL_RESPONSE;
-                    return;
-                } else if (!record->active) {
-                    // Combiner decided that record is too old, update it and add request again to publication list
-                    record = add_request(std::move(request));
-                } else if (!combiner_lock.test_and_set()) {
-                    // Got the lock
-                    combiner();
-                } else {
-                    // For programs where the thread count accessing this data structure is higher than the core count
-                    // available, this prevents wasteful empty CAS loops waiting for a lock that is fighting to be
-                    // scheduled by the OS.
-                    std::this_thread::yield();
-                }
+                // Registering before trying again means that a pop landing in between still wakes this thread
+                unsigned int key;
+                if (pops().prepare_wait(key, [&]() { return push_once(pending); })) return;
+                pops().wait(key);
+            }
+        }
+
+        /**
+         * Pushes the values in [first, last) onto the queue in order. The whole batch is published as a
+         * single request, so it costs one combining pass instead of one per value and is never interleaved with other
+         * threads' pushes. The exception is a bounded queue without room for all of them, which takes the batch in
+         * parts as pops make room, blocking the thread until the last part is in.
+         */
+        template<typename ITERATOR>
+        void push_bulk(ITERATOR first, ITERATOR last) {
+            std::vector<T> batch(first, last);
+            if (batch.empty()) return;
+
+            auto& pending = combiner.thread_request();
+            pending.requested = operation::PUSH_BULK;
+            pending.batch = &batch;
+            pending.batch_done = 0;
+            combiner.submit(pending);
+
+            while (pending.batch_done < batch.size()) {
+                unsigned int key;
+                if (pops().prepare_wait(key, [&]() {
+                    combiner.submit(pending);
+                    return pending.batch_done == batch.size();
+                })) return;
+                pops().wait(key);
             }
         }
 
+        /**
+         * Pops up to maximum values from the head of the queue in a single request, writing them to output in the order
+         * they were popped. Returns how many values were popped, which is zero if the queue was empty.
+         */
+        template<typename OUTPUT_ITERATOR>
+        std::size_t try_pop_n(OUTPUT_ITERATOR output, std::size_t maximum) {
+            if (maximum == 0) return 0;
+
+            // Reserve up front so that the combiner rarely has to allocate on this thread's behalf
+            std::vector<T> batch;
+            batch.reserve(std::min(maximum, MAXIMUM_BULK_RESERVE));
+
+            auto& pending = combiner.thread_request();
+            pending.requested = operation::POP_BULK;
+            pending.batch = &batch;
+            pending.batch_limit = maximum;
+            combiner.submit(pending);
+
+            for (auto& value : batch) {
+                *output++ = std::move(value);
+            }
+            return batch.size();
+        }
+
+        /**
+         * Returns how many values the queue holds, as of the last request a combiner applied. The combiner keeps count
+         * as it goes, so this reads a single atomic without submitting a request or touching the storage. Requests
+         * being applied meanwhile may change it by the time it is used.
+         */
+        std::size_t size_approx() const {
+            return combiner.operations().size.load();
+        }
+
         /**
          * Returns whether the queue is empty. It should be noted that another thread may have already added an
          * entry to the queue by the time the returned boolean is used.
          */
-        bool empty() {
-            return !head;
+        bool empty() const {
+            return size_approx() == 0;
+        }
+
+#ifdef CCL_ENABLE_STATS
+        /**
+         * Returns the combining statistics gathered so far, added up over all threads. Only available when compiled
+         * with CCL_ENABLE_STATS.
+         */
+        combining_stats stats() const {
+            return combiner.stats();
         }
+#endif
     };
 }
 
@@ -0,0 +1,412 @@
+//
+// Safe memory reclamation shared by the containers: epoch based reclamation and hazard pointers.
+//  - Epochs are based on the scheme described by K. Fraser in "Practical lock-freedom" (section 5.2.3).
+//  - Hazard pointers are based on "Hazard Pointers: Safe Memory Reclamation for Lock-Free Objects" by M. M. Michael.
+//
+
+#ifndef CCL_RECLAIM_HPP
+#define CCL_RECLAIM_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+#include "detail.hpp"
+
+namespace ccl {
+    std::size_t const RECLAIM_THRESHOLD = 64; // Retired objects a thread buffers before it tries to free some
+    std::size_t const HAZARD_POINTERS_PER_THREAD = 4; // Hazard pointers a thread may hold at once
+
+    /**
+     * Lets a lock-free reader safely dereference nodes that a writer may unlink at any time. Writers retire()
+     * unlinked nodes instead of deleting them, and readers protect what they are reading in one of two ways.
+     *
+     * An epoch_guard pins the reader for the duration of a traversal, however many nodes it touches. A retired node is
+     * only freed once every thread that was pinned when it was retired has unpinned: the global epoch only advances
+     * once every pinned thread has observed the current epoch, so anything retired in epoch E is unreachable by all
+     * readers once the global epoch reaches E + 2. Pinning is cheap, but a thread that stalls while pinned (preempted,
+     * say) holds back everything retired meanwhile, by all of the containers.
+     *
+     * A hazard_pointer instead protects a single object the reader loaded from a shared pointer, and objects retired
+     * with retire_hazard are freed as soon as no hazard pointer holds them. A stalled reader then only ever holds back
+     * the few objects it protects, so the memory waiting to be freed stays bounded. This suits readers that only need
+     * one or two objects at a time (like a work_stealing_deque's thieves); traversals are better off pinned.
+     *
+     * Each thread buffers what it retires and frees whatever it can once the buffer has grown to twice what was left
+     * the last time (and at least RECLAIM_THRESHOLD), so retiring stays amortized O(1) even while a stalled reader keeps
+     * anything from being freed. What a thread leaves behind when it exits is adopted by the next thread to collect,
+     * without taking any lock, and collect() frees what it can right away, for a thread about to go idle.
+     */
+    namespace reclaim {
+        namespace detail {
+            struct retired_entry {
+                void* pointer;
+                void (*deleter)(void*);
+                std::uint64_t epoch; // Global epoch when it was retired, unused for hazard pointer protected objects
+            };
+
+            /**
+             * Per thread state. Records are never freed, instead they are recycled by threads created later. Each one
+             * has the cache line(s) to itself, since its thread writes local_epoch on every pin.
+             */
+            struct alignas(CACHE_LINE_SIZE) thread_record : ccl::detail::cache_aligned_allocation {
+                std::atomic<std::uint64_t> local_epoch; // (epoch << 1) | 1 while pinned, 0 while not
+                std::atomic<void*> hazards[HAZARD_POINTERS_PER_THREAD]; // Objects protected by the thread
+                std::atomic<bool> in_use;
+                thread_record* next; // Immutable once the record is published
+
+                thread_record()
+                    : local_epoch(0)
+                    , in_use(true)
+                    , next(nullptr) {
+                    for (auto& hazard : hazards) {
+                        hazard.store(nullptr, std::memory_order_relaxed);
+                    }
+                }
+            };
+
+            /**
+             * Entries left behind by a thread that exited before they could be freed.
+             */
+            struct orphan_batch {
+                std::vector<retired_entry> entries;
+                std::vector<retired_entry> hazard_entries;
+                orphan_batch* next;
+            };
+
+            struct global_state {
+                std::atomic<std::uint64_t> epoch;
+                std::atomic<thread_record*> records;
+                std::atomic<orphan_batch*> orphans; // Stack of batches, adopted whole by the next thread to collect
+
+                global_state()
+                    : epoch(1)
+                    , records(nullptr)
+                    , orphans(nullptr) {
+                }
+
+                ~global_state() {
+                    // Every thread is gone by now, so nothing can still be reading
+                    auto batch = orphans.load();
+                    while (batch) {
+                        for (auto& entry : batch->entries) {
+                            entry.deleter(entry.pointer);
+                        }
+                        for (auto& entry : batch->hazard_entries) {
+                            entry.deleter(entry.pointer);
+                        }
+                        auto old_batch = batch;
+                        batch = batch->next;
+                        delete old_batch;
+                    }
+
+                    auto record = records.load();
+                    while (record) {
+                        auto old_record = record;
+                        record = record->next;
+                        delete old_record;
+                    }
+                }
+            };
+
+            inline global_state& state() {
+                static global_state global;
+                return global;
+            }
+
+            /**
+             * Advances the global epoch if every pinned thread has already observed it. Returns the (possibly new)
+             * global epoch.
+             */
+            inline std::uint64_t try_advance() {
+                auto& global = state();
+                auto epoch = global.epoch.load();
+                for (auto record = global.records.load(); record; record = record->next) {
+                    auto local = record->local_epoch.load();
+                    if ((local & 1) && (local >> 1) != epoch) {
+                        // A thread is still pinned in an older epoch
+                        return epoch;
+                    }
+                }
+
+                global.epoch.compare_exchange_strong(epoch, epoch + 1);
+                return global.epoch.load();
+            }
+
+            /**
+             * Frees every entry retired at least two epochs ago, keeping the rest.
+             */
+            inline void free_expired(std::vector<retired_entry>& entries, std::uint64_t epoch) {
+                std::size_t kept = 0;
+                for (auto& entry : entries) {
+                    if (entry.epoch + 2 <= epoch) {
+                        entry.deleter(entry.pointer);
+                    } else {
+                        entries[kept++] = entry;
+                    }
+                }
+                entries.resize(kept);
+            }
+
+            /**
+             * Frees every entry that no thread holds a hazard pointer to, keeping the rest.
+             */
+            inline void free_unprotected(std::vector<retired_entry>& entries) {
+                // Pairs with hazard_pointer::protect however the pointers to the entries were replaced, so that either
+                // this scan sees a hazard or the reader's reload sees the replacement. Without it, a replacement stored
+                // with release could still sit in the store buffer while the scan misses the hazard.
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                std::vector<void*> protected_pointers;
+                for (auto record = state().records.load(); record; record = record->next) {
+                    for (auto& hazard : record->hazards) {
+                        if (auto pointer = hazard.load()) protected_pointers.push_back(pointer);
+                    }
+                }
+                std::sort(protected_pointers.begin(), protected_pointers.end());
+
+                std::size_t kept = 0;
+                for (auto& entry : entries) {
+                    if (std::binary_search(protected_pointers.begin(), protected_pointers.end(), entry.pointer)) {
+                        entries[kept++] = entry;
+                    } else {
+                        entry.deleter(entry.pointer);
+                    }
+                }
+                entries.resize(kept);
+            }
+
+            /**
+             * Returns how many entries a retire list may grow to before it is collected again, given what was left.
+             */
+            inline std::size_t next_threshold(std::size_t left) {
+                return std::max(RECLAIM_THRESHOLD, left * 2);
+            }
+
+            /**
+             * Owns the calling thread's record along with the entries it has retired.
+             */
+            class thread_handle {
+            public:
+                thread_record* record;
+                unsigned int depth; // Allows guards to be nested
+                unsigned int hazards_held; // Bit set of the record's hazard pointers in use
+                std::vector<retired_entry> retired;
+                std::vector<retired_entry> hazard_retired;
+                std::size_t collect_at; // Size of retired that triggers the next collection
+                std::size_t hazard_collect_at; // Same for hazard_retired
+
+                thread_handle()
+                    : record(nullptr)
+                    , depth(0)
+                    , hazards_held(0)
+                    , collect_at(RECLAIM_THRESHOLD)
+                    , hazard_collect_at(RECLAIM_THRESHOLD) {
+                    auto& global = state();
+
+                    // Recycle the record of a thread that has already exited if possible
+                    for (auto current = global.records.load(); current; current = current->next) {
+                        bool expected = false;
+                        if (!current->in_use.load() && current->in_use.compare_exchange_strong(expected, true)) {
+                            record = current;
+                            return;
+                        }
+                    }
+
+                    record = new thread_record;
+                    auto old_head = global.records.load();
+                    do {
+                        record->next = old_head;
+                    } while (!global.records.compare_exchange_weak(old_head, record));
+                }
+
+                ~thread_handle() {
+                    // The epoch has to advance twice for everything to expire, which it will unless a thread is pinned
+                    for (int attempt = 0; attempt < 3 && !(retired.empty() && hazard_retired.empty()); ++attempt) {
+                        collect();
+                    }
+                    if (!retired.empty() || !hazard_retired.empty()) {
+                        // Hand what is left to whichever thread collects next
+                        auto batch = new orphan_batch{std::move(retired), std::move(hazard_retired), nullptr};
+                        auto& orphans = state().orphans;
+                        auto old_head = orphans.load();
+                        do {
+                            batch->next = old_head;
+                        } while (!orphans.compare_exchange_weak(old_head, batch));
+                    }
+
+                    record->local_epoch.store(0);
+                    record->in_use.store(false);
+                }
+
+                /**
+                 * Takes over the entries of every exited thread.
+                 */
+                void adopt() {
+                    auto& orphans = state().orphans;
+                    if (!orphans.load(std::memory_order_relaxed)) return;
+
+                    auto batch = orphans.exchange(nullptr);
+                    while (batch) {
+                        retired.insert(retired.end(), batch->entries.begin(), batch->entries.end());
+                        hazard_retired.insert(hazard_retired.end(), batch->hazard_entries.begin(),
+                                              batch->hazard_entries.end());
+                        auto old_batch = batch;
+                        batch = batch->next;
+                        delete old_batch;
+                    }
+                }
+
+                void collect() {
+                    adopt();
+                    free_expired(retired, try_advance());
+                    collect_at = next_threshold(retired.size());
+                    free_unprotected(hazard_retired);
+                    hazard_collect_at = next_threshold(hazard_retired.size());
+                }
+            };
+
+            inline thread_handle& local() {
+                static thread_local thread_handle handle;
+                return handle;
+            }
+        }
+
+        /**
+         * Pins the calling thread for the guard's lifetime, during which nothing it can reach will be freed.
+         */
+        class epoch_guard {
+        private:
+            detail::thread_handle& handle;
+
+        public:
+            epoch_guard()
+                : handle(detail::local()) {
+                if (handle.depth++ == 0) {
+                    // Sequentially consistent so that try_advance can't miss the pin while we start reading
+                    auto epoch = detail::state().epoch.load();
+                    handle.record->local_epoch.store((epoch << 1) | 1);
+                }
+            }
+
+            ~epoch_guard() {
+                if (--handle.depth == 0) {
+                    handle.record->local_epoch.store(0, std::memory_order_release);
+                }
+            }
+
+            epoch_guard(const epoch_guard &other) = delete;
+            epoch_guard &operator=(const epoch_guard &other) = delete;
+        };
+
+        /**
+         * Protects a single object, loaded through protect(), from being freed by retire_hazard until the hazard
+         * pointer is reset or destroyed. A thread may hold up to HAZARD_POINTERS_PER_THREAD at once.
+         */
+        class hazard_pointer {
+        private:
+            detail::thread_handle& handle;
+            unsigned int index;
+
+        public:
+            hazard_pointer()
+                : handle(detail::local())
+                , index(0) {
+                while (index < HAZARD_POINTERS_PER_THREAD && (handle.hazards_held & (1u << index))) {
+                    ++index;
+                }
+                if (index == HAZARD_POINTERS_PER_THREAD) {
+                    throw std::length_error("ccl::reclaim: more hazard pointers than HAZARD_POINTERS_PER_THREAD");
+                }
+                handle.hazards_held |= 1u << index;
+            }
+
+            ~hazard_pointer() {
+                reset();
+                handle.hazards_held &= ~(1u << index);
+            }
+
+            hazard_pointer(const hazard_pointer &other) = delete;
+            hazard_pointer &operator=(const hazard_pointer &other) = delete;
+
+            /**
+             * Returns the object source points to, protected. The pointer is published and then read again until
+             * it is still the same, so the object can't have been retired before the hazard pointer was seen.
+             */
+            template<typename U>
+            U* protect(std::atomic<U*> const& source) {
+                auto& hazard = handle.record->hazards[index];
+                auto pointer = source.load(std::memory_order_relaxed);
+                for (;;) {
+                    // Sequentially consistent, so that a collection either sees the hazard or this reload sees the
+                    // pointer that replaced it
+                    hazard.store(pointer);
+                    auto current = source.load();
+                    if (current == pointer) return pointer;
+                    pointer = current;
+                }
+            }
+
+            /**
+             * Stops protecting the object.
+             */
+            void reset() {
+                handle.record->hazards[index].store(nullptr, std::memory_order_release);
+            }
+        };
+
+        /**
+         * Schedules an object that is no longer reachable by new readers to be freed with the provided deleter, once
+         * every thread pinned meanwhile has unpinned.
+         */
+        inline void retire(void* pointer, void (*deleter)(void*)) {
+            auto& handle = detail::local();
+            handle.retired.push_back({pointer, deleter, detail::state().epoch.load()});
+            if (handle.retired.size() >= handle.collect_at) {
+                handle.collect();
+            }
+        }
+
+        /**
+         * Schedules an object allocated with new to be deleted once it is no longer reachable by any reader.
+         */
+        template<typename U>
+        void retire(U* pointer) {
+            retire(pointer, [](void* object) { delete static_cast<U*>(object); });
+        }
+
+        /**
+         * Schedules an object that is no longer reachable by new readers, and whose readers protect it with a
+         * hazard_pointer rather than by pinning, to be freed with the provided deleter once no hazard pointer holds it.
+         */
+        inline void retire_hazard(void* pointer, void (*deleter)(void*)) {
+            auto& handle = detail::local();
+            handle.hazard_retired.push_back({pointer, deleter, 0});
+            if (handle.hazard_retired.size() >= handle.hazard_collect_at) {
+                handle.collect();
+            }
+        }
+
+        /**
+         * retire_hazard for an object allocated with new.
+         */
+        template<typename U>
+        void retire_hazard(U* pointer) {
+            retire_hazard(pointer, [](void* object) { delete static_cast<U*>(object); });
+        }
+
+        /**
+         * Frees whatever the calling thread (and the threads that exited before it) retired that no reader can still
+         * reach. Collecting happens as a thread retires anyway, so this is only needed to give memory back right
+         * away, such as before a thread that retired a lot goes idle.
+         */
+        inline void collect() {
+            detail::local().collect();
+        }
+    }
+}
+
+#endif //CCL_RECLAIM_HPP
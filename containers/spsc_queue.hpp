@@ -0,0 +1,187 @@
+//
+// Lock-free queue for exactly one producer and one consumer thread.
+//
+
+#ifndef CCL_SPSC_QUEUE_HPP
+#define CCL_SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+#include "detail.hpp"
+
+namespace ccl {
+    std::size_t const SPSC_SEGMENT_SIZE = 256; // Values each segment of a single producer queue has room for
+
+    /**
+     * Queue (FIFO) for a channel with a single producer and a single consumer. Only one thread may push and only one
+     * (other) thread may pop at any time, which lets both sides skip the publication list and combiner of ccl::queue:
+     * a push is a construct plus one release store, and a pop one acquire load (only when the consumer has caught up
+     * with what it last saw) plus one release store, with no read-modify-write operations at all.
+     *
+     * The values are kept in a linked list of fixed size segments. The producer only touches the tail segment and
+     * the consumer only the head one, and the counters each side publishes are on cache lines of their own, so in a
+     * steady state the only lines moving between the two cores are the ones holding the values. A drained segment is
+     * handed back to the producer as a spare, so a queue that doesn't keep growing doesn't allocate either.
+     */
+    template<typename T, typename ALLOCATOR = std::allocator<T>>
+    class spsc_queue {
+    private:
+        struct segment {
+            detail::value_slot<T> values[SPSC_SEGMENT_SIZE];
+            segment* next; // Written by the producer before it publishes the first value of the next segment
+        };
+
+        using allocator_type = typename std::allocator_traits<ALLOCATOR>::template rebind_alloc<segment>;
+        using allocator_traits = std::allocator_traits<allocator_type>;
+
+        allocator_type allocator;
+
+        // Only accessed by the producer, apart from pushed
+        alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> pushed; // Values pushed so far, published by the producer
+        segment* tail_segment;
+        std::size_t push_count; // Producer's own copy of pushed
+
+        // Only accessed by the consumer, apart from popped
+        alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> popped; // Values popped so far, published by the consumer
+        segment* head_segment;
+        std::size_t pop_count; // Consumer's own copy of popped
+        std::size_t known_pushed; // Value of pushed the consumer last loaded
+
+        alignas(CACHE_LINE_SIZE) std::atomic<segment*> spare; // Drained segment waiting to be reused by the producer
+
+        segment* create_segment() {
+            auto new_segment = spare.exchange(nullptr, std::memory_order_acquire);
+            if (!new_segment) {
+                new_segment = allocator_traits::allocate(allocator, 1);
+            }
+            new_segment->next = nullptr;
+            return new_segment;
+        }
+
+        void retire_segment(segment* old_segment) {
+            // Release, so the producer reusing it sees that the consumer is done with the values in it
+            auto replaced = spare.exchange(old_segment, std::memory_order_release);
+            if (replaced) {
+                allocator_traits::deallocate(allocator, replaced, 1);
+            }
+        }
+
+    public:
+        explicit spsc_queue(ALLOCATOR const& allocator_ = ALLOCATOR())
+            : allocator(allocator_)
+            , pushed(0)
+            , tail_segment(nullptr)
+            , push_count(0)
+            , popped(0)
+            , head_segment(nullptr)
+            , pop_count(0)
+            , known_pushed(0)
+            , spare(nullptr) {
+            tail_segment = head_segment = create_segment();
+        }
+
+        /**
+         * Destroys the values left in the queue. Neither thread may be using the queue anymore.
+         */
+        ~spsc_queue() {
+            while (pop_count != push_count) {
+                auto index = pop_count % SPSC_SEGMENT_SIZE;
+                head_segment->values[index].destroy();
+                if (++pop_count % SPSC_SEGMENT_SIZE == 0) {
+                    auto old_segment = head_segment;
+                    head_segment = head_segment->next;
+                    allocator_traits::deallocate(allocator, old_segment, 1);
+                }
+            }
+            if (head_segment->next) {
+                // Linked by a push whose value's constructor threw
+                allocator_traits::deallocate(allocator, head_segment->next, 1);
+            }
+            allocator_traits::deallocate(allocator, head_segment, 1);
+            if (auto remaining = spare.load()) {
+                allocator_traits::deallocate(allocator, remaining, 1);
+            }
+        }
+
+        // Keep the producer and consumer fields on their own cache lines when the queue is allocated with new
+        static void* operator new(std::size_t size) {
+            return detail::allocate_aligned(size, alignof(spsc_queue));
+        }
+
+        static void operator delete(void* pointer) {
+            detail::free_aligned(pointer);
+        }
+
+        // Disallow copying a queue
+        spsc_queue(const spsc_queue &other) = delete;
+        spsc_queue &operator=(const spsc_queue &other) = delete;
+
+        /**
+         * Pushes a value constructed from the provided arguments. Only the producer thread may call this.
+         */
+        template<typename... ARGS>
+        void emplace(ARGS&&... args) {
+            auto index = push_count % SPSC_SEGMENT_SIZE;
+            if (index == SPSC_SEGMENT_SIZE - 1 && !tail_segment->next) {
+                // Link the next segment before publishing this value, so the consumer finds it once it gets here. It
+                // is linked before the value is constructed, so that a failed allocation leaves no value behind, and a
+                // constructor that throws leaves the segment linked for the next push.
+                tail_segment->next = create_segment();
+            }
+            tail_segment->values[index].emplace(std::forward<ARGS>(args)...);
+            if (index == SPSC_SEGMENT_SIZE - 1) {
+                tail_segment = tail_segment->next;
+            }
+
+            pushed.store(++push_count, std::memory_order_release);
+        }
+
+        /**
+         * Only the producer thread may push.
+         */
+        void push(T const& new_value) {
+            emplace(new_value);
+        }
+
+        void push(T&& new_value) {
+            emplace(std::move(new_value));
+        }
+
+        /**
+         * Returns true if the reference variable given is set to the value at the front of the queue (assuming the
+         * queue is not empty). Only the consumer thread may call this.
+         */
+        bool try_pop(T& return_value) {
+            if (pop_count == known_pushed) {
+                known_pushed = pushed.load(std::memory_order_acquire);
+                if (pop_count == known_pushed) return false;
+            }
+
+            auto index = pop_count % SPSC_SEGMENT_SIZE;
+            auto& slot = head_segment->values[index];
+            return_value = std::move(slot.get());
+            slot.destroy();
+            if (index == SPSC_SEGMENT_SIZE - 1) {
+                auto old_segment = head_segment;
+                head_segment = head_segment->next;
+                retire_segment(old_segment);
+            }
+
+            popped.store(++pop_count, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * Exact when called by either the producer or the consumer (as of when it returns, and until the other side
+         * pushes or pops). From any other thread it is only a snapshot that may already be out of date.
+         */
+        bool empty() const {
+            return popped.load(std::memory_order_acquire) == pushed.load(std::memory_order_acquire);
+        }
+    };
+}
+
+#endif //CCL_SPSC_QUEUE_HPP
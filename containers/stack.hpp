@@ -5,164 +5,200 @@
 #ifndef CCL_STACK_HPP
 #define CCL_STACK_HPP
 
+#include <algorithm>
 #include <utility>
 #include <memory>
 #include <atomic>
 #include <iostream>
 #include <thread>
+#include <chrono>
+#include <vector>
+
+#include "detail.hpp"
+#include "event_count.hpp"
+#include "flat_combiner.hpp"
+#include "stats.hpp"
+#include "storage.hpp"
 
 namespace ccl {
     /**
      * Concurrent stack. A simplified version of std::stack that allows for concurrent access. Implemented using
-     * flat combining, outlined here: http://www.cs.bgu.ac.il/~hendlerd/papers/flat-combining.pdf
+     * flat combining on top of ccl::flat_combiner, outlined here:
+     * http://www.cs.bgu.ac.il/~hendlerd/papers/flat-combining.pdf
+     *
+     * Since the combiner applies every request alone, the elements are kept in a plain sequential container chosen by
+     * the STORAGE policy: linked_storage (the default) keeps a linked list of nodes, recycling freed nodes so that
+     * most combining passes never have to call into the allocator, while contiguous_storage keeps the elements in
+     * a growable buffer.
+     *
+     * A combining pass first gathers every pending request. Each push is then paired with a pop of the same pass, the
+     * value going straight from one publication record to the other (elimination), and only the requests left over
+     * touch the storage. A push immediately followed by a pop is a valid ordering for a stack, so this is
+     * indistinguishable from applying them one at a time.
      */
-    template<typename T>
+    template<typename T, typename ALLOCATOR = std::allocator<T>, typename STORAGE = linked_storage>
     class stack {
     private:
-        struct node {
-            node* next;
-            T data;
-
-            node(T data_)
-                    : data(data_)
-                    , next(nullptr) { }
-        };
+        using storage_type = typename STORAGE::template stack<T, ALLOCATOR>;
 
-        enum class RequestType {
+        enum class operation {
             PUSH,
             POP,
-            RESPONSE_PUSH,
-            RESPONSE_POP,
-            RESPONSE_POP_FAIL,
-            NULL_RESPONSE
-        };
-
-        struct publication_record {
-            publication_record* next;
-            std::pair<RequestType, T> request;
-            unsigned int age;
-            std::atomic<bool> active;
+            PUSH_BULK,
+            POP_BULK
         };
 
-        node* head;
-
-        std::atomic<publication_record*> publication_head;
-        unsigned int combining_pass_counter;
-        std::atomic_flag combiner_lock;
+        static unsigned int const PUSHED = 1; // Event of a combining pass that added values to the storage
 
         /**
-         * Handles pending thread requests.
+         * Applies the requests of a combining pass, pairing up pushes and pops first.
          */
-        void combiner() {
-            ++combining_pass_counter;
-
-            // Traverse publication list from the head, updating age of non-null records and and processing requests
-            auto current_record = publication_head.load();
-            publication_record* previous_record = nullptr;
-            while (current_record) {
-                std::atomic_thread_fence(std::memory_order_acquire);
-                if (current_record->request.first != RequestType::NULL_RESPONSE) {
-                    // Update the age of all non-null requests and apply the methods they requested
-                    current_record->age = combining_pass_counter;
-
-                    if (current_record->request.first == RequestType::PUSH) {
-                        auto new_head = new node(current_record->request.second);
-                        new_head->next = head;
-                        head = new_head;
-
-                        current_record->request.first = RequestType::RESPONSE_PUSH;
-                    } else if (current_record->request.first == RequestType::POP) {
-                        if (head) {
-                            current_record->request.second = head->data;
-                            std::atomic_thread_fence(std::memory_order_release); // Make sure data is updated before
-                                                                                 // signalling a response.
-                            current_record->request.first = RequestType::RESPONSE_POP;
-
-                            auto old_head = head;
-                            head = head->next;
-                            std::atomic_thread_fence(std::memory_order_release);
-                            delete old_head;
-                        } else {
-                            current_record->request.first = RequestType::RESPONSE_POP_FAIL;
-                        }
+        struct operations {
+            struct request : combining_request {
+                operation requested;
+                bool succeeded; // Whether a pop got a value
+                detail::value_slot<T> value; // Value to push, or the value popped by the combiner, while there is one
+                std::vector<T>* batch; // Values of a bulk request, owned by the requesting thread
+                std::size_t batch_limit; // Most values a bulk pop may take
+                request* next_pending; // Only used by the combiner, links requests not yet eliminated
+            };
+
+            // Requests that could not be eliminated yet. At most one of the lists is non-empty at any time, since a new
+            // request is paired with the other list first.
+            request* pending_pushes;
+            request* pending_pops;
+
+            alignas(CACHE_LINE_SIZE) detail::owned_counter size; // Values in the storage, on a line of its own since
+                                                                 // size_approx reads it from any thread
+
+            alignas(CACHE_LINE_SIZE) event_count pushes; // Notified after a combining pass that added values, for
+                                                         // threads blocked in wait_pop
+
+            operations()
+                : pending_pushes(nullptr)
+                , pending_pops(nullptr) {
+            }
+
+            /**
+             * Answers a push and a pop with each other, handing the pushed value directly to the popping thread.
+             */
+            static void eliminate(request& push_request, request& pop_request) {
+                pop_request.value.emplace(std::move(push_request.value.get()));
+                push_request.value.destroy();
+
+                // Answering publishes the value to the popping thread, and keeps the pushing thread from reusing its
+                // request before the value was moved out of it
+                pop_request.succeeded = true;
+                pop_request.answer();
+                push_request.answer();
+            }
+
+            unsigned int apply(storage_type& storage, request& pending) {
+                if (pending.requested == operation::PUSH) {
+                    if (pending_pops) {
+                        auto pop_request = pending_pops;
+                        pending_pops = pending_pops->next_pending;
+                        eliminate(pending, *pop_request);
+                    } else {
+                        pending.next_pending = pending_pushes;
+                        pending_pushes = &pending;
+                    }
+                } else if (pending.requested == operation::POP) {
+                    if (pending_pushes) {
+                        auto push_request = pending_pushes;
+                        pending_pushes = pending_pushes->next_pending;
+                        eliminate(*push_request, pending);
+                    } else {
+                        pending.next_pending = pending_pops;
+                        pending_pops = &pending;
                     }
+                } else if (pending.requested == operation::PUSH_BULK) {
+                    // Bulk requests go straight to the stack, ordered before the leftover requests
+                    for (auto& value : *pending.batch) {
+                        storage.emplace(std::move(value));
+                        size.add(1);
+                    }
+                    pending.answer();
+                    return PUSHED;
                 } else {
-                    // Null requests are removed from the publication list if they become too old
-                    if (combining_pass_counter - current_record->age > MAXIMUM_RECORD_AGE) {
-                        if (!previous_record) {
-                            publication_head.store(current_record->next);
-                        } else {
-                            previous_record->next = current_record->next;
-                        }
-
-                        current_record->active.store(false);
+                    auto& batch = *pending.batch;
+                    while (batch.size() < pending.batch_limit && !storage.empty()) {
+                        batch.push_back(std::move(storage.top()));
+                        storage.pop();
+                        size.subtract(1);
                     }
+                    pending.answer();
                 }
+                return 0;
+            }
 
-                if (current_record->active) {
-                    // Record the previous record in case we need to remove a record
-                    previous_record = current_record;
+            /**
+             * Applies whatever was left over to the stack itself.
+             */
+            unsigned int finish_pass(storage_type& storage) {
+                unsigned int events = 0;
+                while (pending_pushes) {
+                    auto push_request = pending_pushes;
+                    pending_pushes = pending_pushes->next_pending;
+
+                    storage.emplace(std::move(push_request->value.get()));
+                    push_request->value.destroy();
+                    size.add(1);
+                    push_request->answer();
+                    events = PUSHED;
                 }
-                current_record = current_record->next;
+                while (pending_pops) {
+                    auto pop_request = pending_pops;
+                    pending_pops = pending_pops->next_pending;
+
+                    pop_request->succeeded = !storage.empty();
+                    if (pop_request->succeeded) {
+                        pop_request->value.emplace(std::move(storage.top()));
+                        storage.pop();
+                        size.subtract(1);
+                    }
+                    pop_request->answer();
+                }
+                return events;
             }
 
-            combiner_lock.clear();
-        };
-
-        /**
-         * Adds request to thread's
-         */
-        publication_record* add_request(std::pair<RequestType, T> request) {
-            static thread_local publication_record* thread_publication_record = nullptr;
-
-            // First check if thread has a publication record
-            if (thread_publication_record == nullptr) {
-                // Allocate a publication record for thread
-                thread_publication_record = new publication_record;
-                thread_publication_record->next = nullptr;
-                thread_publication_record->age = combining_pass_counter;
-                thread_publication_record->active = false;
+            void abandon_pass() {
+                pending_pushes = nullptr;
+                pending_pops = nullptr;
             }
 
-            // Update node with new values
-            // May want to be careful about this, since a combiner could read request.first before request.second is
-            // also updated on its cache?
-            //thread_publication_record->request = std::move(request);
-            thread_publication_record->request.second = std::move(request.second);
-            std::atomic_thread_fence(std::memory_order_release);
-            thread_publication_record->request.first = std::move(request.first);
-
-            // Make sure record is set to active
-            if(!thread_publication_record->active) {
-                thread_publication_record->active = true;
-
-                // Append as the new head
-                auto old_head = publication_head.load();
-                do {
-                    thread_publication_record->next = old_head;
-                } while(!publication_head.compare_exchange_weak(old_head, thread_publication_record));
+            void notify(unsigned int events) {
+                if (events & PUSHED) {
+                    pushes.notify_all();
+                }
             }
+        };
+
+        flat_combiner<storage_type, operations> combiner;
 
-            return thread_publication_record;
+        event_count& pushes() {
+            return combiner.operations().pushes;
         }
 
     public:
-        stack()
-            : head(nullptr)
-            , combiner_lock(ATOMIC_FLAG_INIT)
-            , combining_pass_counter(0) {
-            // Setup first thread's publication record
-            publication_head.store(nullptr);
-        }
-
-        ~stack() {
-            // Pop stack nodes until head becomes nullptr (reached the tail).
-            // Note: Both constructor and destructor can be assumed sequential, so thread-safety is not an issue.
-            while (head != nullptr) {
-                auto old_head = head;
-                head = head->next;
-                delete old_head;
-            }
+        explicit stack(ALLOCATOR const& allocator = ALLOCATOR())
+            : stack(combining_policy(), allocator) {
+        }
+
+        /**
+         * Constructs a stack whose combiner batches requests according to policy.
+         */
+        explicit stack(combining_policy const& policy_, ALLOCATOR const& allocator = ALLOCATOR())
+            : combiner(policy_, std::forward_as_tuple(allocator), std::forward_as_tuple()) {
+        }
+
+        // Keep the padding between the field groups intact when the stack itself is allocated with new
+        static void* operator new(std::size_t size) {
+            return detail::allocate_aligned(size, alignof(stack));
+        }
+
+        static void operator delete(void* pointer) {
+            detail::free_aligned(pointer);
         }
 
         // Disallow copying a stack
@@ -174,28 +210,43 @@ namespace ccl {
          *  is not empty).
          */
         bool try_pop(T& return_value) {
-            std::pair<RequestType, T> request = std::make_pair(RequestType::POP, T());
-            auto record = add_request(request);
+            auto& pending = combiner.thread_request();
+            pending.requested = operation::POP;
+            pending.succeeded = false;
+            combiner.submit(pending);
+
+            if (pending.succeeded) {
+                return_value = std::move(pending.value.get());
+                pending.value.destroy();
+            }
+            return pending.succeeded;
+        }
 
-            // Node is prepared, spin waiting on a response or if the lock is open
+        /**
+         * Pops the value at the top of the stack, blocking until there is one. A blocked thread sleeps until another
+         * thread pushes, so waiting on an empty stack costs no CPU time.
+         */
+        void wait_pop(T& return_value) {
             while (true) {
-                if (record->request.first == RequestType::RESPONSE_POP) {
-                    // Request processed; acknowledge and return
-                    record->request.first = RequestType::NULL_RESPONSE;
-                    std::atomic_thread_fence(std::memory_order_acquire);
-                    return_value = std::move(record->request.second);
-                    return true;
-                } else if (record->request.first == RequestType::RESPONSE_POP_FAIL) {
-                    record->request.first = RequestType::NULL_RESPONSE;
-                    return false;
-                } else if (!record->active) {
-                    // Combiner decided that record is too old, update it and add request again to publication list
-                    record = add_request(request);
-                } else if (!combiner_lock.test_and_set()) {
-                    // Got the lock
-                    combiner();
-                } else {
-                    std::this_thread::yield();
+                // Registering before trying to pop means that a push landing in between still wakes this thread
+                unsigned int key;
+                if (pushes().prepare_wait(key, [&]() { return try_pop(return_value); })) return;
+                pushes().wait(key);
+            }
+        }
+
+        /**
+         * Same as wait_pop, but gives up once the timeout has passed. Returns false if nothing could be popped in time.
+         */
+        template<typename REP, typename PERIOD>
+        bool wait_pop_for(T& return_value, std::chrono::duration<REP, PERIOD> const& timeout) {
+            auto deadline = std::chrono::steady_clock::now() + timeout;
+            while (true) {
+                unsigned int key;
+                if (pushes().prepare_wait(key, [&]() { return try_pop(return_value); })) return true;
+                if (!pushes().wait_until(key, deadline)) {
+                    // Timed out, but a value may still have been pushed right before then
+                    return try_pop(return_value);
                 }
             }
         }
@@ -203,38 +254,98 @@ namespace ccl {
         /**
          * Pushes a new value onto the stack.
          */
-        void push(T new_value) {
-            std::pair<RequestType, T> request = std::make_pair(RequestType::PUSH, std::move(new_value));
-            auto record = add_request(request);
+        void push(T const& new_value) {
+            emplace(new_value);
+        }
 
-            // Node is prepared, spin waiting on a response or if the lock is open
-            while (true) {
-                if (record->request.first == RequestType::RESPONSE_PUSH) {
-                    // Request processed; acknowledge and return
-                    record->request.first = RequestType::NULL_RESPONSE;
-                    return;
-                } else if (!record->active) {
-                    // Combiner decided that record is too old, update it and add request again to publication list
-                    record = add_request(std::move(request));
-                } else if (!combiner_lock.test_and_set()) {
-                    // Got the lock
-                    combiner();
-                } else {
-                    // For programs where the thread count accessing this data structure is higher than the core count
-                    // available, this prevents wasteful empty CAS loops waiting for a lock that is fighting to be
-                    // scheduled by the OS.
-                    std::this_thread::yield();
-                }
+        void push(T&& new_value) {
+            emplace(std::move(new_value));
+        }
+
+        /**
+         * Pushes a value constructed from args onto the stack. The value is constructed right in the thread's
+         * publication record, from where the combiner moves it into the stack, so T doesn't have to be copyable.
+         */
+        template<typename... ARGS>
+        void emplace(ARGS&&... args) {
+            auto& pending = combiner.thread_request();
+            pending.requested = operation::PUSH;
+            pending.value.emplace(std::forward<ARGS>(args)...);
+            try {
+                combiner.submit(pending);
+            } catch (...) {
+                // A push that failed leaves its value in the request
+                pending.value.destroy();
+                throw;
             }
         }
 
+        /**
+         * Pushes the values in [first, last) onto the stack in order, so the last value ends up on top. The whole batch
+         * is published as a single request, so it costs one combining pass instead of one per value and is never
+         * interleaved with other threads' pushes.
+         */
+        template<typename ITERATOR>
+        void push_bulk(ITERATOR first, ITERATOR last) {
+            std::vector<T> batch(first, last);
+            if (batch.empty()) return;
+
+            auto& pending = combiner.thread_request();
+            pending.requested = operation::PUSH_BULK;
+            pending.batch = &batch;
+            combiner.submit(pending);
+        }
+
+        /**
+         * Pops up to maximum values from the top of the stack in a single request, writing them to output in the order
+         * they were popped. Returns how many values were popped, which is zero if the stack was empty.
+         */
+        template<typename OUTPUT_ITERATOR>
+        std::size_t try_pop_n(OUTPUT_ITERATOR output, std::size_t maximum) {
+            if (maximum == 0) return 0;
+
+            // Reserve up front so that the combiner rarely has to allocate on this thread's behalf
+            std::vector<T> batch;
+            batch.reserve(std::min(maximum, MAXIMUM_BULK_RESERVE));
+
+            auto& pending = combiner.thread_request();
+            pending.requested = operation::POP_BULK;
+            pending.batch = &batch;
+            pending.batch_limit = maximum;
+            combiner.submit(pending);
+
+            for (auto& value : batch) {
+                *output++ = std::move(value);
+            }
+            return batch.size();
+        }
+
+        /**
+         * Returns how many values the stack holds, as of the last request a combiner applied. The combiner keeps count
+         * as it goes (eliminated pairs never count), so this reads a single atomic without submitting a request or
+         * touching the storage. Requests being applied meanwhile may change it by the time it is used.
+         */
+        std::size_t size_approx() const {
+            return combiner.operations().size.load();
+        }
+
         /**
          * Returns whether the stack is empty. It should be noted that another thread may have already added an
          * entry to the stack by the time the returned boolean is used.
          */
-        bool empty() {
-            return !head;
+        bool empty() const {
+            return size_approx() == 0;
+        }
+
+#ifdef CCL_ENABLE_STATS
+        /**
+         * Returns the combining statistics gathered so far, added up over all threads. Only available when compiled
+         * with CCL_ENABLE_STATS.
+         */
+        combining_stats stats() const {
+            return combiner.stats();
         }
+#endif
     };
 }
 
@@ -0,0 +1,385 @@
+//
+// Optional contention and combining statistics of the containers, compiled in with CCL_ENABLE_STATS.
+//
+
+#ifndef CCL_STATS_HPP
+#define CCL_STATS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "detail.hpp"
+
+/**
+ * Runs the statement only when statistics are enabled. Everything the containers record goes through this (or lives
+ * in members that only exist with CCL_ENABLE_STATS), so a build without it doesn't pay for a single instruction.
+ */
+#ifdef CCL_ENABLE_STATS
+#define CCL_STATS(statement) statement
+#else
+#define CCL_STATS(statement)
+#endif
+
+namespace ccl {
+    std::size_t const STATS_SHARDS = 16; // Copies of each counter, spread over the threads to keep them uncontended
+    std::size_t const HISTOGRAM_BUCKETS = 32; // Power of two ranges a histogram tells apart
+
+    /**
+     * Distribution of a recorded quantity. Bucket 0 counts zeros and bucket i the values in [2^(i-1), 2^i), the last
+     * bucket also taking everything larger.
+     */
+    struct histogram {
+        std::array<std::uint64_t, HISTOGRAM_BUCKETS> buckets;
+        std::uint64_t sum; // Of all recorded values
+
+        histogram()
+            : buckets()
+            , sum(0) {
+        }
+
+        /**
+         * Returns the bucket counting value.
+         */
+        static std::size_t bucket_of(std::uint64_t value) {
+            auto index = static_cast<std::size_t>(detail::bit_width(value));
+            return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+        }
+
+        void record(std::uint64_t value) {
+            ++buckets[bucket_of(value)];
+            sum += value;
+        }
+
+        std::uint64_t count() const {
+            std::uint64_t total = 0;
+            for (auto bucket : buckets) {
+                total += bucket;
+            }
+            return total;
+        }
+
+        double mean() const {
+            auto total = count();
+            return total ? static_cast<double>(sum) / total : 0.0;
+        }
+
+        /**
+         * Returns an upper bound on the value below which the given fraction (0 to 1) of the values lie, which is the
+         * largest value of the bucket that fraction falls into.
+         */
+        std::uint64_t percentile(double fraction) const {
+            auto target = static_cast<std::uint64_t>(fraction * count());
+            std::uint64_t seen = 0;
+            for (std::size_t index = 0; index < HISTOGRAM_BUCKETS; ++index) {
+                seen += buckets[index];
+                if (seen > target || index == HISTOGRAM_BUCKETS - 1) {
+                    return index ? (std::uint64_t(1) << index) - 1 : 0;
+                }
+            }
+            return 0;
+        }
+    };
+
+    /**
+     * How the flat combining of a ccl::stack or ccl::queue went.
+     */
+    struct combining_stats {
+        std::uint64_t lock_acquisitions; // Times a thread took the combiner lock
+        std::uint64_t passes; // Combining passes over the publication list
+        std::uint64_t requests; // Requests answered by the combiners
+        std::uint64_t records_aged_out; // Idle records removed from the publication list for being too old
+        std::uint64_t spins; // Times a waiting thread spun on its request
+        std::uint64_t yields; // Times a waiting thread yielded its core
+        std::uint64_t parks; // Times a waiting thread parked until the next combining pass
+        histogram requests_per_pass;
+        histogram publication_list_length; // Records visited by each pass
+
+        combining_stats()
+            : lock_acquisitions(0)
+            , passes(0)
+            , requests(0)
+            , records_aged_out(0)
+            , spins(0)
+            , yields(0)
+            , parks(0) {
+        }
+    };
+
+    /**
+     * Use of a ccl::data_pool.
+     */
+    struct pool_stats {
+        std::uint64_t pushes; // Values pushed, bulk pushes counting each value
+        std::uint64_t pops; // Values popped
+        std::uint64_t empty_pops; // Pops that found no value
+        std::uint64_t compactions; // Compactions that unlinked at least one pool
+        std::uint64_t pools_freed; // Pools unlinked by compactions and clears
+        std::size_t pool_count; // Pools on the list when the statistics were taken
+        std::size_t capacity; // Nodes in those pools
+        histogram words_scanned; // Bitmap words each claim looked at before it was done
+
+        pool_stats()
+            : pushes(0)
+            , pops(0)
+            , empty_pops(0)
+            , compactions(0)
+            , pools_freed(0)
+            , pool_count(0)
+            , capacity(0) {
+        }
+    };
+
+    /**
+     * How contended a lock stripe (or all of them together) was.
+     */
+    struct lock_stats {
+        std::uint64_t acquisitions;
+        std::uint64_t contended; // Acquisitions that found the lock taken and had to wait
+        std::uint64_t wait_nanoseconds; // Spent waiting by the contended acquisitions
+
+        lock_stats()
+            : acquisitions(0)
+            , contended(0)
+            , wait_nanoseconds(0) {
+        }
+    };
+
+    /**
+     * Lookups and lock contention of a ccl::map or ccl::flat_map. Stripes whose lock is acquired far more often than
+     * the others hold hot keys.
+     */
+    struct map_stats {
+        std::uint64_t lookups;
+        std::uint64_t optimistic_retries; // Lock-free lookups a writer interfered with (ccl::map only)
+        std::uint64_t locked_lookups; // Lookups that gave up on being lock-free and took the lock (ccl::map only)
+        lock_stats locks; // All stripes together
+        std::vector<lock_stats> stripes; // Indexed by stripe
+        histogram bucket_heights; // Tree height of every bucket (ccl::map only)
+        histogram probe_lengths; // Groups visited by every probe sequence (ccl::flat_map only)
+
+        map_stats()
+            : lookups(0)
+            , optimistic_retries(0)
+            , locked_lookups(0) {
+        }
+    };
+
+    namespace detail {
+        inline void count(std::atomic<std::uint64_t>& counter, std::uint64_t amount = 1) {
+            counter.fetch_add(amount, std::memory_order_relaxed);
+        }
+
+        /**
+         * The recording side of a histogram.
+         */
+        class histogram_counter {
+        private:
+            std::atomic<std::uint64_t> buckets[HISTOGRAM_BUCKETS];
+            std::atomic<std::uint64_t> sum;
+
+        public:
+            histogram_counter()
+                : sum(0) {
+                for (auto& bucket : buckets) {
+                    bucket.store(0, std::memory_order_relaxed);
+                }
+            }
+
+            void record(std::uint64_t value) {
+                count(buckets[histogram::bucket_of(value)]);
+                count(sum, value);
+            }
+
+            void add_to(histogram& snapshot) const {
+                for (std::size_t index = 0; index < HISTOGRAM_BUCKETS; ++index) {
+                    snapshot.buckets[index] += buckets[index].load(std::memory_order_relaxed);
+                }
+                snapshot.sum += sum.load(std::memory_order_relaxed);
+            }
+        };
+
+        /**
+         * STATS_SHARDS copies of a set of counters, each on its own cache line(s). A thread always records into the
+         * same copy, picked from its seed, and reading the statistics adds all of the copies up.
+         */
+        template<typename SHARD>
+        class sharded {
+        private:
+            struct alignas(CACHE_LINE_SIZE) padded_shard : SHARD, cache_aligned_allocation {
+            };
+
+            std::unique_ptr<padded_shard[]> shards;
+
+        public:
+            sharded()
+                : shards(new padded_shard[STATS_SHARDS]) {
+            }
+
+            SHARD& local() {
+                return shards[scale_seed(thread_seed(), STATS_SHARDS)];
+            }
+
+            SHARD const& operator[](std::size_t index) const {
+                return shards[index];
+            }
+        };
+
+        /**
+         * Per stripe lock statistics. Without CCL_ENABLE_STATS it only locks.
+         */
+#ifdef CCL_ENABLE_STATS
+        class lock_counters {
+        private:
+            std::atomic<std::uint64_t> acquisitions;
+            std::atomic<std::uint64_t> contended;
+            std::atomic<std::uint64_t> wait_nanoseconds;
+
+        public:
+            lock_counters()
+                : acquisitions(0)
+                , contended(0)
+                , wait_nanoseconds(0) {
+            }
+
+            /**
+             * Locks the mutex, timing the wait if it is already taken. Returns the mutex for a guard to adopt.
+             */
+            std::mutex& lock(std::mutex& mutex) {
+                if (!mutex.try_lock()) {
+                    auto begin = std::chrono::steady_clock::now();
+                    mutex.lock();
+                    auto waited = std::chrono::steady_clock::now() - begin;
+                    count(contended);
+                    count(wait_nanoseconds, static_cast<std::uint64_t>(
+                            std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count()));
+                }
+                count(acquisitions);
+                return mutex;
+            }
+
+            void add_to(lock_stats& snapshot) const {
+                snapshot.acquisitions += acquisitions.load(std::memory_order_relaxed);
+                snapshot.contended += contended.load(std::memory_order_relaxed);
+                snapshot.wait_nanoseconds += wait_nanoseconds.load(std::memory_order_relaxed);
+            }
+        };
+#else
+        class lock_counters {
+        public:
+            std::mutex& lock(std::mutex& mutex) {
+                mutex.lock();
+                return mutex;
+            }
+        };
+#endif
+
+        /**
+         * What a flat combining container records, kept per shard.
+         */
+        struct combining_counters {
+            std::atomic<std::uint64_t> lock_acquisitions;
+            std::atomic<std::uint64_t> passes;
+            std::atomic<std::uint64_t> requests;
+            std::atomic<std::uint64_t> records_aged_out;
+            std::atomic<std::uint64_t> spins;
+            std::atomic<std::uint64_t> yields;
+            std::atomic<std::uint64_t> parks;
+            histogram_counter requests_per_pass;
+            histogram_counter publication_list_length;
+
+            combining_counters()
+                : lock_acquisitions(0)
+                , passes(0)
+                , requests(0)
+                , records_aged_out(0)
+                , spins(0)
+                , yields(0)
+                , parks(0) {
+            }
+
+            void add_to(combining_stats& snapshot) const {
+                snapshot.lock_acquisitions += lock_acquisitions.load(std::memory_order_relaxed);
+                snapshot.passes += passes.load(std::memory_order_relaxed);
+                snapshot.requests += requests.load(std::memory_order_relaxed);
+                snapshot.records_aged_out += records_aged_out.load(std::memory_order_relaxed);
+                snapshot.spins += spins.load(std::memory_order_relaxed);
+                snapshot.yields += yields.load(std::memory_order_relaxed);
+                snapshot.parks += parks.load(std::memory_order_relaxed);
+                requests_per_pass.add_to(snapshot.requests_per_pass);
+                publication_list_length.add_to(snapshot.publication_list_length);
+            }
+        };
+
+        /**
+         * What a data pool records, kept per shard.
+         */
+        struct pool_counters {
+            std::atomic<std::uint64_t> pushes;
+            std::atomic<std::uint64_t> pops;
+            std::atomic<std::uint64_t> empty_pops;
+            std::atomic<std::uint64_t> compactions;
+            std::atomic<std::uint64_t> pools_freed;
+            histogram_counter words_scanned;
+
+            pool_counters()
+                : pushes(0)
+                , pops(0)
+                , empty_pops(0)
+                , compactions(0)
+                , pools_freed(0) {
+            }
+
+            void add_to(pool_stats& snapshot) const {
+                snapshot.pushes += pushes.load(std::memory_order_relaxed);
+                snapshot.pops += pops.load(std::memory_order_relaxed);
+                snapshot.empty_pops += empty_pops.load(std::memory_order_relaxed);
+                snapshot.compactions += compactions.load(std::memory_order_relaxed);
+                snapshot.pools_freed += pools_freed.load(std::memory_order_relaxed);
+                words_scanned.add_to(snapshot.words_scanned);
+            }
+        };
+
+        /**
+         * What a map records besides its stripes' locks, kept per shard.
+         */
+        struct map_counters {
+            std::atomic<std::uint64_t> lookups;
+            std::atomic<std::uint64_t> optimistic_retries;
+            std::atomic<std::uint64_t> locked_lookups;
+            histogram_counter probe_lengths;
+
+            map_counters()
+                : lookups(0)
+                , optimistic_retries(0)
+                , locked_lookups(0) {
+            }
+
+            void add_to(map_stats& snapshot) const {
+                snapshot.lookups += lookups.load(std::memory_order_relaxed);
+                snapshot.optimistic_retries += optimistic_retries.load(std::memory_order_relaxed);
+                snapshot.locked_lookups += locked_lookups.load(std::memory_order_relaxed);
+                probe_lengths.add_to(snapshot.probe_lengths);
+            }
+        };
+
+        /**
+         * Adds up every shard of the counters into a fresh snapshot.
+         */
+        template<typename SNAPSHOT, typename SHARD>
+        SNAPSHOT collect(sharded<SHARD> const& counters) {
+            SNAPSHOT snapshot;
+            for (std::size_t index = 0; index < STATS_SHARDS; ++index) {
+                counters[index].add_to(snapshot);
+            }
+            return snapshot;
+        }
+    }
+}
+
+#endif //CCL_STATS_HPP
@@ -0,0 +1,561 @@
+//
+// Sequential (single-threaded) containers that the flat combining containers apply requests to.
+//
+
+#ifndef CCL_STORAGE_HPP
+#define CCL_STORAGE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "node_pool.hpp"
+
+namespace ccl {
+    std::size_t const CHUNK_SIZE = 256; // Elements held by each segment of a contiguous queue
+    std::size_t const MAXIMUM_BULK_RESERVE = 1024; // Values a bulk pop reserves room for before publishing its request
+    std::size_t const RING_INITIAL_CAPACITY = 16; // Elements an unbounded ring queue has room for before it first grows
+    std::size_t const HEAP_ARITY = 4; // Children of every element of a priority queue's heap
+
+    /**
+     * The sequential containers only ever run inside a combining pass (or a constructor/destructor), so none of them
+     * are thread-safe on their own. Values are constructed in place by emplace, and the combiner moves the next value
+     * out (top() or front()) before it pop()s it, so T only has to be move constructible.
+     *
+     * The queues are constructed with the most elements they will ever hold, or 0 if there is no limit. The
+     * combiner enforces the limit itself, it is only a hint for how much room to set aside up front.
+     */
+    namespace sequential {
+        /**
+         * Singly linked list where the head is the top of the stack.
+         */
+        template<typename T, typename ALLOCATOR>
+        class linked_stack {
+        private:
+            struct node {
+                node* next;
+                T data;
+
+                template<typename... ARGS>
+                node(ARGS&&... args)
+                        : next(nullptr)
+                        , data(std::forward<ARGS>(args)...) { }
+            };
+
+            node_pool<node, ALLOCATOR> nodes;
+            node* head;
+
+        public:
+            explicit linked_stack(ALLOCATOR const& allocator)
+                : nodes(allocator)
+                , head(nullptr) {
+            }
+
+            ~linked_stack() {
+                while (head) {
+                    auto old_head = head;
+                    head = head->next;
+                    nodes.destroy(old_head);
+                }
+            }
+
+            template<typename... ARGS>
+            void emplace(ARGS&&... args) {
+                auto new_head = nodes.create(std::forward<ARGS>(args)...);
+                new_head->next = head;
+                head = new_head;
+            }
+
+            /**
+             * The stack must not be empty.
+             */
+            T& top() {
+                return head->data;
+            }
+
+            void pop() {
+                auto old_head = head;
+                head = head->next;
+                nodes.destroy(old_head);
+            }
+
+            bool empty() const {
+                return !head;
+            }
+        };
+
+        /**
+         * Singly linked list, pushing at the tail and popping from the head.
+         */
+        template<typename T, typename ALLOCATOR>
+        class linked_queue {
+        private:
+            struct node {
+                node* next;
+                T data;
+
+                template<typename... ARGS>
+                node(ARGS&&... args)
+                        : next(nullptr)
+                        , data(std::forward<ARGS>(args)...) { }
+            };
+
+            node_pool<node, ALLOCATOR> nodes;
+            node* head;
+            node* tail;
+
+        public:
+            linked_queue(ALLOCATOR const& allocator, std::size_t /* capacity */)
+                : nodes(allocator)
+                , head(nullptr)
+                , tail(nullptr) {
+            }
+
+            ~linked_queue() {
+                while (head) {
+                    auto old_head = head;
+                    head = head->next;
+                    nodes.destroy(old_head);
+                }
+            }
+
+            template<typename... ARGS>
+            void emplace(ARGS&&... args) {
+                auto new_tail = nodes.create(std::forward<ARGS>(args)...);
+                if (tail)
+                    tail->next = new_tail;
+                tail = new_tail;
+                if (!head)
+                    head = tail;
+            }
+
+            /**
+             * The queue must not be empty.
+             */
+            T& front() {
+                return head->data;
+            }
+
+            void pop() {
+                auto old_head = head;
+                head = head->next;
+                if (!head)
+                    tail = nullptr; // Popped the last node, which tail still points to
+                nodes.destroy(old_head);
+            }
+
+            bool empty() const {
+                return !head;
+            }
+        };
+
+        /**
+         * Stack backed by a single growable buffer, so the top is almost always already in cache and elements carry no
+         * link pointer.
+         */
+        template<typename T, typename ALLOCATOR>
+        class array_stack {
+        private:
+            std::vector<T, ALLOCATOR> buffer;
+
+        public:
+            explicit array_stack(ALLOCATOR const& allocator)
+                : buffer(allocator) {
+            }
+
+            template<typename... ARGS>
+            void emplace(ARGS&&... args) {
+                buffer.emplace_back(std::forward<ARGS>(args)...);
+            }
+
+            /**
+             * The stack must not be empty.
+             */
+            T& top() {
+                return buffer.back();
+            }
+
+            void pop() {
+                buffer.pop_back();
+            }
+
+            bool empty() const {
+                return buffer.empty();
+            }
+        };
+
+        /**
+         * Queue backed by a list of fixed size segments (like a deque). Elements are contiguous within a segment, and
+         * the last drained segment is kept as a spare, so a queue in a steady state doesn't allocate.
+         */
+        template<typename T, typename ALLOCATOR>
+        class chunked_queue {
+        private:
+            struct chunk {
+                chunk* next;
+                std::size_t begin; // First element still in the chunk
+                std::size_t end; // One past the last element pushed
+                typename std::aligned_storage<sizeof(T), alignof(T)>::type elements[CHUNK_SIZE];
+
+                chunk()
+                    : next(nullptr)
+                    , begin(0)
+                    , end(0) {
+                }
+
+                T* at(std::size_t index) {
+                    return reinterpret_cast<T*>(&elements[index]);
+                }
+            };
+
+            using allocator_type = typename std::allocator_traits<ALLOCATOR>::template rebind_alloc<chunk>;
+            using allocator_traits = std::allocator_traits<allocator_type>;
+
+            allocator_type allocator;
+            chunk* head;
+            chunk* tail;
+            chunk* spare;
+
+            chunk* create_chunk() {
+                chunk* new_chunk = spare;
+                if (new_chunk) {
+                    spare = nullptr;
+                } else {
+                    new_chunk = allocator_traits::allocate(allocator, 1);
+                }
+                ::new (static_cast<void*>(new_chunk)) chunk;
+                return new_chunk;
+            }
+
+            void free_chunk(chunk* old_chunk) {
+                if (!spare) {
+                    spare = old_chunk;
+                } else {
+                    allocator_traits::deallocate(allocator, old_chunk, 1);
+                }
+            }
+
+        public:
+            chunked_queue(ALLOCATOR const& allocator_, std::size_t /* capacity */)
+                : allocator(allocator_)
+                , head(nullptr)
+                , tail(nullptr)
+                , spare(nullptr) {
+            }
+
+            ~chunked_queue() {
+                while (head) {
+                    for (auto index = head->begin; index < head->end; ++index) {
+                        head->at(index)->~T();
+                    }
+                    auto old_head = head;
+                    head = head->next;
+                    allocator_traits::deallocate(allocator, old_head, 1);
+                }
+                if (spare) {
+                    allocator_traits::deallocate(allocator, spare, 1);
+                }
+            }
+
+            chunked_queue(const chunked_queue &other) = delete;
+            chunked_queue &operator=(const chunked_queue &other) = delete;
+
+            template<typename... ARGS>
+            void emplace(ARGS&&... args) {
+                if (!tail || tail->end == CHUNK_SIZE) {
+                    auto new_chunk = create_chunk();
+                    if (tail)
+                        tail->next = new_chunk;
+                    tail = new_chunk;
+                    if (!head)
+                        head = tail;
+                }
+
+                ::new (static_cast<void*>(tail->at(tail->end))) T(std::forward<ARGS>(args)...);
+                ++tail->end;
+            }
+
+            /**
+             * The queue must not be empty.
+             */
+            T& front() {
+                return *head->at(head->begin);
+            }
+
+            void pop() {
+                head->at(head->begin)->~T();
+
+                if (++head->begin == head->end) {
+                    if (head == tail) {
+                        // Drained the only chunk, rewind it instead of allocating a new one
+                        head->begin = 0;
+                        head->end = 0;
+                    } else if (head->begin == CHUNK_SIZE) {
+                        auto old_head = head;
+                        head = head->next;
+                        free_chunk(old_head);
+                    }
+                }
+            }
+
+            bool empty() const {
+                return !head || head->begin == head->end;
+            }
+        };
+
+        /**
+         * Queue backed by a single circular buffer. Given a capacity the whole buffer is allocated up front and never
+         * grows, so a bounded queue doesn't allocate at all after construction. Otherwise it doubles whenever it is
+         * full.
+         */
+        template<typename T, typename ALLOCATOR>
+        class ring_queue {
+        private:
+            using allocator_type = typename std::allocator_traits<ALLOCATOR>::template rebind_alloc<T>;
+            using allocator_traits = std::allocator_traits<allocator_type>;
+
+            allocator_type allocator;
+            T* elements;
+            std::size_t capacity;
+            std::size_t head; // Position of the front element
+            std::size_t count;
+
+            std::size_t position(std::size_t offset) const {
+                auto index = head + offset;
+                return index < capacity ? index : index - capacity;
+            }
+
+            void grow() {
+                auto new_capacity = capacity * 2;
+                auto new_elements = allocator_traits::allocate(allocator, new_capacity);
+                for (std::size_t offset = 0; offset < count; ++offset) {
+                    auto element = elements + position(offset);
+                    allocator_traits::construct(allocator, new_elements + offset, std::move(*element));
+                    allocator_traits::destroy(allocator, element);
+                }
+                allocator_traits::deallocate(allocator, elements, capacity);
+
+                elements = new_elements;
+                capacity = new_capacity;
+                head = 0;
+            }
+
+        public:
+            ring_queue(ALLOCATOR const& allocator_, std::size_t capacity_)
+                : allocator(allocator_)
+                , elements(nullptr)
+                , capacity(capacity_ ? capacity_ : RING_INITIAL_CAPACITY)
+                , head(0)
+                , count(0) {
+                elements = allocator_traits::allocate(allocator, capacity);
+            }
+
+            ~ring_queue() {
+                for (std::size_t offset = 0; offset < count; ++offset) {
+                    allocator_traits::destroy(allocator, elements + position(offset));
+                }
+                allocator_traits::deallocate(allocator, elements, capacity);
+            }
+
+            ring_queue(const ring_queue &other) = delete;
+            ring_queue &operator=(const ring_queue &other) = delete;
+
+            template<typename... ARGS>
+            void emplace(ARGS&&... args) {
+                if (count == capacity) {
+                    grow();
+                }
+
+                allocator_traits::construct(allocator, elements + position(count), std::forward<ARGS>(args)...);
+                ++count;
+            }
+
+            /**
+             * The queue must not be empty.
+             */
+            T& front() {
+                return elements[head];
+            }
+
+            void pop() {
+                allocator_traits::destroy(allocator, elements + head);
+                head = position(1);
+                --count;
+            }
+
+            bool empty() const {
+                return count == 0;
+            }
+        };
+
+        /**
+         * Heap where every element has HEAP_ARITY children, kept in a single growable buffer, with the greatest
+         * element (by COMPARE, like std::priority_queue) on top. The wider nodes make the heap shallower than a binary
+         * one, and the children of an element share a cache line or two, so popping touches fewer lines.
+         *
+         * Besides emplace, which restores the heap right away, elements can be appended as they come with
+         * emplace_unordered and the heap restored once for the whole batch with restore().
+         */
+        template<typename T, typename COMPARE, typename ALLOCATOR>
+        class d_ary_heap {
+        private:
+            std::vector<T, ALLOCATOR> elements;
+            COMPARE compare;
+            std::size_t ordered; // Elements at the front that are known to form a heap
+
+            /**
+             * Moves the element at index up to where it belongs.
+             */
+            void sift_up(std::size_t index) {
+                if (index == 0 || !compare(elements[(index - 1) / HEAP_ARITY], elements[index])) return;
+
+                T moving(std::move(elements[index]));
+                do {
+                    auto parent = (index - 1) / HEAP_ARITY;
+                    elements[index] = std::move(elements[parent]);
+                    index = parent;
+                } while (index > 0 && compare(elements[(index - 1) / HEAP_ARITY], moving));
+                elements[index] = std::move(moving);
+            }
+
+            /**
+             * Moves the element at index down to where it belongs, among the first count elements.
+             */
+            void sift_down(std::size_t index, std::size_t count) {
+                T moving(std::move(elements[index]));
+                while (true) {
+                    auto first_child = index * HEAP_ARITY + 1;
+                    if (first_child >= count) break;
+
+                    auto largest = first_child;
+                    auto last_child = std::min(first_child + HEAP_ARITY, count);
+                    for (auto child = first_child + 1; child < last_child; ++child) {
+                        if (compare(elements[largest], elements[child])) largest = child;
+                    }
+                    if (!compare(moving, elements[largest])) break;
+
+                    elements[index] = std::move(elements[largest]);
+                    index = largest;
+                }
+                elements[index] = std::move(moving);
+            }
+
+        public:
+            d_ary_heap(COMPARE const& compare_, ALLOCATOR const& allocator)
+                : elements(allocator)
+                , compare(compare_)
+                , ordered(0) {
+            }
+
+            template<typename... ARGS>
+            void emplace(ARGS&&... args) {
+                restore();
+                elements.emplace_back(std::forward<ARGS>(args)...);
+                sift_up(elements.size() - 1);
+                ordered = elements.size();
+            }
+
+            /**
+             * Appends an element without restoring the heap, which restore() has to do before top() or pop().
+             */
+            template<typename... ARGS>
+            void emplace_unordered(ARGS&&... args) {
+                elements.emplace_back(std::forward<ARGS>(args)...);
+            }
+
+            /**
+             * Makes a heap out of the elements appended since the last restore. Sifting each of them up is cheap
+             * (on average a constant amount of steps), unless the batch is larger than the heap it is added to, in
+             * which case the whole buffer is rebuilt bottom-up in linear time instead.
+             */
+            void restore() {
+                auto count = elements.size();
+                if (ordered == count) return;
+
+                if (count - ordered > ordered) {
+                    // Starting from past the last element that has children, which leaves nothing out
+                    for (auto index = count / HEAP_ARITY + 1; index-- > 0;) {
+                        sift_down(index, count);
+                    }
+                } else {
+                    for (auto index = ordered; index < count; ++index) {
+                        sift_up(index);
+                    }
+                }
+                ordered = count;
+            }
+
+            /**
+             * The heap must not be empty, nor have unordered elements.
+             */
+            T& top() {
+                return elements.front();
+            }
+
+            void pop() {
+                if (elements.size() > 1) {
+                    elements.front() = std::move(elements.back());
+                    elements.pop_back();
+                    sift_down(0, elements.size());
+                } else {
+                    elements.pop_back();
+                }
+                ordered = elements.size();
+            }
+
+            /**
+             * Whether value is at least as great as every element, so that it could be popped before any of them. The
+             * heap must not have unordered elements.
+             */
+            bool below(T const& value) const {
+                return elements.empty() || !compare(value, elements.front());
+            }
+
+            bool empty() const {
+                return elements.empty();
+            }
+        };
+    }
+
+    /**
+     * Storage policy for ccl::stack and ccl::queue keeping each element in its own node (the default).
+     */
+    struct linked_storage {
+        template<typename T, typename ALLOCATOR>
+        using stack = sequential::linked_stack<T, ALLOCATOR>;
+
+        template<typename T, typename ALLOCATOR>
+        using queue = sequential::linked_queue<T, ALLOCATOR>;
+    };
+
+    /**
+     * Storage policy for ccl::stack and ccl::queue keeping elements in contiguous memory. Gives better locality and
+     * less memory per element than linked_storage, especially for small T.
+     */
+    struct contiguous_storage {
+        template<typename T, typename ALLOCATOR>
+        using stack = sequential::array_stack<T, ALLOCATOR>;
+
+        template<typename T, typename ALLOCATOR>
+        using queue = sequential::chunked_queue<T, ALLOCATOR>;
+    };
+
+    /**
+     * Storage policy for ccl::queue keeping the elements in a single circular buffer, which a bounded queue allocates
+     * in full when it is constructed, so that pushing and popping never allocate. Stacks keep a growable buffer, like
+     * with contiguous_storage.
+     */
+    struct ring_storage {
+        template<typename T, typename ALLOCATOR>
+        using stack = sequential::array_stack<T, ALLOCATOR>;
+
+        template<typename T, typename ALLOCATOR>
+        using queue = sequential::ring_queue<T, ALLOCATOR>;
+    };
+}
+
+#endif //CCL_STORAGE_HPP
@@ -0,0 +1,285 @@
+//
+// Work-stealing deque, and a scheduler spreading tasks over one deque per worker thread.
+//  - Based on "Dynamic Circular Work-Stealing Deque" by D. Chase and Y. Lev, with the memory orderings of "Correct
+//    and Efficient Work-Stealing for Weak Memory Models" by N. M. Le, A. Pop, A. Cohen and F. Zappa Nardelli.
+//
+
+#ifndef CCL_WORK_STEALING_DEQUE_HPP
+#define CCL_WORK_STEALING_DEQUE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "detail.hpp"
+#include "mpsc_queue.hpp"
+#include "reclaim.hpp"
+
+namespace ccl {
+    std::size_t const DEQUE_INITIAL_CAPACITY = 64; // Values a work-stealing deque has room for before it first grows
+    std::size_t const INBOX_TRANSFER_LIMIT = 32; // Submitted tasks a worker moves into its deque at once
+
+    /**
+     * Deque owned by a single thread, which pushes and pops at the bottom (LIFO) like a ccl::stack, while any other
+     * thread may steal from the top (FIFO). The owner's push and pop don't use any read-modify-write operation unless
+     * they race with a thief over the last value, so a worker mostly working on its own tasks never contends on a
+     * lock or a combiner.
+     *
+     * The values are kept in a circular array that the owner doubles when it fills up. Thieves may still be reading
+     * the old array, so it is retired through ccl::reclaim rather than freed. A thief only ever reads the one array,
+     * so it protects it with a hazard pointer instead of pinning itself: a thief preempted mid-steal then holds back
+     * nothing but that array, rather than everything the other containers retire meanwhile.
+     *
+     * NOTE: A thief reads a value before it knows whether it won it, and the owner may overwrite that slot at the same
+     * time, so T must be trivially copyable (a task pointer or a small handle). Larger types are better pushed by
+     * pointer, since every slot is a std::atomic<T>.
+     */
+    template<typename T>
+    class work_stealing_deque {
+    private:
+        static_assert(std::is_trivially_copyable<T>::value, "Values of a work-stealing deque must be trivially "
+                                                            "copyable, push pointers to anything else");
+
+        struct buffer {
+            std::size_t mask; // Capacity - 1, the capacity being a power of two
+            std::unique_ptr<std::atomic<T>[]> slots;
+
+            explicit buffer(std::size_t capacity)
+                : mask(capacity - 1)
+                , slots(new std::atomic<T>[capacity]) {
+            }
+
+            std::atomic<T>& operator[](std::int64_t index) {
+                return slots[static_cast<std::size_t>(index) & mask];
+            }
+
+            std::int64_t capacity() const {
+                return static_cast<std::int64_t>(mask + 1);
+            }
+        };
+
+        alignas(CACHE_LINE_SIZE) std::atomic<std::int64_t> top; // Next value to steal, only ever advanced by a CAS
+
+        alignas(CACHE_LINE_SIZE) std::atomic<std::int64_t> bottom; // Next slot to push to, only written by the owner
+        std::atomic<buffer*> values;
+
+        /**
+         * Replaces the array with one twice the size, holding the values in [first, last).
+         */
+        buffer* grow(buffer* old_values, std::int64_t first, std::int64_t last) {
+            auto new_values = new buffer(static_cast<std::size_t>(old_values->capacity()) * 2);
+            for (auto index = first; index < last; ++index) {
+                (*new_values)[index].store((*old_values)[index].load(std::memory_order_relaxed),
+                                           std::memory_order_relaxed);
+            }
+            values.store(new_values, std::memory_order_release);
+            reclaim::retire_hazard(old_values);
+            return new_values;
+        }
+
+    public:
+        explicit work_stealing_deque(std::size_t capacity = DEQUE_INITIAL_CAPACITY)
+            : top(0)
+            , bottom(0)
+            , values(nullptr) {
+            std::size_t rounded = 1;
+            while (rounded < capacity) {
+                rounded *= 2;
+            }
+            values.store(new buffer(rounded));
+        }
+
+        ~work_stealing_deque() {
+            delete values.load();
+        }
+
+        // Keep the owner's and the thieves' fields on their own cache lines when the deque is allocated with new
+        static void* operator new(std::size_t size) {
+            return detail::allocate_aligned(size, alignof(work_stealing_deque));
+        }
+
+        static void operator delete(void* pointer) {
+            detail::free_aligned(pointer);
+        }
+
+        // Disallow copying a deque
+        work_stealing_deque(const work_stealing_deque &other) = delete;
+        work_stealing_deque &operator=(const work_stealing_deque &other) = delete;
+
+        /**
+         * Pushes a value at the bottom. Only the owner may call this.
+         */
+        void push(T const& new_value) {
+            auto current_bottom = bottom.load(std::memory_order_relaxed);
+            auto current_top = top.load(std::memory_order_acquire);
+            auto current_values = values.load(std::memory_order_relaxed);
+            if (current_bottom - current_top > current_values->capacity() - 1) {
+                current_values = grow(current_values, current_top, current_bottom);
+            }
+
+            (*current_values)[current_bottom].store(new_value, std::memory_order_relaxed);
+            // Publishes the value before the new bottom, for thieves that see the new bottom
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom.store(current_bottom + 1, std::memory_order_relaxed);
+        }
+
+        /**
+         * Returns true if the reference variable given is set to the value at the bottom (the one pushed last).
+         * Only the owner may call this.
+         */
+        bool try_pop(T& return_value) {
+            auto current_bottom = bottom.load(std::memory_order_relaxed) - 1;
+            auto current_values = values.load(std::memory_order_relaxed);
+            bottom.store(current_bottom, std::memory_order_relaxed);
+            // Either a thief sees the lowered bottom, or the owner sees the thief's top
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto current_top = top.load(std::memory_order_relaxed);
+
+            if (current_top > current_bottom) {
+                // Empty, restore the bottom
+                bottom.store(current_bottom + 1, std::memory_order_relaxed);
+                return false;
+            }
+
+            auto popped = (*current_values)[current_bottom].load(std::memory_order_relaxed);
+            if (current_top == current_bottom) {
+                // Last value, race the thieves for it
+                bool won = top.compare_exchange_strong(current_top, current_top + 1, std::memory_order_seq_cst,
+                                                       std::memory_order_relaxed);
+                bottom.store(current_bottom + 1, std::memory_order_relaxed);
+                if (!won) return false;
+            }
+
+            return_value = popped;
+            return true;
+        }
+
+        /**
+         * Returns true if the reference variable given is set to the value at the top (the oldest one). Fails if the
+         * deque is empty or another thread took the top value first. Any thread other than the owner may call this.
+         */
+        bool try_steal(T& return_value) {
+            auto current_top = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto current_bottom = bottom.load(std::memory_order_acquire);
+            if (current_top >= current_bottom) return false;
+
+            reclaim::hazard_pointer hazard; // The owner may replace the array while this thread reads from it
+            auto current_values = hazard.protect(values);
+            auto stolen = (*current_values)[current_top].load(std::memory_order_relaxed);
+            if (!top.compare_exchange_strong(current_top, current_top + 1, std::memory_order_seq_cst,
+                                             std::memory_order_relaxed)) {
+                return false;
+            }
+
+            return_value = stolen;
+            return true;
+        }
+
+        /**
+         * Exact on the owner while no thief is stealing, otherwise only a snapshot.
+         */
+        bool empty() const {
+            auto current_top = top.load(std::memory_order_acquire);
+            return bottom.load(std::memory_order_acquire) <= current_top;
+        }
+    };
+
+    /**
+     * Spreads tasks over a fixed number of workers, each with a work_stealing_deque of its own. A worker pushes the
+     * tasks it spawns to its own deque and pops from it first, and only when it runs dry takes the tasks submitted to
+     * it from other threads, then steals from the other workers, starting at a random one. There is no lock or counter
+     * shared by all of the workers, so the per-worker queues scale with the amount of cores.
+     *
+     * Worker i is whichever thread passes i to push() and try_pop(), and each index may only be used by one thread at
+     * a time. Threads that are not workers hand tasks in through submit(), which goes to an mpsc_queue inbox of the
+     * workers in turn. The scheduler doesn't run any threads itself, nor does it park idle workers: a worker whose
+     * try_pop fails should back off (yield or sleep) before trying again.
+     */
+    template<typename T>
+    class work_stealing_scheduler {
+    private:
+        struct alignas(CACHE_LINE_SIZE) worker : detail::cache_aligned_allocation {
+            work_stealing_deque<T> deque;
+            mpsc_queue<T> inbox; // Tasks submitted by other threads, only popped by the worker itself
+            std::uint64_t random; // State of the worker's xorshift generator, for picking victims
+        };
+
+        std::vector<std::unique_ptr<worker>> workers;
+        alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> next_submission; // Worker the next submit() goes to
+
+        /**
+         * Takes the oldest submitted task, moving some of those behind it into the deque where thieves can reach
+         * them.
+         */
+        bool take_submitted(worker& self, T& return_value) {
+            if (!self.inbox.try_pop(return_value)) return false;
+
+            T submitted;
+            for (std::size_t moved = 0; moved < INBOX_TRANSFER_LIMIT && self.inbox.try_pop(submitted); ++moved) {
+                self.deque.push(submitted);
+            }
+            return true;
+        }
+
+    public:
+        explicit work_stealing_scheduler(std::size_t worker_count = detail::hardware_threads())
+            : next_submission(0) {
+            for (std::size_t index = 0; index < std::max<std::size_t>(worker_count, 1); ++index) {
+                workers.emplace_back(new worker());
+                workers.back()->random = detail::mix_hash(index + 1) | 1;
+            }
+        }
+
+        // Disallow copying a scheduler
+        work_stealing_scheduler(const work_stealing_scheduler &other) = delete;
+        work_stealing_scheduler &operator=(const work_stealing_scheduler &other) = delete;
+
+        std::size_t worker_count() const {
+            return workers.size();
+        }
+
+        /**
+         * Pushes a task to the deque of worker self. Only the thread acting as that worker may call this.
+         */
+        void push(std::size_t self, T const& task) {
+            workers[self]->deque.push(task);
+        }
+
+        /**
+         * Hands a task to the workers from any thread.
+         */
+        void submit(T const& task) {
+            auto target = next_submission.fetch_add(1, std::memory_order_relaxed) % workers.size();
+            workers[target]->inbox.push(task);
+        }
+
+        /**
+         * Returns true if the reference variable given is set to a task for worker self: the last one it pushed,
+         * else the oldest submitted to it, else one stolen from another worker. Only the thread acting as that worker
+         * may call this.
+         */
+        bool try_pop(std::size_t self, T& return_value) {
+            auto& own = *workers[self];
+            if (own.deque.try_pop(return_value) || take_submitted(own, return_value)) return true;
+
+            own.random ^= own.random << 13;
+            own.random ^= own.random >> 7;
+            own.random ^= own.random << 17;
+            auto count = workers.size();
+            auto first = detail::scale_seed(own.random, count);
+            for (std::size_t offset = 0; offset < count; ++offset) {
+                auto victim = (first + offset) % count;
+                if (victim != self && workers[victim]->deque.try_steal(return_value)) return true;
+            }
+            return false;
+        }
+    };
+}
+
+#endif //CCL_WORK_STEALING_DEQUE_HPP